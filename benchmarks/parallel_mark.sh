@@ -0,0 +1,15 @@
+#!/bin/sh
+# Runs parallel_mark.fei with 1, 2, 4 and 8 marking threads and prints the
+# fastest full mark of each run next to its speedup over one thread.
+# Usage: benchmarks/parallel_mark.sh [path to cfei]
+
+CFEI=${1:-cfei}
+SCRIPT=$(dirname "$0")/parallel_mark.fei
+
+printf "%-8s %12s %9s\n" threads "mark (ms)" speedup
+for threads in 1 2 4 8
+do
+	time=$("$CFEI" --gc-threads $threads "$SCRIPT") || exit 1
+	if [ $threads -eq 1 ]; then base=$time; fi
+	printf "%-8s %12s %8.2fx\n" $threads $time $(awk "BEGIN { print $base / $time }")
+done
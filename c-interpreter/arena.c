@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+#include "virtualm.h"
+
+// the memory of a block follows its header
+#define BLOCK_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_MIN_SIZE - 1) & ~(size_t)(ARENA_MIN_SIZE - 1))
+
+static uint8_t* blockMemory(ArenaBlock* block)
+{
+	return (uint8_t*)block + BLOCK_HEADER_SIZE;
+}
+
+// index of the smallest power of two that holds size, 0 for 16 bytes
+static int sizeClassOf(size_t size)
+{
+	int sizeClass = 0;
+	while (((size_t)ARENA_MIN_SIZE << sizeClass) < size) sizeClass++;
+	return sizeClass;
+}
+
+void initArena(Arena* arena)
+{
+	arena->blocks = NULL;
+	arena->last = NULL;
+
+	for (int i = 0; i < ARENA_SIZE_CLASSES; i++)
+	{
+		arena->freeLists[i] = NULL;
+	}
+}
+
+void freeArena(Arena* arena)
+{
+	ArenaBlock* block = arena->blocks;
+	while (block != NULL)
+	{
+		ArenaBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+
+	initArena(arena);
+}
+
+static ArenaBlock* newBlock(Arena* arena, size_t size)
+{
+	if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+
+	// compiler scratch memory is not in the heap, but a full collection may still give the system some back
+	ArenaBlock* block = (ArenaBlock*)malloc(BLOCK_HEADER_SIZE + size);
+	if (block == NULL)
+	{
+		collectGarbage();
+		block = (ArenaBlock*)malloc(BLOCK_HEADER_SIZE + size);
+
+		// interpret reports it like a failed heap allocation, abortCompile frees the blocks already taken
+		if (block == NULL) outOfMemory(OUT_OF_MEMORY_SYSTEM);
+	}
+
+	block->size = size;
+	block->used = 0;
+	block->next = arena->blocks;
+	arena->blocks = block;
+	return block;
+}
+
+void* arenaAllocate(Arena* arena, size_t size)
+{
+	int sizeClass = sizeClassOf(size);
+
+	void* result = arena->freeLists[sizeClass];
+	if (result != NULL)
+	{
+		arena->freeLists[sizeClass] = *(void**)result;
+		return result;
+	}
+
+	size = (size_t)ARENA_MIN_SIZE << sizeClass;
+	ArenaBlock* block = arena->blocks;
+	if (block == NULL || block->size - block->used < size) block = newBlock(arena, size);
+
+	result = blockMemory(block) + block->used;
+	block->used += size;
+	arena->last = result;
+	return result;
+}
+
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize)
+{
+	if (pointer != NULL && pointer == arena->last)
+	{
+		// the last allocation ends where the block's free space starts, extend it if the rest fits
+		ArenaBlock* block = arena->blocks;
+		size_t start = (uint8_t*)pointer - blockMemory(block);
+		size_t size = (size_t)ARENA_MIN_SIZE << sizeClassOf(newSize);
+		if (size <= block->size - start)
+		{
+			block->used = start + size;
+			return pointer;
+		}
+	}
+
+	void* result = arenaAllocate(arena, newSize);
+	if (pointer != NULL)
+	{
+		memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+		arenaFree(arena, pointer, oldSize);
+	}
+	return result;
+}
+
+void arenaFree(Arena* arena, void* pointer, size_t size)
+{
+	if (pointer == NULL) return;
+
+	int sizeClass = sizeClassOf(size);
+	if (pointer == arena->last)		// bumped back, the next allocation takes the space
+	{
+		arena->blocks->used -= (size_t)ARENA_MIN_SIZE << sizeClass;
+		arena->last = NULL;
+		return;
+	}
+
+	*(void**)pointer = arena->freeLists[sizeClass];
+	arena->freeLists[sizeClass] = pointer;
+}
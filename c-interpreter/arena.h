@@ -0,0 +1,47 @@
+// arena, the scratch memory of one compilation
+// -> the compiler's locals, upvalues, loops, jump lists and switch cases come from it instead of reallocate, so they are
+//	not counted in vm.bytesAllocated and cannot start a collection in the middle of a declaration
+// -> allocations are bumped out of 32KB blocks, freeArena gives every block back at once when compile ends
+// -> sizes are rounded up to powers of two, arrays given back with arenaFree are kept on a list for their size and
+//	reused by the next function compiled, so a long script needs no more memory than its deepest nesting
+// -> growing the last allocation extends it in place
+
+#ifndef arena_h
+#define arena_h
+
+#include "common.h"
+
+#define ARENA_BLOCK_SIZE (32 * 1024)		// larger allocations get a block of their own
+#define ARENA_MIN_SIZE 16					// also the alignment of every allocation
+#define ARENA_SIZE_CLASSES 32				// 16 bytes, 32 bytes ... 32GB
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock* next;		// the blocks filled before this one
+	size_t size;					// bytes after the header
+	size_t used;
+} ArenaBlock;
+
+typedef struct
+{
+	ArenaBlock* blocks;				// the block allocations come from, the older ones follow
+	void* last;						// the last allocation, grown in place
+	void* freeLists[ARENA_SIZE_CLASSES];		// allocations given back, linked through their first bytes
+} Arena;
+
+#define ARENA_ALLOCATE(arena, type, count) \
+	(type*)arenaAllocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+	(type*)arenaGrow(arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+#define ARENA_FREE_ARRAY(arena, type, pointer, oldCount) \
+	arenaFree(arena, pointer, sizeof(type) * (oldCount))
+
+void initArena(Arena* arena);
+void freeArena(Arena* arena);		// the arena is empty and can be used again
+void* arenaAllocate(Arena* arena, size_t size);
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);		// pointer may be NULL
+void arenaFree(Arena* arena, void* pointer, size_t size);		// size as allocated or grown to, pointer may be NULL
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -18,9 +19,15 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
 	if (chunk->capacity < chunk->count + 1)				// check if chunk is full
 	{
 		int oldCapacity = chunk->capacity;
-		chunk->capacity = GROW_CAPACITY(oldCapacity);	// get size of new capacity
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);	// reallocate memory and grow array
-		chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+		int capacity = GROW_CAPACITY(oldCapacity);	// get size of new capacity
+
+		// an allocation can fail with an out of memory error, the chunk is only changed once both arrays have grown
+		int* lines = ALLOCATE(int, capacity);
+		chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, capacity);	// reallocate memory and grow array
+		if (oldCapacity > 0) memcpy(lines, chunk->lines, sizeof(int) * oldCapacity);
+		FREE_ARRAY(int, chunk->lines, oldCapacity);
+		chunk->lines = lines;
+		chunk->capacity = capacity;
 	}
 		
 	chunk->code[chunk->count] = byte;	// code is an array, [] is just the index number
@@ -38,6 +45,182 @@ void freeChunk(Chunk* chunk)
 	initChunk(chunk);
 }
 
+// opcode and operands, used by the passes that decode finished chunks
+int instructionLength(Chunk* chunk, int offset)
+{
+	switch (chunk->code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_CALL:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_GET_SUPER:
+		return 2;
+
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_LOOP:
+	case OP_LOOP_IF_FALSE:
+	case OP_LOOP_IF_TRUE:
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		return 3;
+
+	case OP_FOR_RANGE_INIT:
+	case OP_FOR_RANGE:
+	case OP_FOR_ITER:
+		return 4;
+
+	// function, argument count and jump offset
+	case OP_CHECK_FUNCTION:
+	case OP_CHECK_METHOD:
+		return 5;
+
+	// an isLocal and index byte for every upvalue the function captures
+	case OP_CLOSURE:
+	{
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+		return 2 + 2 * function->upvalueCount;
+	}
+
+	default:
+		return 1;
+	}
+}
+
+// every jump ends with its 16 bit offset, counted from the end of the instruction
+bool isJump(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+	case OP_LOOP:
+	case OP_LOOP_IF_FALSE:
+	case OP_LOOP_IF_TRUE:
+	case OP_FOR_RANGE_INIT:
+	case OP_FOR_RANGE:
+	case OP_FOR_ITER:
+	case OP_CHECK_FUNCTION:
+	case OP_CHECK_METHOD:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool isBackward(uint8_t op)
+{
+	return op == OP_LOOP || op == OP_LOOP_IF_FALSE || op == OP_LOOP_IF_TRUE || op == OP_FOR_RANGE;
+}
+
+bool fallsThrough(uint8_t op)
+{
+	return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+bool hasSlotOperand(uint8_t op)
+{
+	return op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_FOR_RANGE_INIT || op == OP_FOR_RANGE || op == OP_FOR_ITER;
+}
+
+int jumpTarget(Chunk* chunk, int offset)
+{
+	uint8_t op = chunk->code[offset];
+	int end = offset + instructionLength(chunk, offset);
+	int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+	return isBackward(op) ? end - distance : end + distance;
+}
+
+// values the instruction at offset takes off the stack and puts on it, what it only reads or stores to a slot is not counted
+void stackEffect(Chunk* chunk, int offset, int* pops, int* pushes)
+{
+	*pops = 0;
+	*pushes = 0;
+
+	switch (chunk->code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		*pushes = 1;
+		break;
+
+	case OP_POP:
+	case OP_PRINT:
+	case OP_DEFINE_GLOBAL:
+	case OP_CLOSE_UPVALUE:
+	case OP_METHOD:
+	case OP_INHERIT:
+	case OP_LOOP_IF_FALSE:
+	case OP_LOOP_IF_TRUE:
+	case OP_RETURN:
+		*pops = 1;
+		break;
+
+	case OP_NEGATE:
+	case OP_NOT:
+	case OP_GET_PROPERTY:
+		*pops = 1;
+		*pushes = 1;
+		break;
+
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+		*pops = 2;
+		*pushes = 1;
+		break;
+
+	case OP_SWITCH_EQUAL:		// the switch value stays for the next case
+		*pops = 1;
+		*pushes = 1;
+		break;
+
+	case OP_CALL:
+		*pops = chunk->code[offset + 1] + 1;
+		*pushes = 1;
+		break;
+
+	case OP_INVOKE:
+		*pops = chunk->code[offset + 2] + 1;
+		*pushes = 1;
+		break;
+
+	case OP_SUPER_INVOKE:
+		*pops = chunk->code[offset + 2] + 2;
+		*pushes = 1;
+		break;
+
+	default:		// jumps, stores and the loop instructions, which work on the slots in place
+		break;
+	}
+}
+
 int addConstant(Chunk* chunk, Value value)
 {
 	push(value);			// garbage collection
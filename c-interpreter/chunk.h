@@ -53,12 +53,18 @@ typedef enum
 
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,		// takes a 16-bit operand
+	OP_JUMP_IF_TRUE,		// written by the peephole pass in place of OP_NOT and OP_JUMP_IF_FALSE
 	OP_CALL,
 
 	OP_LOOP, 
 	OP_LOOP_IF_FALSE,		// repeat until
 	OP_LOOP_IF_TRUE,	// do while
 
+	// for in loops
+	OP_FOR_RANGE_INIT,	// checks the range bounds, skips the loop if the range is empty
+	OP_FOR_RANGE,		// increments the counter, compares and loops back, all in one dispatch
+	OP_FOR_ITER,		// fetches the next element of a sequence or exits the loop
+
 	OP_CLOSURE,
 	OP_CLASS,
 	OP_METHOD,
@@ -68,6 +74,10 @@ typedef enum
 	OP_GET_SUPER,		// for superclasses
 	OP_SUPER_INVOKE,
 
+	// guards of inlined calls, see inliner.h, jump to the call they replace unless it would run the function expected
+	OP_CHECK_FUNCTION,		// the callee is a closure of the function
+	OP_CHECK_METHOD,		// the receiver is an instance whose class has the function as the method of that name
+
 	OP_RETURN,		// means return from current function
 } OpCode;			// basically a typdef call to an enum
 					// in C, you cannot have enums called simply by their rvalue 'string' names, use typdef to define them
@@ -91,6 +101,15 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);	// add to array
 														// when we write a byte of code to the chunk, need to know source line it came from
 // add explicit function to add constats
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(Chunk* chunk, int offset);		// bytes of the instruction at offset, its opcode and operands
+void stackEffect(Chunk* chunk, int offset, int* pops, int* pushes);
+
+// opcode tables of the passes that decode finished chunks, so a new jump or slot instruction is added in one place
+bool isJump(uint8_t op);			// ends with a 16 bit offset, counted from the end of the instruction
+bool isBackward(uint8_t op);		// the offset is subtracted
+bool fallsThrough(uint8_t op);		// the next instruction can run after it
+bool hasSlotOperand(uint8_t op);	// the operand is a stack slot of the frame
+int jumpTarget(Chunk* chunk, int offset);		// offset the jump at offset goes to
 
 
 /* the top two are simply wrapper around bytes */
@@ -1,3 +1,5 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>			// to display errors
 #include <string.h>
@@ -5,7 +7,11 @@
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
-#include "memory.h"			// for switch statements and marking the roots
+#include "memory.h"			// for marking the roots
+#include "arena.h"
+#include "peephole.h"
+#include "optimizer.h"
+#include "inliner.h"
 
 /*	A compiler has two jobs really:
 	- it parses the user's source code
@@ -79,6 +85,41 @@ typedef struct
 	int index;			// matches the index of the local variable in ObjClosure
 } Upvalue;	
 
+/*	constant folding
+-> literals record themselves as the last expression, binary() and unary() replace an operation on such loads with
+	a load of its result, so 60 * 60 * 24 is compiled to one constant
+-> the record only holds while its code is the last one emitted, a jump patched to land after it ends the record, the
+	right side of 'and' and 'or' is not the value of the whole expression
+-> results of arithmetic are numbers, x * 1, x / 1 and x - 0 are dropped for those, not for other values which the vm
+	stops with an error, and not x + 0, which turns -0 into 0
+-> operations the vm stops with an error, like adding a number to a string, are left to the vm
+*/
+typedef struct
+{
+	Chunk* chunk;			// chunk of the last expression, NULL once a jump lands after it
+	int start;				// offset of its code, known for constants
+	int end;				// the expression is the last one while the chunk's count is still end
+	bool isConstant;		// its code is a single load of value
+	bool isNumber;			// it produces a number, unless the vm stops with an error first
+	Value value;
+} LastExpression;
+
+// code that can never run, compiled for its errors and dropped with everything it added to the compiler
+typedef struct
+{
+	int start;
+	int constantCount;
+	int breakCount;
+	int continuePatchCount;
+} DeadCode;
+
+typedef struct
+{
+	int continueTarget;		// offset continue statements loop back to, -1 if they jump forward
+	int breakStart;			// the loop's break jumps are those from this index of breakJumps
+	int scopeDepth;			// locals declared deeper are inside the loop's body
+} Loop;
+
 typedef enum
 {
 	TYPE_FUNCTION,
@@ -96,19 +137,28 @@ typedef struct Compiler		// give name to struct itself(the name comes after), on
 	ObjFunction* function;
 	FunctionType type;
 
-	Local locals[UINT8_COUNT];		// array to store locals, ordered in the order of declarations
+	// the arrays below grow in the compile arena, up to UINT8_COUNT locals and upvalues
+	Local* locals;					// array to store locals, ordered in the order of declarations
 	int localCount;					// tracks amount of locals in a scope
-	Upvalue upvalues[UINT8_COUNT];
+	int localCapacity;
+	Upvalue* upvalues;				// as many as function->upvalueCount
+	int upvalueCapacity;
 	int scopeDepth;					// number of scopes/blocks surrounding the code
 
 	// for loop breaks and continues, loop enclosing
 	int loopCountTop;
-	int* continueJumps;
-	int continueJumpCapacity;			// only for continue jumpbs
+	Loop* loops;
+	int loopCapacity;
 
-	// for patching all break statements
-	int breakPatchJumps[UINT8_COUNT][UINT8_COUNT];
-	int breakJumpCounts[UINT8_COUNT];
+	// range loops test at the bottom, their continue statements jump forward and are patched at the end of the loop
+	int* continuePatchJumps;
+	int continuePatchCount;
+	int continuePatchCapacity;
+
+	// break jumps of every loop being compiled, innermost last, patched and dropped when their loop ends
+	int* breakJumps;
+	int breakCount;
+	int breakCapacity;
 
 } Compiler;
 
@@ -127,6 +177,13 @@ ClassCompiler* currentClass = NULL;
 
 Compiler* current = NULL;
 
+static LastExpression lastExpression;
+
+// scratch memory of the running compile, freed at its end
+static Arena arena;
+static InlineTargets inlineTargets;		// global functions and methods compiled so far, kept in the arena
+static bool isOptimizing = false;		// set once by main, before anything is compiled
+
 static Chunk* currentChunk()
 {
 	return &current->function->chunk;
@@ -306,6 +363,7 @@ static void emitReturn()
 static uint8_t makeConstant(Value value)
 {
 	int constant = addConstant(currentChunk(), value);
+	WRITE_BARRIER(current->function, value);		// function may have been promoted while compiling
 	if (constant > UINT8_MAX)
 	{
 		error("Too many constants in one chunk.");
@@ -322,6 +380,8 @@ static void emitConstant(Value value)		// for constant emit the opcode, then the
 
 static void patchJump(int offset)
 {
+	lastExpression.chunk = NULL;		// code jumps in after the last expression, it is not alone anymore
+
 	// - 2 to adjust for the jump offset itself
 	int jump = currentChunk()->count - offset - 2;
 
@@ -335,6 +395,147 @@ static void patchJump(int offset)
 	currentChunk()->code[offset + 1] = jump & 0xff;			// only AND
 }
 
+/*		constant folding, see LastExpression		*/
+
+static void recordExpression(int start, bool isConstant, bool isNumber, Value value)
+{
+	lastExpression.chunk = currentChunk();
+	lastExpression.start = start;
+	lastExpression.end = currentChunk()->count;
+	lastExpression.isConstant = isConstant;
+	lastExpression.isNumber = isNumber;
+	lastExpression.value = value;
+}
+
+// the last expression compiled is a constant load starting at start, with nothing emitted after it
+static bool isConstantFrom(int start)
+{
+	return lastExpression.chunk == currentChunk() && lastExpression.end == currentChunk()->count &&
+		lastExpression.isConstant && lastExpression.start == start;
+}
+
+// the code emitted last produces a number
+static bool endsWithNumber()
+{
+	return lastExpression.chunk == currentChunk() && lastExpression.end == currentChunk()->count && lastExpression.isNumber;
+}
+
+// null and booleans have opcodes of their own
+static void emitLoad(Value value)
+{
+	if (IS_NULL(value)) emitByte(OP_NULL);
+	else if (IS_BOOL(value)) emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	else emitConstant(value);
+}
+
+static void emitFolded(int start, Value value)
+{
+	emitLoad(value);
+	recordExpression(start, true, IS_NUMBER(value), value);
+}
+
+// removes a constant load emitted at start and the code after it, its constant goes too if it was the last one added
+static void removeLoad(int start)
+{
+	Chunk* chunk = currentChunk();
+	if (chunk->code[start] == OP_CONSTANT && chunk->code[start + 1] == chunk->constants.count - 1)
+	{
+		chunk->constants.count--;
+	}
+
+	chunk->count = start;
+}
+
+// the vm converts both operands of % to int, out of range values and a zero divisor are left to it
+static bool foldModulo(double a, double b, Value* result)
+{
+	if (!(a >= INT_MIN && a <= INT_MAX && b >= INT_MIN && b <= INT_MAX)) return false;		// NaN fails too
+
+	int dividend = (int)a;
+	int divisor = (int)b;
+	if (divisor == 0 || (dividend == INT_MIN && divisor == -1)) return false;
+
+	*result = NUMBER_VAL(dividend % divisor);
+	return true;
+}
+
+// the result of a binary operator on two constants, false if the vm would stop with an error
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+	switch (operatorType)
+	{
+	case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+	case TOKEN_BANG_EQUAL: *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+	default: break;
+	}
+
+	if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b))
+	{
+		ObjString* first = AS_STRING(a);			// both are in the constant table, safe if the GC runs here
+		ObjString* second = AS_STRING(b);
+		int length = first->length + second->length;
+		char* chars = ALLOCATE(char, length + 1);
+		memcpy(chars, first->chars, first->length);
+		memcpy(chars + first->length, second->chars, second->length);
+		chars[length] = '\0';
+
+		*result = OBJ_VAL(internString(takeString(chars, length)));		// interned like the literals
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+
+	// the comparisons are the same expressions as the opcodes binary() emits, NaN included
+	switch (operatorType)
+	{
+	case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+	case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+	case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+	case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+
+	case TOKEN_PLUS: *result = NUMBER_VAL(x + y); return true;
+	case TOKEN_MINUS: *result = NUMBER_VAL(x - y); return true;
+	case TOKEN_STAR: *result = NUMBER_VAL(x * y); return true;
+	case TOKEN_SLASH: *result = NUMBER_VAL(x / y); return true;
+	case TOKEN_MODULO: return foldModulo(x, y, result);
+	default:
+		return false;
+	}
+}
+
+// operators that give back their left operand when it is a number and the right one is b
+static bool isIdentity(TokenType operatorType, double b)
+{
+	switch (operatorType)
+	{
+	case TOKEN_STAR:
+	case TOKEN_SLASH: return b == 1;
+	case TOKEN_MINUS: return b == 0 && !signbit(b);		// -0 - 0 is -0, but -0 - -0 is 0
+	default:
+		return false;
+	}
+}
+
+static void beginDeadCode(DeadCode* dead)
+{
+	dead->start = currentChunk()->count;
+	dead->constantCount = currentChunk()->constants.count;
+	dead->breakCount = current->breakCount;
+	dead->continuePatchCount = current->continuePatchCount;
+}
+
+// jumps out of the dead code, by break and continue, are dropped with it
+static void endDeadCode(DeadCode* dead)
+{
+	currentChunk()->count = dead->start;
+	currentChunk()->constants.count = dead->constantCount;
+	current->breakCount = dead->breakCount;
+	current->continuePatchCount = dead->continuePatchCount;
+	lastExpression.chunk = NULL;
+}
+
 // initialize the compiler
 static void initCompiler(Compiler* compiler, FunctionType type)
 {
@@ -351,10 +552,17 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 	if (type != TYPE_SCRIPT)
 	{
 		current->function->name = copyString(parser.previous.start, parser.previous.length);		// function name handled here
+		WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
 	}
 
+	compiler->locals = ARENA_ALLOCATE(&arena, Local, 8);
+	compiler->localCapacity = 8;
+	compiler->upvalues = NULL;
+	compiler->upvalueCapacity = 0;
+
 	// compiler implicitly claims slot zero for local variables
 	Local* local = &current->locals[current->localCount++];
+	local->depth = 0;			// the locals come from the arena, a function compiled before may have left anything here
 	local->isCaptured = false;
 	
 	// for this tags 
@@ -371,11 +579,16 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 
 	// for loop scopes, for break and continue statements
 	compiler->loopCountTop = -1;
-	compiler->continueJumpCapacity = 4;
-	compiler->continueJumps = ALLOCATE(int, 4);
+	compiler->loops = NULL;
+	compiler->loopCapacity = 0;
+
+	compiler->continuePatchJumps = NULL;
+	compiler->continuePatchCount = 0;
+	compiler->continuePatchCapacity = 0;
 
-	// use memset to initialize array to 0
-	memset(compiler->breakJumpCounts, 0, UINT8_COUNT * sizeof(compiler->breakJumpCounts[0]));
+	compiler->breakJumps = NULL;
+	compiler->breakCount = 0;
+	compiler->breakCapacity = 0;
 }
 
 static ObjFunction* endCompiler()
@@ -383,8 +596,22 @@ static ObjFunction* endCompiler()
 	emitReturn();
 	ObjFunction* function = current->function;
 
-	FREE(int, current->continueJumps);
+	if (!parser.hadError)
+	{
+		optimizeChunk(currentChunk(), &arena);
+		if (isOptimizing)
+		{
+			bool isChanged = inlineCalls(function, &inlineTargets, &arena);
+			if (optimizeFunction(function, &arena)) isChanged = true;
+			if (isChanged) optimizeChunk(currentChunk(), &arena);		// the rewrites leave jumps to jumps behind
+		}
+	}
 
+	// given back for the next function, inner functions have already returned theirs, the upvalues once the closure is emitted
+	ARENA_FREE_ARRAY(&arena, int, current->breakJumps, current->breakCapacity);
+	ARENA_FREE_ARRAY(&arena, int, current->continuePatchJumps, current->continuePatchCapacity);
+	ARENA_FREE_ARRAY(&arena, Loop, current->loops, current->loopCapacity);
+	ARENA_FREE_ARRAY(&arena, Local, current->locals, current->localCapacity);
 
 	// for debugging
 #ifdef DEBUG_PRINT_CODE
@@ -429,34 +656,73 @@ static void endScope()
 static void beginLoopScope()
 {
 	current->loopCountTop++;
+
+	if (current->loopCountTop == current->loopCapacity)
+	{
+		int oldCapacity = current->loopCapacity;
+		current->loopCapacity = GROW_CAPACITY(oldCapacity);
+		current->loops = ARENA_GROW_ARRAY(&arena, Loop, current->loops, oldCapacity, current->loopCapacity);
+	}
+
+	current->loops[current->loopCountTop].breakStart = current->breakCount;
+	current->loops[current->loopCountTop].scopeDepth = current->scopeDepth;
 }
 
 static void endLoopScope()
 {
-	if (current->breakJumpCounts[current->loopCountTop] > 0)
-		current->breakJumpCounts[current->loopCountTop] = 0;
-
 	current->loopCountTop--;
 }
 
 // mark current chunk for continue jump
 static void markContinueJump()
 {
-	current->continueJumps[current->loopCountTop] = currentChunk()->count;
+	current->loops[current->loopCountTop].continueTarget = currentChunk()->count;
+}
+
+// continue statements of the current loop jump forward, to be patched with patchContinueJumps
+static void markForwardContinue()
+{
+	current->loops[current->loopCountTop].continueTarget = -1;
+}
+
+// patch forward continue jumps emitted since patchStart, which is the count when the loop started
+static void patchContinueJumps(int patchStart)
+{
+	for (int i = patchStart; i < current->continuePatchCount; i++)
+	{
+		patchJump(current->continuePatchJumps[i]);
+	}
+
+	current->continuePatchCount = patchStart;
+}
+
+// break and continue leave the scopes of the loop's body, their locals are popped before the jump like endScope does
+// -> the locals stay declared, the code after the statement still belongs to those scopes
+static void discardLoopLocals()
+{
+	int loopDepth = current->loops[current->loopCountTop].scopeDepth;
+	for (int i = current->localCount - 1; i >= 0 && current->locals[i].depth > loopDepth; i--)
+	{
+		emitByte(current->locals[i].isCaptured ? OP_CLOSE_UPVALUE : OP_POP);
+	}
 }
 
-// patch available break jumps
+// patch the break jumps of the current loop
 static void patchBreakJumps()
 {
-	for (int i = 0; i < current->breakJumpCounts[current->loopCountTop]; i++)
+	int breakStart = current->loops[current->loopCountTop].breakStart;
+	for (int i = breakStart; i < current->breakCount; i++)
 	{
-		patchJump(current->breakPatchJumps[current->loopCountTop][i]);
+		patchJump(current->breakJumps[i]);
 	}
+
+	current->breakCount = breakStart;
 }
 
 /* forwad declaration of main functions */
 static void expression();
 static void statement();
+static void ifStatement();
 static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
@@ -515,6 +781,13 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
 		return 0;
 	}
 
+	if (upvalueCount == compiler->upvalueCapacity)
+	{
+		int oldCapacity = compiler->upvalueCapacity;
+		compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->upvalues = ARENA_GROW_ARRAY(&arena, Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+	}
+
 	// compiler keeps an array of upvalue structs to track closed-over identifiers
 	// indexes in the array match the indexes of ObjClosure at runtime
 	// insert to upvalues array
@@ -560,6 +833,13 @@ static void addLocal(Token name)
 		return;
 	}
 
+	if (current->localCount == current->localCapacity)
+	{
+		int oldCapacity = current->localCapacity;
+		current->localCapacity = GROW_CAPACITY(oldCapacity);
+		current->locals = ARENA_GROW_ARRAY(&arena, Local, current->locals, oldCapacity, current->localCapacity);
+	}
+
 	Local* local = &current->locals[current->localCount++];
 	local->name = name;
 	local->depth = -1;			// for cases where a variable name is redefined inside another scope, using the variable itself
@@ -673,6 +953,12 @@ static void binary(bool canAssign)
 {
 	// remember type of operator, already consumed
 	TokenType  operatorType = parser.previous.type;
+
+	// the left operand, if it can be folded
+	LastExpression left = lastExpression;
+	bool isLeftConstant = isConstantFrom(left.start);
+	bool isLeftNumber = endsWithNumber();
+	int rightStart = currentChunk()->count;
 	
 	// compile right operand
 	ParseRule* rule = getRule(operatorType);		// the BIDMAS rule, operands in the right side have HIGHER PRECEDENCE
@@ -680,6 +966,28 @@ static void binary(bool canAssign)
 	// recursively call parsePrecedence again
 	parsePrecedence((Precedence)(rule->precedence + 1));		// conert from rule to enum(precedence) type
 
+	if (isConstantFrom(rightStart))
+	{
+		Value right = lastExpression.value;
+		Value result;
+		if (isLeftConstant && foldBinary(operatorType, left.value, right, &result))
+		{
+			removeLoad(rightStart);
+			removeLoad(left.start);
+			emitFolded(left.start, result);
+			return;
+		}
+
+		if (isLeftNumber && IS_NUMBER(right) && isIdentity(operatorType, AS_NUMBER(right)))
+		{
+			removeLoad(rightStart);
+			lastExpression = left;
+			return;
+		}
+	}
+
+	bool isRightNumber = endsWithNumber();
+
 	switch (operatorType)
 	{
 		// note how NOT opcode is at the end
@@ -691,11 +999,14 @@ static void binary(bool canAssign)
 	case TOKEN_LESS: emitByte(OP_LESS);	break;
 	case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
 
-	case TOKEN_PLUS:	emitByte(OP_ADD); break;
-	case TOKEN_MINUS:	emitByte(OP_SUBTRACT); break;
-	case TOKEN_STAR:	emitByte(OP_MULTIPLY); break;
-	case TOKEN_SLASH:	emitByte(OP_DIVIDE); break;
-	case TOKEN_MODULO:  emitByte(OP_MODULO); break;
+	case TOKEN_PLUS:
+		emitByte(OP_ADD);
+		if (isLeftNumber && isRightNumber) recordExpression(-1, false, true, NULL_VAL);		// not a concatenation
+		break;
+	case TOKEN_MINUS:	emitByte(OP_SUBTRACT); recordExpression(-1, false, true, NULL_VAL); break;
+	case TOKEN_STAR:	emitByte(OP_MULTIPLY); recordExpression(-1, false, true, NULL_VAL); break;
+	case TOKEN_SLASH:	emitByte(OP_DIVIDE); recordExpression(-1, false, true, NULL_VAL); break;
+	case TOKEN_MODULO:  emitByte(OP_MODULO); recordExpression(-1, false, true, NULL_VAL); break;
 	default:
 		return;			// unreachable
 	}
@@ -741,11 +1052,12 @@ static void dot(bool canAssign)
 
 static void literal(bool canAssign)
 {
+	int start = currentChunk()->count;
 	switch (parser.previous.type)
 	{
-	case TOKEN_FALSE: emitByte(OP_FALSE); break;
-	case TOKEN_TRUE: emitByte(OP_TRUE); break;
-	case TOKEN_NULL: emitByte(OP_NULL); break;
+	case TOKEN_FALSE: emitFolded(start, BOOL_VAL(false)); break;
+	case TOKEN_TRUE: emitFolded(start, BOOL_VAL(true)); break;
+	case TOKEN_NULL: emitFolded(start, NULL_VAL); break;
 
 	default:		// unreachable
 		return;
@@ -774,7 +1086,7 @@ static void number(bool canAssign)
 	*/
 	double value = strtod(parser.previous.start, NULL);		
 	//printf("num %c\n", *parser.previous.start);
-	emitConstant(NUMBER_VAL(value));
+	emitFolded(currentChunk()->count, NUMBER_VAL(value));
 }
 
 static void or_(bool canAssign)
@@ -794,7 +1106,8 @@ static void or_(bool canAssign)
 static void string(bool canAssign)
 {
 	// in a string, eg. "hitagi", the quotation marks are trimmed
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+	int start = currentChunk()->count;
+	emitFolded(start, OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 // declare/call variables
@@ -909,8 +1222,27 @@ static void unary(bool canAssign)
 	TokenType operatorType = parser.previous.type;		// leading - token has already been consumed 
 
 	// compile operand
+	int start = currentChunk()->count;
 	expression();
 
+	if (isConstantFrom(start))
+	{
+		Value value = lastExpression.value;
+		if (operatorType == TOKEN_BANG)
+		{
+			removeLoad(start);
+			emitFolded(start, BOOL_VAL(isFalsey(value)));
+			return;
+		}
+
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(value))
+		{
+			removeLoad(start);
+			emitFolded(start, NUMBER_VAL(-AS_NUMBER(value)));
+			return;
+		}
+	}
+
 	switch (operatorType)
 	{
 	case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -923,7 +1255,7 @@ static void unary(bool canAssign)
 		when the unary negation is called, all of a.b + 3 will be consumed in expression(). Hence, a method is needed
 		to STOP when + is found, or generally when an operand of LOWER PRECEDENCE is found
 		*/
-	case TOKEN_MINUS: emitByte(OP_NEGATE); break;			
+	case TOKEN_MINUS: emitByte(OP_NEGATE); recordExpression(-1, false, true, NULL_VAL); break;
 	default:
 		return;		
 	}
@@ -945,6 +1277,7 @@ ParseRule rules[] =
 	[TOKEN_RIGHT_BRACE]		= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_COMMA]			= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_DOT]				= {NULL,     dot,   PREC_CALL},
+	[TOKEN_DOT_DOT]			= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_MINUS]			= {unary,    binary, PREC_TERM},
 	[TOKEN_PLUS]			= {NULL,     binary, PREC_TERM},
 	[TOKEN_SEMICOLON]		= {NULL,     NULL,   PREC_NONE},
@@ -969,6 +1302,7 @@ ParseRule rules[] =
 	[TOKEN_FOR]				= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_FUN]				= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_IF]				= {NULL,     NULL,   PREC_NONE},
+	[TOKEN_IN]				= {NULL,     NULL,   PREC_NONE},
 	[TOKEN_SWITCH] = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_NULL]			= {literal,     NULL,   PREC_NONE},
 	[TOKEN_OR]				= {NULL,     or_,   PREC_OR},
@@ -1057,7 +1391,7 @@ static void block()
 
 
 /* functions */
-static void function(FunctionType type)
+static ObjFunction* function(FunctionType type)
 {
 	// create separate Compiler for each function
 	Compiler compiler;
@@ -1109,6 +1443,8 @@ static void function(FunctionType type)
 		emitByte(compiler.upvalues[i].index);				 // emit index
 	}
 
+	ARENA_FREE_ARRAY(&arena, Upvalue, compiler.upvalues, compiler.upvalueCapacity);		// kept by endCompiler for the bytes above
+	return function;
 }
 
 // create method for class type
@@ -1126,7 +1462,8 @@ static void method()
 		type = TYPE_INITIALIZER;
 	}
 
-	function(type);				// process the function
+	ObjFunction* declared = function(type);				// process the function
+	if (isOptimizing && type == TYPE_METHOD && !parser.hadError) addInlineMethod(&inlineTargets, declared, &arena);
 
 	emitBytes(OP_METHOD, constant);
 }
@@ -1200,7 +1537,10 @@ static void funDeclaration()
 {
 	uint8_t global = parseVariable("Expect function name.");
 	markInitialized();					// scoping
-	function(TYPE_FUNCTION);	
+	ObjFunction* declared = function(TYPE_FUNCTION);
+
+	// a global function can be inlined into the functions declared after it
+	if (isOptimizing && current->scopeDepth == 0 && !parser.hadError) addInlineFunction(&inlineTargets, declared, &arena);
 	defineVariable(global);
 }
 
@@ -1228,16 +1568,51 @@ static void expressionStatement()
 	emitByte(OP_POP);
 }
 
+// a statement that can never run
+static void deadStatement()
+{
+	DeadCode dead;
+	beginDeadCode(&dead);
+	statement();
+	endDeadCode(&dead);
+}
+
+// the else and elf branches of an if statement
+static void elseBranches(bool isDead)
+{
+	DeadCode dead;
+	if (isDead) beginDeadCode(&dead);
+
+	if (match(TOKEN_ELSE)) statement();
+	if (match(TOKEN_ELF)) ifStatement();
+
+	if (isDead) endDeadCode(&dead);
+}
+
 // if method
 static void ifStatement()
 {
 //	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	int conditionStart = currentChunk()->count;
 	expression();													// compile the expression statment inside; parsePrecedence()
 	// after compiling expression above conditon value will be left at the top of the stack
 //	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
 	consume(TOKEN_THEN, "Missing 'then' keyword after if expression.");
 
+	// a constant condition picks its branch here, the other one is dropped and nothing is tested at runtime
+	if (isConstantFrom(conditionStart))
+	{
+		bool isTrue = !isFalsey(lastExpression.value);
+		removeLoad(conditionStart);
+
+		if (isTrue) statement();
+		else deadStatement();
+
+		elseBranches(isTrue);
+		return;
+	}
+
 	// gives an operand on how much to offset the ip; how many bytes of code to skip
 	// if falsey, simply adjusts the ip by that amount
 	// offset to jump to next (potentially else or elf) statment
@@ -1263,13 +1638,7 @@ static void ifStatement()
 	patchJump(thenJump);	/* this actually jumps */
 
 	emitByte(OP_POP);		// if else statment is run; pop the expression inside () after if
-	if (match(TOKEN_ELSE)) statement();
-
-	if (match(TOKEN_ELF))	// else if
-	{
-		// go to statement, then go back to IF
-		ifStatement();
-	}
+	elseBranches(false);		// elf goes back to ifStatement
 
 	/* this actually jumps */
 	// last jump that is executed IF FIRST STATEMENT IS TRUE
@@ -1290,18 +1659,18 @@ static void switchStatement()
 	consume(TOKEN_CASE, "Expect at least 1 case after switch declaration.");
 
 	/* to store  opcode offsets */
-	uint8_t casesCount = -1;
-	uint8_t capacity = 0;
-	int* casesOffset = ALLOCATE(int, 8);			// 8 initial switch cases
+	int casesCount = -1;
+	int capacity = 8;
+	int* casesOffset = ARENA_ALLOCATE(&arena, int, capacity);			// 8 initial switch cases
 
 	do		// while next token is a case, match also advances
 	{
 		// grow array if needed
-		if (capacity < casesCount + 1)
+		if (capacity == casesCount + 1)
 		{
 			int oldCapacity = capacity;
 			capacity = GROW_CAPACITY(oldCapacity);
-			casesOffset = GROW_ARRAY(int, casesOffset, oldCapacity, capacity);
+			casesOffset = ARENA_GROW_ARRAY(&arena, int, casesOffset, oldCapacity, capacity);
 		}
 		
 		casesCount++; 
@@ -1334,13 +1703,13 @@ static void switchStatement()
 
 
 	// patchJump for each available jump
-	for (uint8_t i = 0; i <= casesCount; i++)
+	for (int i = 0; i <= casesCount; i++)
 	{
 		patchJump(casesOffset[i]);
 	}
 		
 	emitByte(OP_POP);			// pop switch constant
-	FREE_ARRAY(int, casesOffset, capacity);
+	ARENA_FREE_ARRAY(&arena, int, casesOffset, capacity);
 
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' at the end of switch statement");
 }
@@ -1377,8 +1746,120 @@ static void returnStatement()
 	}
 }
 
+// loop operand is a local slot followed by a 16 bit jump offset
+static int emitLoopJump(uint8_t instruction, uint8_t slot)
+{
+	emitBytes(instruction, slot);
+	emitByte(0xff);
+	emitByte(0xff);
+
+	return currentChunk()->count - 2;		// patched with patchJump, like emitJump
+}
+
+static void emitLoopBack(uint8_t instruction, uint8_t slot, int loopStart)
+{
+	emitBytes(instruction, slot);
+
+	int offset = currentChunk()->count - loopStart + 2;
+	if (offset > UINT16_MAX) error("Loop body too large.");
+
+	emitByte((offset >> 8) & 0xff);
+	emitByte(offset & 0xff);
+}
+
+// declare the locals of a for in loop in order of their stack slots, all initialized
+static void addLoopLocal(Token name)
+{
+	addLocal(name);
+	current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+/*	for x in start..end
+-> the counter is the loop variable itself, the end is a hidden local right above it
+-> the condition is tested once at the top and then at the bottom, by OP_FOR_RANGE which increments,
+	compares and jumps back in a single dispatch instead of the seven instructions of a C style loop
+*/
+static void forRangeStatement(Token name)
+{
+	consume(TOKEN_DOT_DOT, "Expect '..' in range.");
+	expression();							// end of the range, exclusive
+
+	uint8_t slot = (uint8_t)(current->localCount);
+	addLoopLocal(name);
+	addLoopLocal(syntheticToken(""));		// empty name can never be resolved by the user
+
+	int exitJump = emitLoopJump(OP_FOR_RANGE_INIT, slot);
+	int bodyStart = currentChunk()->count;
+
+	markForwardContinue();
+	int continueStart = current->continuePatchCount;
+
+	statement();
+
+	patchContinueJumps(continueStart);		// continue lands on the increment
+	emitLoopBack(OP_FOR_RANGE, slot, bodyStart);
+
+	patchJump(exitJump);
+}
+
+/*	for x in sequence
+-> generic iteration over strings(one character strings) and byte buffers(numbers)
+-> hidden locals hold the sequence and the next index, OP_FOR_ITER loads the element into x or exits
+*/
+static void forEachStatement(Token name)
+{
+	uint8_t slot = (uint8_t)(current->localCount);
+	addLoopLocal(syntheticToken(""));		// the sequence, already on the stack
+	emitConstant(NUMBER_VAL(0));
+	addLoopLocal(syntheticToken(""));		// the index
+	emitByte(OP_NULL);
+	addLoopLocal(name);						// the loop variable
+
+	int loopStart = currentChunk()->count;
+	markContinueJump();
+
+	int exitJump = emitLoopJump(OP_FOR_ITER, slot);
+
+	statement();
+
+	emitLoop(loopStart);
+	patchJump(exitJump);
+}
+
+static void forInStatement()
+{
+	beginScope();
+	beginLoopScope();
+
+	consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+	Token name = parser.previous;
+	consume(TOKEN_IN, "Expect 'in' after loop variable.");
+
+	expression();			// start of the range, or the sequence
+
+	if (check(TOKEN_DOT_DOT))
+	{
+		forRangeStatement(name);
+	}
+	else
+	{
+		forEachStatement(name);
+	}
+
+	patchBreakJumps();
+
+	endLoopScope();
+	endScope();
+}
+
 static void forStatement()
 {
+	if (check(TOKEN_IDENTIFIER))	// for x in
+	{
+		forInStatement();
+		return;
+	}
+
 	beginScope();			// for possible variable declarations in clause
 
 	beginLoopScope();
@@ -1476,6 +1957,26 @@ static void whileStatement()
 
 	expression();
 
+	// while true loops until a break without testing anything, a loop that never runs is dropped
+	if (isConstantFrom(loopStart))
+	{
+		bool isTrue = !isFalsey(lastExpression.value);
+		removeLoad(loopStart);
+
+		if (isTrue)
+		{
+			statement();
+			emitLoop(loopStart);
+			patchBreakJumps();
+		}
+		else
+		{
+			deadStatement();
+		}
+
+		endLoopScope();
+		return;
+	}
 
 	int exitJump = emitJump(OP_JUMP_IF_FALSE);			// skip stament if condition is false
 
@@ -1503,16 +2004,15 @@ static void breakStatement()
 		return;
 	}
 
-	if (++current->breakJumpCounts[current->loopCountTop] > UINT8_COUNT)
+	if (current->breakCount == current->breakCapacity)
 	{
-		error("Too many break statments in one loop");
-		return;
+		int oldCapacity = current->breakCapacity;
+		current->breakCapacity = GROW_CAPACITY(oldCapacity);
+		current->breakJumps = ARENA_GROW_ARRAY(&arena, int, current->breakJumps, oldCapacity, current->breakCapacity);
 	}
 
-	int breakJump = emitJump(OP_JUMP);
-	int loopDepth = current->loopCountTop;
-	int breakAmount = current->breakJumpCounts[loopDepth];
-	current->breakPatchJumps[current->loopCountTop][breakAmount - 1] = breakJump;
+	discardLoopLocals();
+	current->breakJumps[current->breakCount++] = emitJump(OP_JUMP);
 
 	consume(TOKEN_SEMICOLON, "Expect ';' after break.");
 }
@@ -1526,14 +2026,23 @@ static void continueStatement()
 		return;
 	}
 
-	if (current->loopCountTop == current->continueJumpCapacity)
+	discardLoopLocals();
+
+	if (current->loops[current->loopCountTop].continueTarget == -1)		// loop condition is below, jump forward
 	{
-		int oldCapacity = current->continueJumpCapacity;
-		current->continueJumpCapacity = GROW_CAPACITY(oldCapacity);
-		current->continueJumps = GROW_ARRAY(int, current->continueJumps, oldCapacity, current->continueJumpCapacity);
-	}
+		if (current->continuePatchCount == current->continuePatchCapacity)
+		{
+			int oldCapacity = current->continuePatchCapacity;
+			current->continuePatchCapacity = GROW_CAPACITY(oldCapacity);
+			current->continuePatchJumps = ARENA_GROW_ARRAY(&arena, int, current->continuePatchJumps, oldCapacity, current->continuePatchCapacity);
+		}
 
-	emitLoop(current->continueJumps[current->loopCountTop]);
+		current->continuePatchJumps[current->continuePatchCount++] = emitJump(OP_JUMP);
+	}
+	else
+	{
+		emitLoop(current->loops[current->loopCountTop].continueTarget);
+	}
 
 	consume(TOKEN_SEMICOLON, "Expect ';' after continue.");
 }
@@ -1694,9 +2203,16 @@ static void statement()					// either an expression or a print
 	}
 }
 
+void setOptimizing(bool optimizing)
+{
+	isOptimizing = optimizing;
+}
+
 ObjFunction* compile(const char* source)
 {
 	initScanner(source);			// start scan/lexing
+	initArena(&arena);
+	initInlineTargets(&inlineTargets);
 	Compiler compiler;
 	initCompiler(&compiler, TYPE_SCRIPT);
 
@@ -1712,10 +2228,18 @@ ObjFunction* compile(const char* source)
 
 	
 	ObjFunction* function = endCompiler();					// ends the expression with a return type
+	freeArena(&arena);
 	return parser.hadError ? NULL : function;		// if no error return true
 }
 
 
+void abortCompile()
+{
+	current = NULL;
+	currentClass = NULL;
+	freeArena(&arena);
+}
+
 // marking compiler roots, for garbage collection
 void markCompilerRoots()
 {
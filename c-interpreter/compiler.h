@@ -7,8 +7,10 @@
 #include "virtualm.h"
 
 ObjFunction* compile(const char* source);			// receives the source code(in charray) and the chunk itself
+void setOptimizing(bool optimizing);				// -O, functions also go through the passes of optimizer.h
 
 // for garbage collection
 void markCompilerRoots();
+void abortCompile();			// an allocation failed while compiling, the functions being compiled are dropped
 
 #endif
\ No newline at end of file
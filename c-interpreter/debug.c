@@ -46,6 +46,29 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 
 }
 
+// guards of inlined calls, the function expected, the argument count and the jump to the call
+static int checkInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t constant = chunk->code[offset + 1];
+	uint8_t argCount = chunk->code[offset + 2];
+	uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+	jump |= chunk->code[offset + 4];
+	printf("%-16s (%d args) %4d ", name, argCount, constant);
+	printValue(chunk->constants.values[constant]);
+	printf(" -> %d\n", offset + 5 + jump);
+	return offset + 5;
+}
+
+// loop instructions with a local slot and a jump offset
+static int loopInstruction(const char* name, int sign, Chunk* chunk, int offset)
+{
+	uint8_t slot = chunk->code[offset + 1];
+	uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+	jump |= chunk->code[offset + 3];
+	printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 4 + sign * jump);
+	return offset + 4;
+}
+
 void disassembleChunk(Chunk* chunk, const char* name)
 {
 	printf("== %s ==\n", name);				// print a little header for debugging
@@ -155,6 +178,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
 		return jumpInstruction("OP_JUMP", 1, chunk, offset);
 	case OP_JUMP_IF_FALSE:
 		return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+	case OP_JUMP_IF_TRUE:
+		return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
 
 	case OP_CALL:
 		return byteInstruction("OP_CALL", chunk, offset);
@@ -198,6 +223,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_SUPER_INVOKE:
 		return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
 
+	case OP_CHECK_FUNCTION:
+		return checkInstruction("OP_CHECK_FUNCTION", chunk, offset);
+	case OP_CHECK_METHOD:
+		return checkInstruction("OP_CHECK_METHOD", chunk, offset);
+
 	case OP_RETURN:
 		return simpleInstruction("OP_RETURN", offset);		// dispatch to a utility function to display it
 
@@ -210,6 +240,13 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_LOOP_IF_FALSE:
 		return jumpInstruction("OP_LOOP_IF_FALSE", -1, chunk, offset);
 
+	case OP_FOR_RANGE_INIT:
+		return loopInstruction("OP_FOR_RANGE_INIT", 1, chunk, offset);
+	case OP_FOR_RANGE:
+		return loopInstruction("OP_FOR_RANGE", -1, chunk, offset);
+	case OP_FOR_ITER:
+		return loopInstruction("OP_FOR_ITER", 1, chunk, offset);
+
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
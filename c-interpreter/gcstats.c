@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "gcstats.h"
+
+void initGCStats(GCStats* stats)
+{
+	memset(stats, 0, sizeof(GCStats));
+}
+
+void recordPauseTime(PauseHistogram* histogram, double seconds)
+{
+	histogram->count++;
+	histogram->total += seconds;
+	if (seconds > histogram->max) histogram->max = seconds;
+
+	int bucket = 0;
+	double limit = 1e-6;
+	while (bucket < GC_PAUSE_BUCKETS - 1 && seconds >= limit)
+	{
+		bucket++;
+		limit *= 2;
+	}
+	histogram->buckets[bucket]++;
+}
+
+double pausePercentile(PauseHistogram* histogram, double percentile)
+{
+	if (histogram->count == 0) return 0;
+
+	// index of the pause at the percentile, among the pauses sorted by length
+	double rank = histogram->count * percentile / 100;
+	long wanted = (long)rank;
+	if (wanted == rank && wanted > 0) wanted--;
+	long seen = 0;
+	double limit = 1e-6;
+	for (int i = 0; i < GC_PAUSE_BUCKETS - 1; i++)
+	{
+		seen += histogram->buckets[i];
+		if (seen > wanted) return limit < histogram->max ? limit : histogram->max;
+		limit *= 2;
+	}
+	return histogram->max;			// in the open ended bucket
+}
+
+const char* objTypeName(ObjType type)
+{
+	switch (type)
+	{
+	case OBJ_BOUND_METHOD: return "bound method";
+	case OBJ_BYTES: return "bytes";
+	case OBJ_INSTANCE: return "instance";
+	case OBJ_CLASS: return "class";
+	case OBJ_CLOSURE: return "closure";
+	case OBJ_FUNCTION: return "function";
+	case OBJ_NATIVE: return "native";
+	case OBJ_STRING: return "string";
+	case OBJ_STRING_BUILDER: return "builder";
+	case OBJ_UPVALUE: return "upvalue";
+	case OBJ_WEAK_MAP: return "weak map";
+	case OBJ_WEAK_REF: return "weak ref";
+	}
+	return "unknown";
+}
+
+static void printHistogram(const char* name, PauseHistogram* histogram, FILE* file)
+{
+	fprintf(file, "%-14s %8ld pauses, total %.3f ms, max %.3f ms, p50 < %.3f ms, p99 < %.3f ms\n",
+		name, histogram->count, histogram->total * 1000, histogram->max * 1000,
+		pausePercentile(histogram, 50) * 1000, pausePercentile(histogram, 99) * 1000);
+
+	double limit = 1e-6;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+	{
+		if (histogram->buckets[i] != 0)
+		{
+			if (i == GC_PAUSE_BUCKETS - 1) fprintf(file, "%14s >= %9.3f ms %8ld\n", "", limit / 2 * 1000, histogram->buckets[i]);
+			else fprintf(file, "%14s  < %9.3f ms %8ld\n", "", limit * 1000, histogram->buckets[i]);
+		}
+		limit *= 2;
+	}
+}
+
+void printGCStats(GCStats* stats, FILE* file)
+{
+	fprintf(file, "== garbage collector ==\n");
+	fprintf(file, "collections    %ld minor, %ld full, %ld compacting\n",
+		stats->minorCollections, stats->fullCollections, stats->compactions);
+	fprintf(file, "freed          %zu bytes, last full %zu, last minor %zu\n",
+		stats->freedBytes, stats->lastFullFreed, stats->lastMinorFreed);
+
+	printHistogram("pauses", &stats->pauses, file);
+	printHistogram("mark pauses", &stats->markPauses, file);
+	printHistogram("sweep pauses", &stats->sweepPauses, file);
+
+	long objects = 0;
+	size_t bytes = 0;
+	fprintf(file, "live after the last full marking\n");
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+	{
+		if (stats->live.objects[i] == 0) continue;
+		fprintf(file, "%14s %10ld objects %12zu bytes\n", objTypeName((ObjType)i), stats->live.objects[i], stats->live.bytes[i]);
+		objects += stats->live.objects[i];
+		bytes += stats->live.bytes[i];
+	}
+	fprintf(file, "%14s %10ld objects %12zu bytes\n", "total", objects, bytes);
+}
@@ -0,0 +1,56 @@
+// statistics of the garbage collector, kept in vm.gcStats
+// counters and pause histograms are updated by every collection, the live objects by every full marking
+// -> scripts read them with gcStat(name), embedders read vm.gcStats, cfei --gc-stats prints them at exit
+
+#ifndef gcstats_h
+#define gcstats_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// bucket i counts pauses shorter than 2^i microseconds, the last bucket every longer pause
+#define GC_PAUSE_BUCKETS 20
+
+typedef struct
+{
+	long count;
+	double total;				// seconds
+	double max;
+	long buckets[GC_PAUSE_BUCKETS];
+} PauseHistogram;
+
+// objects and the bytes they hold, their own size and the arrays they own, counted like vm.bytesAllocated
+typedef struct
+{
+	long objects[OBJ_TYPE_COUNT];
+	size_t bytes[OBJ_TYPE_COUNT];
+} HeapCensus;
+
+typedef struct
+{
+	long minorCollections;
+	long fullCollections;
+	long compactions;
+
+	PauseHistogram pauses;			// every time the collector stopped the program
+	PauseHistogram markPauses;		// the marking part of a pause: roots, incremental slices, minor collections
+	PauseHistogram sweepPauses;		// the sweeping part: lazy sweep slices and young objects of minor collections
+
+	size_t freedBytes;				// by every collection so far
+	size_t lastFullFreed;			// by the last full collection, its lazy sweep included
+	size_t lastMinorFreed;
+
+	// objects reached by the last full marking, objects allocated while it ran incrementally are not included
+	HeapCensus live;
+} GCStats;
+
+void initGCStats(GCStats* stats);
+void recordPauseTime(PauseHistogram* histogram, double seconds);
+double pausePercentile(PauseHistogram* histogram, double percentile);		// upper bound of the bucket, in seconds
+
+const char* objTypeName(ObjType type);
+void printGCStats(GCStats* stats, FILE* file);
+
+#endif
@@ -6,8 +6,91 @@
 #include "hasht.h"
 #include "value.h"
 
-// the hash table can only be 75% full
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+/*	control bytes, one for every entry, after the entries
+-> a full entry has the top 7 bits of its key's hash, 0 to 127, the other states have the high bit set
+-> a key goes to its home entry, picked by the low bits of the hash, when that one is free, and a lookup tries the
+	home entry first, so keys of small and sparse tables are found without reading the control bytes
+-> otherwise the lookup compares the 16 control bytes of the home entry's group with the key's 7 bits and only looks
+	at the entries whose byte matches, about one in 128 of the others
+-> a group with an empty entry ends the lookup, otherwise the next group is probed in triangular steps, which visit
+	every group when their number is a power of two
+-> tables of 4 and 8 entries fill the rest of their group with sentinels, which match nothing
+*/
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xFE)
+#define CONTROL_SENTINEL ((uint8_t)0xFF)
+
+// the hash table can be 7/8 full, deleted entries included, so there is always an empty entry to end a lookup
+#define TABLE_MAX_LOAD(capacity) ((capacity) * 7 / 8)
+
+// instances with up to 3 fields keep a table of 4 entries, the smallest size class that fits it
+#define TABLE_MIN_CAPACITY 4
+#define TABLE_GROW_CAPACITY(capacity) ((capacity) < TABLE_MIN_CAPACITY ? TABLE_MIN_CAPACITY : (capacity) * 2)
+
+/*	resizing
+-> deleted entries count towards the load like full ones, when the load reaches the maximum the table is rebuilt for
+	its live entries only: it doubles when most of them are live, otherwise it keeps its capacity and only drops the
+	tombstones, or shrinks when few entries are left
+-> a rebuilt table is at most half loaded, so as many entries as it holds can be added before the next rebuild
+-> a table whose load fell under 1/8 of its capacity shrinks at the next insert, like vm.strings after the
+	collector dropped the strings of a spike
+-> tableRemoveWhite runs inside a collection and cannot allocate, it drops the tombstones in place instead
+*/
+#define TABLE_SHRINK_LOAD(capacity) ((capacity) / 8)
+
+static uint8_t* controlsOf(Entry* entries, int capacity)
+{
+	return (uint8_t*)(entries + capacity);
+}
+
+// the low bits pick the home entry and its group, the top 7 bits go to the control byte
+static uint8_t hashTag(uint32_t hash)
+{
+	return (uint8_t)(hash >> 25);
+}
+
+static int groupMaskOf(int capacity)
+{
+	return capacity < TABLE_GROUP_WIDTH ? 0 : capacity / TABLE_GROUP_WIDTH - 1;
+}
+
+// bit i is set when byte i of the group equals control
+static uint32_t matchControl(const uint8_t* group, uint8_t control)
+{
+#ifdef TABLE_SSE2
+	__m128i bytes = _mm_loadu_si128((const __m128i*)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+#else
+	uint32_t bits = 0;
+	for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+	{
+		if (group[i] == control) bits |= 1u << i;
+	}
+	return bits;
+#endif
+}
+
+// the empty and deleted entries of a group, where a new key can go
+static uint32_t matchFree(const uint8_t* group)
+{
+#ifdef TABLE_SSE2
+	// as signed bytes empty(-128) and deleted(-2) are below the sentinel(-1), full entries(0 to 127) are not
+	__m128i bytes = _mm_loadu_si128((const __m128i*)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(bytes, _mm_set1_epi8((char)CONTROL_SENTINEL)));
+#else
+	uint32_t bits = 0;
+	for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+	{
+		if (group[i] == CONTROL_EMPTY || group[i] == CONTROL_DELETED) bits |= 1u << i;
+	}
+	return bits;
+#endif
+}
 
 void initTable(Table* table)
 {
@@ -18,36 +101,69 @@ void initTable(Table* table)
 
 void freeTable(Table* table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->entries, TABLE_BYTES(table->capacity));
 	initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+// lookup past the home entry, through the control bytes
+static int probeEntry(Entry* entries, int capacity, ObjString* key)
 {
-	uint32_t index = key->hash % capacity;		// use modulo to map the key's hash to the code index
-	Entry* tombstone = NULL;
+	uint8_t* controls = controlsOf(entries, capacity);
+	int groupMask = groupMaskOf(capacity);
+	int group = (key->hash & (capacity - 1)) / TABLE_GROUP_WIDTH;
+	uint8_t tag = hashTag(key->hash);
 
-	for (;;)
+	for (int step = 1;; step++)
 	{
-		Entry* entry = &entries[index];		// index is 'inserted' here
-		
-		if (entry->key == NULL)
-		{
-			if (IS_NULL(entry->value))
-			{	
-				return tombstone != NULL ? tombstone : entry;		// empty entry
-			}
-			else {
-				if (tombstone == NULL) tombstone = entry;		// can return tombstone bucket as empty and reuse it
-			}
-		}
-		if (entry->key == key)		// compare them in MEMORY
+		uint8_t* bytes = controls + group * TABLE_GROUP_WIDTH;
+		for (uint32_t bits = matchControl(bytes, tag); bits != 0; bits &= bits - 1)
 		{
-			return entry;
+			int index = group * TABLE_GROUP_WIDTH + lowestBit(bits);
+			if (entries[index].key == key) return index;
 		}
-		
 
-		index = (index + 1) % capacity;		
+		if (matchControl(bytes, CONTROL_EMPTY) != 0) return -1;
+		group = (group + step) & groupMask;
+	}
+}
+
+// index of the key's entry, -1 if it is not in the table
+// -> small enough to be inlined, most keys of instance and class tables are in their home entry
+static inline int findEntry(Entry* entries, int capacity, ObjString* key)
+{
+	int home = key->hash & (capacity - 1);
+	if (entries[home].key == key) return home;		// compare them in MEMORY
+
+	return probeEntry(entries, capacity, key);
+}
+
+// number of full entries, tombstones left out
+static int countLive(Table* table)
+{
+	uint8_t* controls = controlsOf(table->entries, table->capacity);
+	int live = 0;
+	for (int i = 0; i < table->capacity; i++)
+	{
+		if ((controls[i] & 0x80) == 0) live++;
+	}
+	return live;
+}
+
+// first empty or deleted entry on the probe sequence of hash
+static int findFreeEntry(Entry* entries, int capacity, uint32_t hash)
+{
+	uint8_t* controls = controlsOf(entries, capacity);
+	int home = hash & (capacity - 1);
+	if (controls[home] & 0x80) return home;			// empty or deleted, sentinels are only past the capacity
+
+	int groupMask = groupMaskOf(capacity);
+	int group = home / TABLE_GROUP_WIDTH;
+
+	for (int step = 1;; step++)
+	{
+		uint32_t bits = matchFree(controls + group * TABLE_GROUP_WIDTH);
+		if (bits != 0) return group * TABLE_GROUP_WIDTH + lowestBit(bits);
+		group = (group + step) & groupMask;
 	}
 }
 
@@ -55,78 +171,168 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 {
 	if (table->count == 0) return false;
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	int index = findEntry(table->entries, table->capacity, key);
+	if (index < 0) return false;
 
-	*value = entry->value;			// asign the value parameter the entry value
+	*value = table->entries[index].value;			// asign the value parameter the entry value
 	return true;
 }
 
 
 static void adjustCapacity(Table* table, int capacity)
 {
-	Entry* entries = ALLOCATE(Entry, capacity);			// create a bucket with capacity entries, new array
-	for (int i = 0; i < capacity; i++)		// initialize every element			
+	Entry* entries = (Entry*)ALLOCATE(uint8_t, TABLE_BYTES(capacity));		// the entries and their control bytes
+	for (int i = 0; i < capacity; i++)		// initialize every element
 	{
-		entries[i].key = NULL;				
+		entries[i].key = NULL;
 		entries[i].value = NULL_VAL;
 	}
 
+	uint8_t* controls = controlsOf(entries, capacity);
+	size_t controlCount = TABLE_BYTES(capacity) - sizeof(Entry) * capacity;
+	memset(controls, CONTROL_EMPTY, capacity);
+	memset(controls + capacity, CONTROL_SENTINEL, controlCount - capacity);
+
 	table->count = 0;		// do not copy tombstones over when growing
-	// NOTE: entries may end up in different buckets
-	// with the same hash as it is divided by the modulo; loop below recalculates everything
+	// NOTE: entries may end up in different groups, the loop below places everything again
 	for (int i = 0; i < table->capacity; i++)	// travers through old array
 	{
 		Entry* entry = &table->entries[i];
-		if (entry->key == NULL) continue;		
+		if (entry->key == NULL) continue;
 
-		// insert into new array
-		Entry* dest = findEntry(entries, capacity, entry->key);			// pass in new array
-		dest->key = entry->key;					// match old array to new array
-		dest->value = entry->value;
+		// insert into new array, every key is different so there is no need to look it up first
+		int index = findFreeEntry(entries, capacity, entry->key->hash);
+		entries[index] = *entry;
+		controls[index] = hashTag(entry->key->hash);
 		table->count++;			// recound the number of entries
 	}
 
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(uint8_t, table->entries, TABLE_BYTES(table->capacity));
 	table->entries = entries;
 	table->capacity = capacity;
 }
 
-// inserting into the table, return false if collision
-bool tableSet(Table* table, ObjString* key, Value value)
+/*	rebuilds the table in its own array, every tombstone becomes an empty entry
+-> full entries are first marked deleted, meaning not placed yet, and then placed one after the other: an entry that
+	is already in the first group with room on its probe sequence stays, one whose place is empty moves there, and
+	one whose place holds an entry not placed yet swaps with it and the swapped in entry is placed next
+-> groups before a placed entry on its probe sequence are full of placed entries, which never move again, so the
+	entry can still be found when the rebuild ends
+*/
+static void dropTombstones(Table* table)
 {
-	// make sure array is big enough
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+	Entry* entries = table->entries;
+	uint8_t* controls = controlsOf(entries, table->capacity);
+
+	for (int i = 0; i < table->capacity; i++)
+	{
+		controls[i] = (controls[i] & 0x80) == 0 ? CONTROL_DELETED : CONTROL_EMPTY;
+	}
+
+	table->count = 0;
+	for (int i = 0; i < table->capacity; i++)
 	{
-		int capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+		if (controls[i] != CONTROL_DELETED) continue;
+
+		uint32_t hash = entries[i].key->hash;
+		int index = findFreeEntry(entries, table->capacity, hash);
+		if (index / TABLE_GROUP_WIDTH == i / TABLE_GROUP_WIDTH)
+		{
+			controls[i] = hashTag(hash);		// the entry is in the right group already
+		}
+		else if (controls[index] == CONTROL_EMPTY)
+		{
+			entries[index] = entries[i];
+			controls[index] = hashTag(hash);
+			entries[i].key = NULL;
+			entries[i].value = NULL_VAL;
+			controls[i] = CONTROL_EMPTY;
+		}
+		else
+		{
+			Entry swapped = entries[index];
+			entries[index] = entries[i];
+			controls[index] = hashTag(hash);
+			entries[i] = swapped;
+			i--;			// place the swapped in entry next
+		}
+
+		table->count++;
 	}
+}
+
+// rebuilds the table for count entries, see resizing above
+static void resizeTable(Table* table, int count)
+{
+	int capacity = TABLE_MIN_CAPACITY;
+	while (count > TABLE_MAX_LOAD(capacity) / 2) capacity *= 2;
+
+	// a table full of live entries doubles, instead of making room for twice as many as it holds
+	if (capacity > TABLE_GROW_CAPACITY(table->capacity)) capacity = TABLE_GROW_CAPACITY(table->capacity);
 
+	if (capacity == table->capacity) dropTombstones(table);
+	else adjustCapacity(table, capacity);
+}
+
+// inserting into the table, return true if the key is new
+bool tableSet(Table* table, ObjString* key, Value value)
+{
+	if (table->count > 0)
+	{
+		int index = findEntry(table->entries, table->capacity, key);
+		if (index >= 0)
+		{
+			table->entries[index].value = value;
+			return false;
+		}
+	}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
+	// make sure array is big enough, without tombstones piling up or the memory of deleted entries kept
+	int load = table->count + 1;
+	if (load > TABLE_MAX_LOAD(table->capacity)) resizeTable(table, countLive(table) + 1);
+	else if (load < TABLE_SHRINK_LOAD(table->capacity)) resizeTable(table, load);
 
-	bool isNewKey = entry->key == NULL;
-	if (isNewKey && IS_NULL(entry->value)) table->count++;		// IS_NULL for tombstones; treat them as full objects
+	int index = findFreeEntry(table->entries, table->capacity, key->hash);
+	uint8_t* controls = controlsOf(table->entries, table->capacity);
+	if (controls[index] == CONTROL_EMPTY) table->count++;		// a deleted entry is reused, it is counted already
 
-	entry->key = key;
-	entry->value = value;
+	controls[index] = hashTag(key->hash);
+	table->entries[index].key = key;
+	table->entries[index].value = value;
 
-	return isNewKey;
+	return true;
 }
 
+static void removeEntry(Table* table, int index)
+{
+	uint8_t* controls = controlsOf(table->entries, table->capacity);
+	uint8_t* group = controls + index / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+
+	table->entries[index].key = NULL;
+	table->entries[index].value = NULL_VAL;
+
+	// lookups only go past a group that has no empty entry, while this one has one no key was placed beyond it
+	// and the entry is empty again, otherwise it becomes a tombstone that lookups step over
+	if (matchControl(group, CONTROL_EMPTY) != 0)
+	{
+		controls[index] = CONTROL_EMPTY;
+		table->count--;
+	}
+	else
+	{
+		controls[index] = CONTROL_DELETED;
+	}
+}
 
 bool tableDelete(Table* table, ObjString* key)
 {
 	if (table->count == 0) return false;
 
 	// find entry
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
-
-	// place tombstone
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);		//BOOL_VAL(true) as the tombstone
+	int index = findEntry(table->entries, table->capacity, key);
+	if (index < 0) return false;
 
+	removeEntry(table, index);
 	return true;
 }
 
@@ -143,42 +349,50 @@ void tableAddAll(Table* from, Table* to)
 }
 
 // used in VM to find the string
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)		// pass in raw character array 
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash)		// pass in raw character array
 {
-	
 	if (table->count == 0) return NULL;
 
-	uint32_t index = hash % table->capacity;	// get index
-	
-	for (;;)
+	// no shortcut through the home entry, reading a key that does not match costs a cache miss, the control bytes
+	// rule out most of them
+	uint8_t* controls = controlsOf(table->entries, table->capacity);
+	int groupMask = groupMaskOf(table->capacity);
+	int group = (hash & (table->capacity - 1)) / TABLE_GROUP_WIDTH;
+	uint8_t tag = hashTag(hash);
+
+	for (int step = 1;; step++)
 	{
-		Entry* entry = &table->entries[index];		// get entry pointer
-		if (entry->key == NULL)
-		{
-			// stop if found empty non-tombstone entry
-			if (IS_NULL(entry->value)) return NULL;		// return null if not tombstone(tombstone value is BOOL_VAL(true))
-		}
-		else if (entry->key->length == length && entry->key->hash == hash
-			&& memcmp(entry->key->chars, chars, length) == 0)
+		uint8_t* bytes = controls + group * TABLE_GROUP_WIDTH;
+		for (uint32_t bits = matchControl(bytes, tag); bits != 0; bits &= bits - 1)
 		{
-			return entry->key;		// found the entry
+			ObjString* key = table->entries[group * TABLE_GROUP_WIDTH + lowestBit(bits)].key;
+			if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0)
+			{
+				return key;		// found the entry
+			}
 		}
 
-		index = (index + 1) % table->capacity;
+		if (matchControl(bytes, CONTROL_EMPTY) != 0) return NULL;		// stop at a group with an empty entry
+		group = (group + step) & groupMask;
 	}
 }
 
 // removing unreachable pointers, used to remove string interns in garbage collection
 void tableRemoveWhite(Table* table)
 {
+	int live = 0;
 	for (int i = 0; i < table->capacity; i++)
 	{
 		Entry* entry = &table->entries[i];
-		if (entry->key != NULL && !entry->key->obj.isMarked)		// remove not marked (string) object pointers
-		{
-			tableDelete(table, entry->key);
-		}
+		if (entry->key == NULL) continue;
+
+		if (isWhite((Obj*)entry->key)) removeEntry(table, i);		// remove not marked (string) object pointers
+		else live++;
 	}
+
+	// every lookup of a string that is not interned yet probes past the tombstones, they go once they are a
+	// sixteenth of the table
+	if (table->count - live > table->capacity / 16) dropTombstones(table);
 }
 
 
@@ -188,8 +402,10 @@ void markTable(Table* table)
 	for (int i = 0; i < table->capacity; i++)
 	{
 		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+
 		// need to mark both the STRING KEYS and the actual value/obj itself
 		markObject((Obj*)entry->key);			// mark the string key(ObjString type)
 		markValue(entry->value);				// mark the actual avlue
 	}
-}
\ No newline at end of file
+}
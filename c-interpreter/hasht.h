@@ -1,27 +1,34 @@
 // hash table to store names, etc.
 // in terms of the language's bytecode datatypes (eg. Value, objString)
 // hash function is in object.c, applied to every string for cache
+// -> open addressing over a power of two capacity, with a control byte for every entry kept after the entries,
+//	see hasht.c, lookups compare the control bytes of a whole group of entries at once
 #ifndef hasht_h
 #define hasht_h
 
 #include "common.h"
 #include "value.h"
 
+#define TABLE_GROUP_WIDTH 16		// entries whose control bytes are compared at once, with SSE2 where available
 
 typedef struct
 {
-	ObjString* key;			// use ObjString pointer as key
+	ObjString* key;			// use ObjString pointer as key, NULL for empty and deleted entries
 	Value value;			// the value/data type
 } Entry;
 
 // the table, an array of entries
 typedef struct
 {
-	int count;
-	int capacity;
-	Entry* entries;
+	int count;				// full and deleted entries, both count towards the load
+	int capacity;			// 0 or a power of two, at least 4
+	Entry* entries;			// capacity entries followed by their control bytes
 } Table;
 
+// the entries and the control bytes after them, tables smaller than a group still have a group of control bytes
+#define TABLE_BYTES(capacity) \
+	((capacity) == 0 ? 0 : sizeof(Entry) * (capacity) + ((capacity) < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : (capacity)))
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "platform.h"
+
+// the page memory starts with the pointer to its descriptor, the cells follow
+#define PAGE_HEADER_SIZE CELL_ALIGNMENT
+
+void initHeap(Heap* heap)
+{
+	heap->pages = NULL;
+	heap->pageCount = 0;
+	heap->emptyPages = NULL;
+	heap->emptyCount = 0;
+
+	for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+	{
+		heap->sizeClasses[i].current = NULL;
+		heap->sizeClasses[i].available = NULL;
+	}
+}
+
+static void releasePage(Page* page)
+{
+	freePages(page->cells - PAGE_HEADER_SIZE, PAGE_SIZE);
+	free(page);
+}
+
+static void freePageList(Page* page)
+{
+	while (page != NULL)
+	{
+		Page* next = page->next;
+		releasePage(page);
+		page = next;
+	}
+}
+
+void freeHeap(Heap* heap)
+{
+	freePageList(heap->pages);
+	freePageList(heap->emptyPages);
+	initHeap(heap);
+}
+
+
+// NULL if the system is out of memory
+static Page* newPage(Heap* heap, int sizeClass)
+{
+	Page* page = heap->emptyPages;
+	if (page != NULL)		// reuse an empty page, its bitmaps were cleared when it was swept
+	{
+		heap->emptyPages = page->next;
+		heap->emptyCount--;
+	}
+	else
+	{
+		// descriptors are malloc'd, like the gray stack they are not counted as heap
+		page = (Page*)malloc(sizeof(Page));
+		uint8_t* memory = (uint8_t*)allocatePages(PAGE_SIZE);
+		if (page == NULL || memory == NULL)			// out of memory, the caller decides what to do
+		{
+			free(page);
+			if (memory != NULL) freePages(memory, PAGE_SIZE);
+			return NULL;
+		}
+
+		*(Page**)memory = page;
+		page->cells = memory + PAGE_HEADER_SIZE;
+		memset(page->allocated, 0, sizeof(page->allocated));
+		memset((void*)page->marked, 0, sizeof(page->marked));
+	}
+
+	page->sizeClass = sizeClass;
+	page->cellSize = (sizeClass + 1) * CELL_ALIGNMENT;
+	page->cellDivider = (uint32_t)(((uint64_t)1 << 32) / page->cellSize + 1);
+	page->cellCount = (int)((PAGE_SIZE - PAGE_HEADER_SIZE) / page->cellSize);
+	page->wordCount = (page->cellCount + 63) / 64;
+	page->searchWord = 0;
+	page->liveCount = 0;
+	page->isAvailable = true;
+	page->needsSweep = false;
+	page->isEvacuating = false;
+	page->lastWordMask = page->cellCount % 64 == 0 ? ~(uint64_t)0 : ((uint64_t)1 << (page->cellCount % 64)) - 1;
+
+	page->next = heap->pages;
+	heap->pages = page;
+	heap->pageCount++;
+	return page;
+}
+
+// the first free cell of the page, NULL if it is full
+static void* takeCell(Page* page)
+{
+	for (int word = page->searchWord; word < page->wordCount; word++)
+	{
+		uint64_t open = ~page->allocated[word] & usableBits(page, word);
+		if (open == 0) continue;
+
+		int bit = lowestBit(open);
+		page->allocated[word] |= (uint64_t)1 << bit;
+		page->searchWord = word;
+		page->liveCount++;
+		return cellAt(page, word * 64 + bit);
+	}
+
+	page->searchWord = page->wordCount;
+	return NULL;
+}
+
+// free cells are found in the allocated bitmap, they are never written to until they are handed out
+void* allocateCell(Heap* heap, size_t size)
+{
+	if (size > MAX_CELL_SIZE) return NULL;		// every object type fits in the largest class, the caller reports it
+
+	int sizeClass = (int)((size + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT) - 1;
+	SizeClass* bucket = &heap->sizeClasses[sizeClass];
+
+	while (true)
+	{
+		if (bucket->current != NULL)
+		{
+			void* cell = takeCell(bucket->current);
+			if (cell != NULL) return cell;
+			bucket->current->isAvailable = false;		// full, freeCell makes it available again
+		}
+
+		if (bucket->available != NULL)
+		{
+			bucket->current = bucket->available;
+			bucket->available = bucket->available->nextAvailable;
+		}
+		else
+		{
+			bucket->current = newPage(heap, sizeClass);
+			if (bucket->current == NULL) return NULL;
+		}
+	}
+}
+
+void freeCell(Heap* heap, void* cell)
+{
+	Page* page = pageOf(cell);
+	int index = cellIndex(page, cell);
+	page->allocated[index / 64] &= ~((uint64_t)1 << (index % 64));
+	page->liveCount--;
+	if (index / 64 < page->searchWord) page->searchWord = index / 64;
+
+	if (page->isAvailable || page->needsSweep) return;		// the sweep makes it available
+
+	page->isAvailable = true;
+	page->nextAvailable = heap->sizeClasses[page->sizeClass].available;
+	heap->sizeClasses[page->sizeClass].available = page;
+}
+
+bool claimCell(void* cell)
+{
+	Page* page = pageOf(cell);
+	int index = cellIndex(page, cell);
+	uint64_t bit = (uint64_t)1 << (index % 64);
+	volatile uint64_t* word = &page->marked[index / 64];
+
+	if (atomicLoadBits(word) & bit) return false;		// reading first, the locked or is not free
+	return (atomicOrBits(word, bit) & bit) == 0;
+}
+
+
+/*		sweeping
+-> after marking, the available lists are dropped and every page is swept before it is allocated from again
+-> the collector clears the allocated bits of the dead cells of a page, then finishPageSweep either
+	releases the whole page or puts it back on the available list of its size class
+*/
+
+void prepareSweep(Heap* heap)
+{
+	for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+	{
+		heap->sizeClasses[i].current = NULL;
+		heap->sizeClasses[i].available = NULL;
+	}
+
+	for (Page* page = heap->pages; page != NULL; page = page->next)
+	{
+		page->needsSweep = true;
+		page->isAvailable = false;
+	}
+}
+
+bool finishPageSweep(Heap* heap, Page** link)
+{
+	Page* page = *link;
+	page->needsSweep = false;
+
+	int live = 0;
+	for (int i = 0; i < page->wordCount; i++)
+	{
+		uint64_t word = page->allocated[i];
+		while (word != 0)			// count the set bits
+		{
+			word &= word - 1;
+			live++;
+		}
+	}
+	page->liveCount = live;
+
+	if (live == 0)			// nothing left, the page is kept for reuse or goes back to the operating system
+	{
+		*link = page->next;
+		heap->pageCount--;
+
+		if (heap->emptyCount < EMPTY_PAGES_MIN || heap->emptyCount < heap->pageCount / 4)
+		{
+			page->next = heap->emptyPages;
+			heap->emptyPages = page;
+			heap->emptyCount++;
+		}
+		else
+		{
+			releasePage(page);
+		}
+		return false;
+	}
+
+	if (live < page->cellCount)
+	{
+		SizeClass* bucket = &heap->sizeClasses[page->sizeClass];
+		page->searchWord = 0;
+		page->isAvailable = true;
+		page->nextAvailable = bucket->available;
+		bucket->available = page;
+	}
+	return true;
+}
+
+/*		end of sweeping		 */
+
+
+/*		compaction
+-> the live cells of a size class fit in ceil(live / cells per page) pages, the densest pages of the class are kept
+	and the objects of the others are moved into their free cells
+-> moving the objects and updating the pointers to them is up to the collector, it knows the object layouts
+*/
+
+// pages a compaction would keep for each size class
+static void countNeededPages(Heap* heap, int needed[SIZE_CLASS_COUNT])
+{
+	int live[SIZE_CLASS_COUNT] = { 0 };
+	int cellCount[SIZE_CLASS_COUNT] = { 0 };
+
+	for (Page* page = heap->pages; page != NULL; page = page->next)
+	{
+		live[page->sizeClass] += page->liveCount;
+		cellCount[page->sizeClass] = page->cellCount;
+	}
+
+	for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+	{
+		needed[i] = live[i] == 0 ? 0 : (live[i] + cellCount[i] - 1) / cellCount[i];
+	}
+}
+
+int reclaimablePages(Heap* heap)
+{
+	int needed[SIZE_CLASS_COUNT];
+	countNeededPages(heap, needed);
+
+	int neededTotal = 0;
+	for (int i = 0; i < SIZE_CLASS_COUNT; i++) neededTotal += needed[i];
+	return heap->pageCount + heap->emptyCount - neededTotal;
+}
+
+static int compareDensity(const void* a, const void* b)
+{
+	return (*(Page**)b)->liveCount - (*(Page**)a)->liveCount;		// most live cells first
+}
+
+int selectEvacuation(Heap* heap)
+{
+	int needed[SIZE_CLASS_COUNT];
+	countNeededPages(heap, needed);
+
+	Page** pages = (Page**)malloc(sizeof(Page*) * (heap->pageCount + 1));
+	if (pages == NULL) return 0;		// nothing is flagged, the heap is compacted by a later cycle
+
+	int selected = 0;
+	for (int sizeClass = 0; sizeClass < SIZE_CLASS_COUNT; sizeClass++)
+	{
+		int count = 0;
+		for (Page* page = heap->pages; page != NULL; page = page->next)
+		{
+			if (page->sizeClass == sizeClass) pages[count++] = page;
+		}
+
+		qsort(pages, count, sizeof(Page*), compareDensity);
+
+		SizeClass* bucket = &heap->sizeClasses[sizeClass];
+		bucket->current = NULL;
+		bucket->available = NULL;
+
+		for (int i = count - 1; i >= 0; i--)		// sparsest first, so the densest page ends up at the head of the list
+		{
+			Page* page = pages[i];
+			page->isAvailable = false;
+
+			if (i >= needed[sizeClass])
+			{
+				page->isEvacuating = true;
+				selected++;
+			}
+			else if (page->liveCount < page->cellCount)
+			{
+				page->searchWord = 0;
+				page->isAvailable = true;
+				page->nextAvailable = bucket->available;
+				bucket->available = page;
+			}
+		}
+	}
+
+	free(pages);
+	return selected;
+}
+
+void releaseEvacuated(Heap* heap)
+{
+	Page** link = &heap->pages;
+	while (*link != NULL)
+	{
+		Page* page = *link;
+		if (page->isEvacuating)
+		{
+			*link = page->next;
+			heap->pageCount--;
+			releasePage(page);
+		}
+		else
+		{
+			link = &page->next;
+		}
+	}
+
+	freePageList(heap->emptyPages);
+	heap->emptyPages = NULL;
+	heap->emptyCount = 0;
+}
+
+/*		end of compaction		 */
@@ -0,0 +1,137 @@
+// the heap of garbage collected objects
+// objects are not allocated with realloc, they live in 64KB pages that each hold cells of one size class
+// a page's descriptor is kept apart from its cells, with a bitmap of the allocated cells and one of the marked cells
+// -> the collector only writes to the descriptors, marking and sweeping leave the memory of the objects untouched,
+//	so processes forked from a common parent keep sharing their heap pages after a collection
+
+#ifndef heap_h
+#define heap_h
+
+#include "common.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define PAGE_SIZE (64 * 1024)
+#define CELL_ALIGNMENT 16
+#define SIZE_CLASS_COUNT 16				// cells of 16, 32, 48 ... 256 bytes
+#define MAX_CELL_SIZE (CELL_ALIGNMENT * SIZE_CLASS_COUNT)
+#define PAGE_BITMAP_WORDS (PAGE_SIZE / CELL_ALIGNMENT / 64)		// one bit for every cell the page could hold
+#define EMPTY_PAGES_MIN 16				// empty pages kept for reuse, at least this many or a quarter of the heap
+
+typedef struct Page
+{
+	struct Page* next;			// every page of the heap
+	struct Page* nextAvailable;	// pages of the same size class with free cells
+	uint8_t* cells;				// the page memory, after the pointer back to this descriptor
+	int sizeClass;
+	int cellSize;
+	uint32_t cellDivider;		// 2^32 / cellSize rounded up, dividing by multiplying is exact for offsets inside a page
+	int cellCount;				// cells that fit in the page
+	int wordCount;				// bitmap words in use
+	int searchWord;				// the allocated words before it are full
+	int liveCount;				// allocated cells
+	bool isAvailable;			// allocations may come from it, it is the current page or on the available list
+	bool needsSweep;			// allocated before the last marking ended, not swept since
+	bool isEvacuating;			// its objects are being moved out by a compaction
+	uint64_t lastWordMask;		// bits of the last word that stand for cells
+	uint64_t allocated[PAGE_BITMAP_WORDS];
+	volatile uint64_t marked[PAGE_BITMAP_WORDS];
+} Page;
+
+typedef struct
+{
+	Page* current;				// page cells are allocated from
+	Page* available;			// other pages with free cells
+} SizeClass;
+
+typedef struct
+{
+	Page* pages;
+	int pageCount;
+	Page* emptyPages;			// swept empty pages kept instead of unmapping and mapping them again right away
+	int emptyCount;
+	SizeClass sizeClasses[SIZE_CLASS_COUNT];
+} Heap;
+
+// pages are aligned to their size and start with a pointer to their descriptor
+static inline Page* pageOf(void* cell)
+{
+	return *(Page**)((uintptr_t)cell & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline int cellIndex(Page* page, void* cell)
+{
+	return (int)(((uint64_t)((uint8_t*)cell - page->cells) * page->cellDivider) >> 32);
+}
+
+static inline void* cellAt(Page* page, int index)
+{
+	return page->cells + (size_t)index * page->cellSize;
+}
+
+static inline bool isAllocated(Page* page, int index)
+{
+	return (page->allocated[index / 64] >> (index % 64)) & 1;
+}
+
+// bits of a bitmap word that stand for cells, only the last word is partly used
+static inline uint64_t usableBits(Page* page, int word)
+{
+	return word == page->wordCount - 1 ? page->lastWordMask : ~(uint64_t)0;
+}
+
+// index of the lowest set bit, bits must not be 0
+static inline int lowestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return (int)index;
+#else
+	return __builtin_ctzll(bits);
+#endif
+}
+
+// marks, kept in the page descriptor instead of the object header
+static inline bool isCellMarked(void* cell)
+{
+	Page* page = pageOf(cell);
+	int index = cellIndex(page, cell);
+	return (page->marked[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void setCellMarked(void* cell)
+{
+	Page* page = pageOf(cell);
+	int index = cellIndex(page, cell);
+	page->marked[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static inline void clearCellMark(void* cell)
+{
+	Page* page = pageOf(cell);
+	int index = cellIndex(page, cell);
+	page->marked[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+// marks the cell atomically, returns false if it was marked already, by this or another thread
+bool claimCell(void* cell);
+
+void initHeap(Heap* heap);
+void freeHeap(Heap* heap);			// releases every page, the objects must have been freed
+
+void* allocateCell(Heap* heap, size_t size);		// NULL if no page could be mapped or size is past the largest cell
+void freeCell(Heap* heap, void* cell);
+
+// sweeping, the collector decides which cells are dead and clears their allocated bits
+void prepareSweep(Heap* heap);			// every page needs a sweep, no cell is allocated from a page before it is swept
+bool finishPageSweep(Heap* heap, Page** link);		// link points at the page, returns false if it was empty and is unlinked
+
+// compaction, only after a complete sweep when every allocated cell is live
+int reclaimablePages(Heap* heap);			// pages a compaction would give back, empty pages kept for reuse included
+int selectEvacuation(Heap* heap);			// flags the pages to move out of, allocations only go to the others, 0 if none
+void releaseEvacuated(Heap* heap);			// the flagged pages and the empty pages kept for reuse go back to the os
+
+#endif
@@ -0,0 +1,501 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcstats.h"
+#include "heapreport.h"
+#include "heapsnap.h"
+
+#define REPORT_TOP 20				// objects listed by retained size
+#define REPORT_CLASSES 10			// classes listed by the bytes of their instances
+#define PATH_SHOWN 8				// longer paths from the roots are cut in the middle
+
+// the graph of a snapshot, edges of node i are edgeTo[firstEdge[i]] to edgeTo[firstEdge[i + 1] - 1]
+typedef struct
+{
+	long nodeCount;
+	int* types;
+	size_t* sizes;
+	size_t* previews;				// offsets into text
+	long* firstEdge;
+
+	long edgeCount;
+	long edgeCapacity;
+	long* edgeTo;
+	size_t* edgeNames;
+
+	char* text;						// previews and edge names, each null terminated
+	size_t textLength;
+	size_t textCapacity;
+} Graph;
+
+static void freeGraph(Graph* graph)
+{
+	free(graph->types);
+	free(graph->sizes);
+	free(graph->previews);
+	free(graph->firstEdge);
+	free(graph->edgeTo);
+	free(graph->edgeNames);
+	free(graph->text);
+}
+
+// offset of the copied text, (size_t)-1 if there is no memory for it
+static size_t addText(Graph* graph, const char* chars)
+{
+	size_t length = strlen(chars) + 1;
+	if (graph->textLength + length > graph->textCapacity)
+	{
+		size_t capacity = graph->textCapacity < 4096 ? 4096 : graph->textCapacity * 2;
+		while (capacity < graph->textLength + length) capacity *= 2;
+		char* text = (char*)realloc(graph->text, capacity);
+		if (text == NULL) return (size_t)-1;
+
+		graph->text = text;
+		graph->textCapacity = capacity;
+	}
+
+	size_t offset = graph->textLength;
+	memcpy(graph->text + offset, chars, length);
+	graph->textLength += length;
+	return offset;
+}
+
+static bool addEdge(Graph* graph, long to, const char* name)
+{
+	if (graph->edgeCount == graph->edgeCapacity)
+	{
+		long capacity = graph->edgeCapacity < 1024 ? 1024 : graph->edgeCapacity * 2;
+		long* edgeTo = (long*)realloc(graph->edgeTo, sizeof(long) * capacity);
+		if (edgeTo == NULL) return false;
+		graph->edgeTo = edgeTo;
+
+		size_t* edgeNames = (size_t*)realloc(graph->edgeNames, sizeof(size_t) * capacity);
+		if (edgeNames == NULL) return false;
+		graph->edgeNames = edgeNames;
+		graph->edgeCapacity = capacity;
+	}
+
+	size_t offset = addText(graph, name);
+	if (offset == (size_t)-1) return false;
+
+	graph->edgeTo[graph->edgeCount] = to;
+	graph->edgeNames[graph->edgeCount] = offset;
+	graph->edgeCount++;
+	return true;
+}
+
+// the text after a record's numbers, without the newline
+static char* restOfLine(char* cursor)
+{
+	if (*cursor == ' ') cursor++;
+	cursor[strcspn(cursor, "\r\n")] = '\0';
+	return cursor;
+}
+
+static bool readGraph(FILE* file, Graph* graph)
+{
+	char line[512];
+	int version;
+	if (fgets(line, sizeof(line), file) == NULL) return false;
+	if (sscanf(line, "feiheap %d %ld", &version, &graph->nodeCount) != 2) return false;
+	if (version != SNAPSHOT_VERSION || graph->nodeCount < 1) return false;
+
+	long count = graph->nodeCount;
+	graph->types = (int*)malloc(sizeof(int) * count);
+	graph->sizes = (size_t*)malloc(sizeof(size_t) * count);
+	graph->previews = (size_t*)malloc(sizeof(size_t) * count);
+	graph->firstEdge = (long*)malloc(sizeof(long) * (count + 1));
+	if (graph->types == NULL || graph->sizes == NULL || graph->previews == NULL || graph->firstEdge == NULL) return false;
+
+	long node = -1;
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char* cursor = line + 2;
+		if (line[0] == 'n' && line[1] == ' ')
+		{
+			if (++node == count) return false;
+			graph->types[node] = (int)strtol(cursor, &cursor, 10);
+			graph->sizes[node] = (size_t)strtoull(cursor, &cursor, 10);
+			graph->previews[node] = addText(graph, restOfLine(cursor));
+			graph->firstEdge[node] = graph->edgeCount;
+			if (graph->previews[node] == (size_t)-1) return false;
+		}
+		else if (line[0] == 'e' && line[1] == ' ' && node >= 0)
+		{
+			long to = strtol(cursor, &cursor, 10);
+			if (to < 0 || to >= count) return false;
+			if (!addEdge(graph, to, restOfLine(cursor))) return false;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	graph->firstEdge[count] = graph->edgeCount;
+	return node == count - 1;
+}
+
+
+/*		dominators		*/
+
+typedef struct
+{
+	long* postorder;				// reachable nodes, the roots last
+	long reachable;
+	long* order;					// position of each node in postorder, -1 if unreachable
+	long* dominator;				// immediate dominator, the roots dominate themselves
+	size_t* retained;
+} Dominators;
+
+static void freeDominators(Dominators* tree)
+{
+	free(tree->postorder);
+	free(tree->order);
+	free(tree->dominator);
+	free(tree->retained);
+}
+
+// depth first from the roots, with an explicit stack as heaps make deep graphs
+static bool numberNodes(Graph* graph, Dominators* tree)
+{
+	long count = graph->nodeCount;
+	long* stack = (long*)malloc(sizeof(long) * count);
+	long* nextEdge = (long*)malloc(sizeof(long) * count);
+	if (stack == NULL || nextEdge == NULL)
+	{
+		free(stack);
+		free(nextEdge);
+		return false;
+	}
+
+	for (long i = 0; i < count; i++) tree->order[i] = -1;
+	tree->reachable = 0;
+
+	long top = 0;
+	stack[top++] = 0;
+	nextEdge[0] = graph->firstEdge[0];
+	tree->order[0] = -2;			// on the stack
+
+	while (top > 0)
+	{
+		long node = stack[top - 1];
+		if (nextEdge[node] < graph->firstEdge[node + 1])
+		{
+			long child = graph->edgeTo[nextEdge[node]++];
+			if (tree->order[child] != -1) continue;
+
+			tree->order[child] = -2;
+			nextEdge[child] = graph->firstEdge[child];
+			stack[top++] = child;
+			continue;
+		}
+
+		top--;
+		tree->order[node] = tree->reachable;
+		tree->postorder[tree->reachable++] = node;
+	}
+
+	free(stack);
+	free(nextEdge);
+	return true;
+}
+
+static long intersect(Dominators* tree, long a, long b)
+{
+	while (a != b)
+	{
+		while (tree->order[a] < tree->order[b]) a = tree->dominator[a];
+		while (tree->order[b] < tree->order[a]) b = tree->dominator[b];
+	}
+	return a;
+}
+
+static bool findDominators(Graph* graph, Dominators* tree)
+{
+	long count = graph->nodeCount;
+	tree->postorder = (long*)malloc(sizeof(long) * count);
+	tree->order = (long*)malloc(sizeof(long) * count);
+	tree->dominator = (long*)malloc(sizeof(long) * count);
+	tree->retained = (size_t*)malloc(sizeof(size_t) * count);
+	if (tree->postorder == NULL || tree->order == NULL || tree->dominator == NULL || tree->retained == NULL) return false;
+	if (!numberNodes(graph, tree)) return false;
+
+	// predecessors of every reachable node, the reversed edges
+	long* firstPredecessor = (long*)calloc(count + 1, sizeof(long));
+	long* predecessors = (long*)malloc(sizeof(long) * (graph->edgeCount + 1));
+	if (firstPredecessor == NULL || predecessors == NULL)
+	{
+		free(firstPredecessor);
+		free(predecessors);
+		return false;
+	}
+
+	for (long from = 0; from < count; from++)
+	{
+		if (tree->order[from] < 0) continue;
+		for (long edge = graph->firstEdge[from]; edge < graph->firstEdge[from + 1]; edge++)
+		{
+			firstPredecessor[graph->edgeTo[edge] + 1]++;
+		}
+	}
+	for (long i = 0; i < count; i++) firstPredecessor[i + 1] += firstPredecessor[i];
+	for (long from = 0; from < count; from++)
+	{
+		if (tree->order[from] < 0) continue;
+		for (long edge = graph->firstEdge[from]; edge < graph->firstEdge[from + 1]; edge++)
+		{
+			long to = graph->edgeTo[edge];
+			predecessors[firstPredecessor[to]++] = from;
+		}
+	}
+	for (long i = count; i > 0; i--) firstPredecessor[i] = firstPredecessor[i - 1];		// back to the first of each
+	firstPredecessor[0] = 0;
+
+	// every node's dominator is the nearest common dominator of its predecessors, until nothing changes
+	for (long i = 0; i < count; i++) tree->dominator[i] = -1;
+	tree->dominator[0] = 0;
+
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (long i = tree->reachable - 2; i >= 0; i--)		// reverse postorder, the roots excluded
+		{
+			long node = tree->postorder[i];
+			long dominator = -1;
+			for (long p = firstPredecessor[node]; p < firstPredecessor[node + 1]; p++)
+			{
+				long predecessor = predecessors[p];
+				if (tree->dominator[predecessor] == -1) continue;
+				dominator = dominator == -1 ? predecessor : intersect(tree, predecessor, dominator);
+			}
+
+			if (tree->dominator[node] != dominator)
+			{
+				tree->dominator[node] = dominator;
+				changed = true;
+			}
+		}
+	}
+
+	free(firstPredecessor);
+	free(predecessors);
+
+	// a dominator comes after the nodes it dominates in postorder, their sizes are added up on the way
+	for (long i = 0; i < count; i++) tree->retained[i] = tree->order[i] < 0 ? 0 : graph->sizes[i];
+	for (long i = 0; i < tree->reachable - 1; i++)
+	{
+		long node = tree->postorder[i];
+		tree->retained[tree->dominator[node]] += tree->retained[node];
+	}
+	return true;
+}
+
+
+/*		report		*/
+
+static const char* typeName(int type)
+{
+	return type < 0 ? "roots" : objTypeName((ObjType)type);
+}
+
+static size_t* sortKeys;
+
+static int compareKeys(const void* a, const void* b)
+{
+	size_t first = sortKeys[*(long*)a];
+	size_t second = sortKeys[*(long*)b];
+	return first < second ? 1 : first > second ? -1 : 0;
+}
+
+static void reportTypes(Graph* graph, Dominators* tree, FILE* out)
+{
+	long objects[OBJ_TYPE_COUNT] = { 0 };
+	size_t bytes[OBJ_TYPE_COUNT] = { 0 };
+	size_t total = 0;
+
+	for (long i = 1; i < graph->nodeCount; i++)
+	{
+		int type = graph->types[i];
+		if (type < 0 || type >= OBJ_TYPE_COUNT) continue;
+		objects[type]++;
+		bytes[type] += graph->sizes[i];
+		total += graph->sizes[i];
+	}
+
+	fprintf(out, "%ld objects, %zu bytes", graph->nodeCount - 1, total);
+	if (tree->reachable < graph->nodeCount) fprintf(out, ", %ld not reachable from the roots", graph->nodeCount - tree->reachable);
+	fprintf(out, "\n\n%14s %10s %12s\n", "type", "objects", "bytes");
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+	{
+		if (objects[type] != 0) fprintf(out, "%14s %10ld %12zu\n", objTypeName((ObjType)type), objects[type], bytes[type]);
+	}
+}
+
+static Graph* sortedGraph;
+
+static int comparePreviews(const void* a, const void* b)
+{
+	return strcmp(sortedGraph->text + sortedGraph->previews[*(long*)a], sortedGraph->text + sortedGraph->previews[*(long*)b]);
+}
+
+// instances grouped by the class name, which is their preview
+// classes holds the first instance of each class, bytes and objects are kept at that instance's node
+static void listClasses(Graph* graph, long* instances, long* classes, size_t* bytes, long* objects, FILE* out)
+{
+	long count = 0;
+	for (long i = 1; i < graph->nodeCount; i++)
+	{
+		if (graph->types[i] == OBJ_INSTANCE) instances[count++] = i;
+	}
+	if (count == 0) return;
+
+	sortedGraph = graph;
+	qsort(instances, count, sizeof(long), comparePreviews);
+
+	long classCount = 0;
+	for (long i = 0; i < count; i++)
+	{
+		if (i == 0 || comparePreviews(&instances[i], &instances[i - 1]) != 0) classes[classCount++] = instances[i];
+		long first = classes[classCount - 1];
+		bytes[first] += graph->sizes[instances[i]];
+		objects[first]++;
+	}
+
+	sortKeys = bytes;
+	qsort(classes, classCount, sizeof(long), compareKeys);
+
+	fprintf(out, "\n%14s %10s %12s\n", "instances of", "objects", "bytes");
+	for (long i = 0; i < classCount && i < REPORT_CLASSES; i++)
+	{
+		fprintf(out, "%14.14s %10ld %12zu\n", graph->text + graph->previews[classes[i]], objects[classes[i]], bytes[classes[i]]);
+	}
+	if (classCount > REPORT_CLASSES) fprintf(out, "... %ld more classes\n", classCount - REPORT_CLASSES);
+}
+
+static void reportClasses(Graph* graph, FILE* out)
+{
+	long* instances = (long*)malloc(sizeof(long) * graph->nodeCount);
+	long* classes = (long*)malloc(sizeof(long) * graph->nodeCount);
+	size_t* bytes = (size_t*)calloc(graph->nodeCount, sizeof(size_t));
+	long* objects = (long*)calloc(graph->nodeCount, sizeof(long));
+
+	if (instances != NULL && classes != NULL && bytes != NULL && objects != NULL)
+	{
+		listClasses(graph, instances, classes, bytes, objects, out);
+	}
+
+	free(instances);
+	free(classes);
+	free(bytes);
+	free(objects);
+}
+
+// edge names along the shortest path from the roots, found by a breadth first search
+static void printPath(Graph* graph, long* parentEdge, long* parent, long node, FILE* out)
+{
+	long path[PATH_SHOWN + 1];
+	long depth = 0;
+	long skipped = 0;
+
+	// walking up from the node, the last edges are kept and the ones near the roots are cut
+	for (long at = node; at != 0; at = parent[at])
+	{
+		if (depth < PATH_SHOWN) path[depth++] = parentEdge[at];
+		else skipped++;
+	}
+
+	if (skipped > 0) fprintf(out, "... ");
+	for (long i = depth - 1; i >= 0; i--)
+	{
+		fprintf(out, "%s%s", graph->text + graph->edgeNames[path[i]], i > 0 ? " > " : "");
+	}
+}
+
+// nodes doubles as the queue of the search, and ends up with the reachable nodes sorted by retained size
+// an object dominated by one already listed is part of its retained size, a linked list would fill the list otherwise
+static void listRetainers(Graph* graph, Dominators* tree, long* nodes, long* parent, long* parentEdge, bool* isListed, FILE* out)
+{
+	for (long i = 0; i < graph->nodeCount; i++) parent[i] = -1;
+	parent[0] = 0;
+	long head = 0;
+	long tail = 0;
+	nodes[tail++] = 0;
+	while (head < tail)
+	{
+		long node = nodes[head++];
+		for (long edge = graph->firstEdge[node]; edge < graph->firstEdge[node + 1]; edge++)
+		{
+			long to = graph->edgeTo[edge];
+			if (parent[to] != -1) continue;
+			parent[to] = node;
+			parentEdge[to] = edge;
+			nodes[tail++] = to;
+		}
+	}
+
+	// the roots come first in the queue, they retain everything
+	sortKeys = tree->retained;
+	qsort(nodes + 1, tail - 1, sizeof(long), compareKeys);
+
+	fprintf(out, "\n%12s %10s %-12s %-22s %s\n", "retained", "self", "type", "object", "path from the roots");
+	int listed = 0;
+	for (long i = 1; i < tail && listed < REPORT_TOP; i++)
+	{
+		long node = nodes[i];
+		isListed[node] = true;
+		if (isListed[tree->dominator[node]]) continue;
+
+		listed++;
+		fprintf(out, "%12zu %10zu %-12s %-22.22s ", tree->retained[node], graph->sizes[node],
+			typeName(graph->types[node]), graph->text + graph->previews[node]);
+		printPath(graph, parentEdge, parent, node, out);
+		fprintf(out, "\n");
+	}
+}
+
+static void reportRetainers(Graph* graph, Dominators* tree, FILE* out)
+{
+	long* nodes = (long*)malloc(sizeof(long) * graph->nodeCount);
+	long* parent = (long*)malloc(sizeof(long) * graph->nodeCount);
+	long* parentEdge = (long*)malloc(sizeof(long) * graph->nodeCount);
+	bool* isListed = (bool*)calloc(graph->nodeCount, sizeof(bool));
+
+	if (nodes != NULL && parent != NULL && parentEdge != NULL && isListed != NULL)
+	{
+		listRetainers(graph, tree, nodes, parent, parentEdge, isListed, out);
+	}
+
+	free(isListed);
+	free(nodes);
+	free(parent);
+	free(parentEdge);
+}
+
+bool reportHeapSnapshot(const char* path, FILE* out)
+{
+	FILE* file = fopen(path, "r");
+	if (file == NULL) return false;
+
+	Graph graph;
+	memset(&graph, 0, sizeof(Graph));
+	Dominators tree;
+	memset(&tree, 0, sizeof(Dominators));
+
+	bool isRead = readGraph(file, &graph);
+	fclose(file);
+
+	bool isDone = isRead && findDominators(&graph, &tree);
+	if (isDone)
+	{
+		fprintf(out, "== heap snapshot %s ==\n", path);
+		reportTypes(&graph, &tree, out);
+		reportClasses(&graph, out);
+		reportRetainers(&graph, &tree, out);
+	}
+
+	freeDominators(&tree);
+	freeGraph(&graph);
+	return isDone;
+}
@@ -0,0 +1,18 @@
+// offline analysis of a heap snapshot written by heapsnap.c, cfei --snapshot-report file
+// -> the retained size of an object is what a collection would free if that object alone became unreachable:
+//	itself and every object it dominates, those that can only be reached from the roots through it
+// -> dominators come from the iterative algorithm of Cooper, Harvey and Kennedy over a reverse postorder of the graph
+// -> the report lists the objects and bytes of each type, the instances of each class, and the objects retaining the
+//	most memory, leaving out those retained by an object already listed, with the shortest path of references from
+//	the roots to each of them
+
+#ifndef heapreport_h
+#define heapreport_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+bool reportHeapSnapshot(const char* path, FILE* out);		// false if the file cannot be read or is not a snapshot
+
+#endif
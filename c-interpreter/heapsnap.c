@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapsnap.h"
+#include "memory.h"
+#include "object.h"
+#include "platform.h"
+#include "virtualm.h"
+
+volatile sig_atomic_t heapSnapshotRequested = 0;
+
+// the snapshot being written, nodes are numbered by the address of their object, the roots being node 0
+typedef struct
+{
+	FILE* file;
+	Obj** objects;			// sorted by address, malloc'd as nothing may be allocated on the heap while writing
+	long count;
+	long capacity;
+	bool isFull;			// the object array could not grow
+} Snapshot;
+
+static Snapshot snapshot;
+
+static void collectObject(Obj* object)
+{
+	if (snapshot.count == snapshot.capacity)
+	{
+		long capacity = GROW_CAPACITY(snapshot.capacity);
+		Obj** objects = (Obj**)realloc(snapshot.objects, sizeof(Obj*) * capacity);
+		if (objects == NULL)
+		{
+			snapshot.isFull = true;
+			return;
+		}
+
+		snapshot.objects = objects;
+		snapshot.capacity = capacity;
+	}
+
+	snapshot.objects[snapshot.count++] = object;
+}
+
+static int compareAddresses(const void* a, const void* b)
+{
+	Obj* first = *(Obj**)a;
+	Obj* second = *(Obj**)b;
+	return first < second ? -1 : first > second;
+}
+
+static long nodeOf(Obj* object)
+{
+	Obj** found = (Obj**)bsearch(&object, snapshot.objects, snapshot.count, sizeof(Obj*), compareAddresses);
+	return found == NULL ? -1 : found - snapshot.objects + 1;
+}
+
+
+/*		text		*/
+
+// the rest of the line, control characters escaped so the record stays on one line
+static void writeText(const char* chars, int length)
+{
+	int written = 0;
+	for (int i = 0; i < length && written < SNAPSHOT_TEXT_MAX; i++, written++)
+	{
+		unsigned char c = (unsigned char)chars[i];
+		if (c == '\n') fputs("\\n", snapshot.file);
+		else if (c == '\t') fputs("\\t", snapshot.file);
+		else if (c == '\\') fputs("\\\\", snapshot.file);
+		else if (c < ' ' || c == 127) fprintf(snapshot.file, "\\x%02x", c);
+		else fputc(c, snapshot.file);
+	}
+	if (length > SNAPSHOT_TEXT_MAX) fputs("...", snapshot.file);
+	fputc('\n', snapshot.file);
+}
+
+static void writeName(ObjString* name)
+{
+	if (name == NULL) writeText("script", 6);
+	else writeText(name->chars, name->length);
+}
+
+static void writeNode(int type, size_t size)
+{
+	fprintf(snapshot.file, "n %d %zu ", type, size);
+}
+
+static void writePreview(Obj* object)
+{
+	writeNode(object->type, objectBytes(object));
+
+	char text[64];
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD: writeName(((ObjBoundMethod*)object)->method->function->name); break;
+	case OBJ_BYTES:
+	{
+		ObjBytes* bytes = (ObjBytes*)object;
+		int length = snprintf(text, sizeof(text), "%zu bytes%s", bytes->length,
+			bytes->parent != NULL ? ", slice" : bytes->isMapped ? ", mapped" : "");
+		writeText(text, length);
+		break;
+	}
+	case OBJ_CLASS: writeName(((ObjClass*)object)->name); break;
+	case OBJ_CLOSURE: writeName(((ObjClosure*)object)->function->name); break;
+	case OBJ_FUNCTION: writeName(((ObjFunction*)object)->name); break;
+	case OBJ_INSTANCE: writeName(((ObjInstance*)object)->kelas->name); break;
+	case OBJ_STRING: writeText(((ObjString*)object)->chars, ((ObjString*)object)->length); break;
+	case OBJ_STRING_BUILDER: writeText(((ObjStringBuilder*)object)->chars, ((ObjStringBuilder*)object)->length); break;
+	case OBJ_WEAK_MAP:
+	{
+		int length = snprintf(text, sizeof(text), "%d entries", ((ObjWeakMap*)object)->count);
+		writeText(text, length);
+		break;
+	}
+	case OBJ_NATIVE:
+	case OBJ_UPVALUE:
+	case OBJ_WEAK_REF:
+		writeText("", 0);
+		break;
+	}
+}
+
+
+/*		edges		*/
+
+static void writeEdge(Obj* to, const char* name)
+{
+	if (to == NULL) return;
+
+	long node = nodeOf(to);
+	if (node < 0) return;			// an object allocated after the walk, cannot happen unless writing allocates
+	fprintf(snapshot.file, "e %ld ", node);
+	writeText(name, (int)strlen(name));
+}
+
+static void writeValueEdge(Value value, const char* name)
+{
+	if (IS_OBJ(value)) writeEdge(AS_OBJ(value), name);
+}
+
+static void writeIndexEdge(Value value, int index)
+{
+	char name[16];
+	snprintf(name, sizeof(name), "[%d]", index);
+	writeValueEdge(value, name);
+}
+
+// a value for every key, named by the key
+static void writeTableEdges(Table* table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
+
+		writeEdge((Obj*)entry->key, "(key)");
+		if (IS_OBJ(entry->value))
+		{
+			long node = nodeOf(AS_OBJ(entry->value));
+			if (node < 0) continue;
+			fprintf(snapshot.file, "e %ld ", node);
+			writeText(entry->key->chars, entry->key->length);
+		}
+	}
+}
+
+// the same references blackenObject follows
+static void writeEdges(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		writeValueEdge(bound->receiver, "(receiver)");
+		writeEdge((Obj*)bound->method, "(method)");
+		break;
+	}
+	case OBJ_BYTES: writeEdge((Obj*)((ObjBytes*)object)->parent, "(parent)"); break;
+	case OBJ_UPVALUE: writeValueEdge(((ObjUpvalue*)object)->closed, "(closed)"); break;
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		writeEdge((Obj*)function->name, "(name)");
+		for (int i = 0; i < function->chunk.constants.count; i++)
+		{
+			writeIndexEdge(function->chunk.constants.values[i], i);
+		}
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure* closure = (ObjClosure*)object;
+		writeEdge((Obj*)closure->function, "(function)");
+		for (int i = 0; i < closure->upvalueCount; i++)
+		{
+			if (closure->upvalues[i] != NULL) writeIndexEdge(OBJ_VAL(closure->upvalues[i]), i);
+		}
+		break;
+	}
+	case OBJ_CLASS:
+	{
+		ObjClass* kelas = (ObjClass*)object;
+		writeEdge((Obj*)kelas->name, "(name)");
+		writeTableEdges(&kelas->methods);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance* instance = (ObjInstance*)object;
+		writeEdge((Obj*)instance->kelas, "(class)");
+		writeTableEdges(&instance->fields);
+		break;
+	}
+	case OBJ_STRING: writeEdge((Obj*)((ObjString*)object)->owner, "(owner)"); break;
+	case OBJ_WEAK_MAP:
+	{
+		// values are kept alive by their keys, the graph has no such edges and shows them held by the map
+		ObjWeakMap* map = (ObjWeakMap*)object;
+		for (int i = 0; i < map->capacity; i++)
+		{
+			if (map->entries[i].key != NULL) writeValueEdge(map->entries[i].value, "(weak value)");
+		}
+		break;
+	}
+	case OBJ_NATIVE:
+	case OBJ_STRING_BUILDER:
+	case OBJ_WEAK_REF:			// the target is not retained
+		break;
+	}
+}
+
+// the roots markRoots marks, but the compiler's, snapshots are never taken while compiling
+static void writeRoots()
+{
+	writeNode(-1, 0);
+	writeText("(roots)", 7);
+
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) writeIndexEdge(*slot, (int)(slot - vm.stack));
+	for (int i = 0; i < vm.frameCount; i++) writeEdge((Obj*)vm.frames[i].closure, "(frame)");
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+	{
+		writeEdge((Obj*)upvalue, "(open upvalue)");
+	}
+	writeTableEdges(&vm.globals);
+	writeEdge((Obj*)vm.initString, "(init)");
+}
+
+
+long writeHeapSnapshot(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return -1;
+
+	snapshot.file = file;
+	snapshot.objects = NULL;
+	snapshot.count = 0;
+	snapshot.capacity = 0;
+	snapshot.isFull = false;
+
+	forEachLiveObject(collectObject);
+	qsort(snapshot.objects, snapshot.count, sizeof(Obj*), compareAddresses);
+
+	long count = snapshot.count;
+	if (!snapshot.isFull)
+	{
+		fprintf(file, "feiheap %d %ld\n", SNAPSHOT_VERSION, count + 1);
+		writeRoots();
+		for (long i = 0; i < count; i++)
+		{
+			writePreview(snapshot.objects[i]);
+			writeEdges(snapshot.objects[i]);
+		}
+	}
+
+	free(snapshot.objects);
+	snapshot.objects = NULL;
+	if (fclose(file) != 0 || snapshot.isFull) return -1;
+	return count;
+}
+
+
+/*		user signal		*/
+
+static void requestSnapshot(int signal)
+{
+	heapSnapshotRequested = 1;
+}
+
+void enableSnapshotSignal()
+{
+	onUserSignal(requestSnapshot);
+}
+
+void takeRequestedSnapshot()
+{
+	static int taken = 0;
+	heapSnapshotRequested = 0;
+
+	char path[64];
+	snprintf(path, sizeof(path), "heap-%d-%d.heapsnap", processId(), ++taken);
+	long count = writeHeapSnapshot(path);
+
+	if (count < 0) fprintf(stderr, "Could not write the heap snapshot %s.\n", path);
+	else fprintf(stderr, "Heap snapshot of %ld objects written to %s.\n", count, path);
+}
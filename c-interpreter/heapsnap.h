@@ -0,0 +1,36 @@
+// heap snapshots, every live object and every reference between them written to a file for offline analysis
+// -> taken by heapSnapshot(path) in a script, or by sending the user signal to cfei (SIGUSR2, ctrl+break on windows),
+//	which writes heap-<pid>-<n>.heapsnap in the working directory at the next safe point of the interpreter loop
+// -> a full collection runs first, the snapshot only holds objects reachable from the roots markRoots marks
+// -> cfei --snapshot-report file computes retained sizes and dominators from it, see heapreport.h
+
+/* file format, one record per line, numbers in decimal
+	feiheap <version> <node count>
+	n <type> <size> <preview>		a node, the first one is the roots and has type -1, objects follow
+	e <node> <name>					an edge from the last node to the node with that index
+-> type is the ObjType, size is objectBytes, as counted by vm.bytesAllocated
+-> the preview and the edge name run to the end of the line, control characters are escaped and both are cut
+	to SNAPSHOT_TEXT_MAX bytes
+-> edge names are field, method and global names, "[i]" for stack slots, constants and upvalues, "(name)" for the
+	other references an object holds, and "(key)" for the string keys of tables
+-> weak references have no edges, weak maps an edge to each value but none to their keys
+*/
+
+#ifndef heapsnap_h
+#define heapsnap_h
+
+#include <signal.h>
+
+#include "common.h"
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TEXT_MAX 40
+
+long writeHeapSnapshot(const char* path);		// objects written, -1 if the file could not be written
+
+// the user signal only sets the flag, the interpreter takes the snapshot at its next safe point
+extern volatile sig_atomic_t heapSnapshotRequested;
+void enableSnapshotSignal();
+void takeRequestedSnapshot();
+
+#endif
@@ -0,0 +1,618 @@
+#include <string.h>
+
+#include "inliner.h"
+#include "chunk.h"
+#include "memory.h"
+
+// bytes of code a function may have to be inlined, the return the compiler adds at its end included
+#define INLINE_MAX_LENGTH 32
+
+// what is known of a value on the stack of the caller, the instruction that pushed it shifted up one bit
+#define UNKNOWN -1
+#define UNREACHED -2				// state of a jump target no path has been followed to yet
+#define IS_REPLACEABLE 1			// low bit, the value came from a global or from a local a closure captured
+
+// a chunk decoded into instructions, with the stack depth each of them starts at
+typedef struct
+{
+	Chunk* chunk;
+	int count;
+	int* offsets;			// of every instruction, one more for the end of the code
+	int* depths;			// slots in use when it starts, -1 if no path reaches it
+	int* targets;			// instruction a jump goes to, -1 for every other instruction
+	int maxDepth;
+} Code;
+
+// a call of the caller and the function inlined there
+typedef struct
+{
+	ObjFunction* callee;	// NULL where the call is left as it is
+	uint8_t check;			// guard written in front of the body, OP_CALL for none
+	Code body;
+	int slot;				// of the callee or receiver in the caller's frame, slot 0 of the body
+	int bodyLength;			// bytes of the body once its returns are rewritten
+	int length;				// bytes written in place of the call
+} CallSite;
+
+static bool hasConstantOperand(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_CONSTANT:
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_CLASS:
+	case OP_METHOD:
+	case OP_INVOKE:
+	case OP_CHECK_FUNCTION:
+	case OP_CHECK_METHOD:
+		return true;
+	default:
+		return false;		// closures and super are never inlined
+	}
+}
+
+static uint8_t opAt(Code* code, int index)
+{
+	return code->chunk->code[code->offsets[index]];
+}
+
+static uint8_t operandAt(Code* code, int index)
+{
+	return code->chunk->code[code->offsets[index] + 1];
+}
+
+static Value constantAt(Code* code, int index)
+{
+	return code->chunk->constants.values[operandAt(code, index)];
+}
+
+static int lengthAt(Code* code, int index)
+{
+	return code->offsets[index + 1] - code->offsets[index];
+}
+
+void initInlineTargets(InlineTargets* targets)
+{
+	targets->functions = NULL;
+	targets->functionCount = 0;
+	targets->functionCapacity = 0;
+	targets->methods = NULL;
+	targets->methodCount = 0;
+	targets->methodCapacity = 0;
+}
+
+static InlineTarget* findTarget(InlineTarget* targets, int count, ObjString* name)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (targets[i].name == name) return &targets[i];		// identifiers are interned by the compiler
+	}
+	return NULL;
+}
+
+static void addTarget(InlineTarget** targets, int* count, int* capacity, ObjFunction* function, Arena* arena)
+{
+	if (*count == *capacity)
+	{
+		int oldCapacity = *capacity;
+		*capacity = GROW_CAPACITY(oldCapacity);
+		*targets = ARENA_GROW_ARRAY(arena, InlineTarget, *targets, oldCapacity, *capacity);
+	}
+
+	(*targets)[*count].name = function->name;
+	(*targets)[*count].function = function;
+	(*count)++;
+}
+
+void addInlineFunction(InlineTargets* targets, ObjFunction* function, Arena* arena)
+{
+	InlineTarget* target = findTarget(targets->functions, targets->functionCount, function->name);
+	if (target != NULL) target->function = function;
+	else addTarget(&targets->functions, &targets->functionCount, &targets->functionCapacity, function, arena);
+}
+
+// an invoke does not know the class of its receiver, a name two classes declare is left alone
+void addInlineMethod(InlineTargets* targets, ObjFunction* function, Arena* arena)
+{
+	InlineTarget* target = findTarget(targets->methods, targets->methodCount, function->name);
+	if (target == NULL) addTarget(&targets->methods, &targets->methodCount, &targets->methodCapacity, function, arena);
+	else if (target->function != function) target->function = NULL;
+}
+
+// the compiler only jumps back to code the instructions before the jump already lead to
+static bool reach(Code* code, int from, int index, int depth)
+{
+	if (code->depths[index] == -1)
+	{
+		if (index <= from) return false;
+		code->depths[index] = depth;
+	}
+	return code->depths[index] == depth;
+}
+
+static void freeCode(Code* code, Arena* arena)
+{
+	ARENA_FREE_ARRAY(arena, int, code->targets, code->count);
+	ARENA_FREE_ARRAY(arena, int, code->depths, code->count);
+	ARENA_FREE_ARRAY(arena, int, code->offsets, code->count + 1);
+}
+
+// false if an instruction is reached at two depths or pops more than there is, freeCode is needed either way
+static bool decodeCode(Code* code, Chunk* chunk, int entryDepth, Arena* arena)
+{
+	code->chunk = chunk;
+	code->count = 0;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) code->count++;
+
+	code->offsets = ARENA_ALLOCATE(arena, int, code->count + 1);
+	code->depths = ARENA_ALLOCATE(arena, int, code->count);
+	code->targets = ARENA_ALLOCATE(arena, int, code->count);
+	int* indexOf = ARENA_ALLOCATE(arena, int, chunk->count + 1);
+
+	for (int i = 0, offset = 0; i <= code->count; i++)
+	{
+		code->offsets[i] = offset;
+		indexOf[offset] = i;
+		if (i < code->count) offset += instructionLength(chunk, offset);
+	}
+
+	for (int i = 0; i < code->count; i++)
+	{
+		code->depths[i] = -1;
+		code->targets[i] = -1;
+		if (isJump(opAt(code, i))) code->targets[i] = indexOf[jumpTarget(chunk, code->offsets[i])];
+	}
+	ARENA_FREE_ARRAY(arena, int, indexOf, chunk->count + 1);
+
+	code->depths[0] = entryDepth;
+	code->maxDepth = entryDepth;
+	for (int i = 0; i < code->count; i++)
+	{
+		if (code->depths[i] == -1) continue;
+
+		int pops, pushes;
+		stackEffect(chunk, code->offsets[i], &pops, &pushes);
+		if (pops > code->depths[i]) return false;
+
+		// a jump that pops does so before it jumps, both ways go on at the same depth
+		int depth = code->depths[i] - pops + pushes;
+		if (depth > code->maxDepth) code->maxDepth = depth;
+		if (code->targets[i] != -1 && !reach(code, i, code->targets[i], depth)) return false;
+		if (fallsThrough(opAt(code, i)) && i + 1 < code->count && !reach(code, i, i + 1, depth)) return false;
+	}
+	return true;
+}
+
+// small enough, and nothing in it needs a frame of its own
+static bool canInline(ObjFunction* caller, ObjFunction* callee, int argCount)
+{
+	if (callee == caller || callee->arity != argCount || callee->upvalueCount != 0) return false;
+
+	Chunk* chunk = &callee->chunk;
+	if (chunk->count > INLINE_MAX_LENGTH) return false;
+
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+	{
+		switch (chunk->code[offset])
+		{
+		case OP_CLOSURE:		// a closure could capture the slots of the body, which are not closed on return
+		case OP_CLOSE_UPVALUE:
+		case OP_GET_SUPER:
+		case OP_SUPER_INVOKE:
+			return false;
+
+		// calls itself by name, the guard would keep the recursion out of the caller but the body need not grow it
+		case OP_GET_GLOBAL:
+		case OP_INVOKE:
+			if (AS_STRING(chunk->constants.values[chunk->code[offset + 1]]) == callee->name) return false;
+			break;
+
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+// the callee of the call at index, from what is known of the slot it was pushed to
+static ObjFunction* findCallee(Code* caller, int index, int* known, InlineTargets* targets, uint8_t* check)
+{
+	if (opAt(caller, index) == OP_INVOKE)
+	{
+		*check = OP_CHECK_METHOD;
+		InlineTarget* target = findTarget(targets->methods, targets->methodCount, AS_STRING(constantAt(caller, index)));
+		return target != NULL ? target->function : NULL;
+	}
+
+	int callee = known[caller->depths[index] - operandAt(caller, index) - 1];
+	if (callee < 0) return NULL;
+
+	int pusher = callee >> 1;
+	*check = (callee & IS_REPLACEABLE) ? OP_CHECK_FUNCTION : OP_CALL;
+	if (opAt(caller, pusher) == OP_CLOSURE) return AS_FUNCTION(constantAt(caller, pusher));
+
+	InlineTarget* target = findTarget(targets->functions, targets->functionCount, AS_STRING(constantAt(caller, pusher)));
+	return target != NULL ? target->function : NULL;
+}
+
+// merges a state into the one kept for a jump target, true if that changed
+static bool mergeState(int* into, int* state, int depth)
+{
+	bool isChanged = false;
+	for (int slot = 0; slot < depth; slot++)
+	{
+		int merged = into[slot] == UNREACHED || into[slot] == state[slot] ? state[slot] : UNKNOWN;
+		if (merged != into[slot]) isChanged = true;
+		into[slot] = merged;
+	}
+	return isChanged;
+}
+
+// the stack after the instruction at index
+static void applyEffect(Code* code, int index, int* known, bool* isCaptured)
+{
+	int depth = code->depths[index];
+	int slot = lengthAt(code, index) > 1 ? operandAt(code, index) : 0;
+
+	switch (opAt(code, index))
+	{
+	case OP_GET_LOCAL:
+		known[depth] = known[slot] < 0 ? UNKNOWN : known[slot] | (isCaptured[slot] ? IS_REPLACEABLE : 0);
+		break;
+
+	case OP_SET_LOCAL:
+		known[slot] = known[depth - 1];
+		break;
+
+	case OP_GET_GLOBAL:
+		known[depth] = (index << 1) | IS_REPLACEABLE;
+		break;
+
+	case OP_CLOSURE:
+		known[depth] = index << 1;
+		break;
+
+	case OP_FOR_RANGE_INIT:
+	case OP_FOR_RANGE:
+	case OP_FOR_ITER:
+		for (int k = slot; k < slot + 3 && k < depth; k++) known[k] = UNKNOWN;
+		break;
+
+	default:
+	{
+		int pops, pushes;
+		stackEffect(code->chunk, code->offsets[index], &pops, &pushes);
+		for (int k = depth - pops; k < depth - pops + pushes; k++) known[k] = UNKNOWN;
+		break;
+	}
+	}
+}
+
+/* follows the closures and globals the caller pushes to the calls they are called by
+-> the value of every slot is tracked through assignments, and merged where paths join, until the states kept for the
+	jump targets no longer change; a slot captured by a closure can be assigned behind the tracking, its callee is guarded
+*/
+static void findCalls(ObjFunction* function, Code* caller, InlineTargets* targets, CallSite* sites, Arena* arena)
+{
+	bool isCaptured[UINT8_COUNT];
+	memset(isCaptured, 0, sizeof(isCaptured));
+	for (int i = 0; i < caller->count; i++)
+	{
+		if (opAt(caller, i) != OP_CLOSURE) continue;
+
+		uint8_t* upvalues = &caller->chunk->code[caller->offsets[i] + 2];
+		for (int k = 0; k < AS_FUNCTION(constantAt(caller, i))->upvalueCount; k++)
+		{
+			if (upvalues[2 * k]) isCaptured[upvalues[2 * k + 1]] = true;
+		}
+	}
+
+	int** states = ARENA_ALLOCATE(arena, int*, caller->count);
+	for (int i = 0; i < caller->count; i++) states[i] = NULL;
+	for (int i = 0; i < caller->count; i++)
+	{
+		int target = caller->targets[i];
+		if (caller->depths[i] == -1 || target == -1 || states[target] != NULL) continue;
+
+		states[target] = ARENA_ALLOCATE(arena, int, caller->depths[target] + 1);
+		for (int slot = 0; slot < caller->depths[target]; slot++) states[target][slot] = UNREACHED;
+	}
+
+	int known[UINT8_COUNT + 1];
+	bool isChanged = true;
+	while (isChanged)
+	{
+		isChanged = false;
+		for (int slot = 0; slot < caller->depths[0]; slot++) known[slot] = UNKNOWN;
+
+		bool isLive = true;			// known holds the state the instruction is fallen through to with
+		for (int i = 0; i < caller->count; i++)
+		{
+			int depth = caller->depths[i];
+			if (depth == -1)
+			{
+				isLive = false;
+				continue;
+			}
+
+			if (states[i] != NULL)
+			{
+				if (isLive) mergeState(states[i], known, depth);
+				memcpy(known, states[i], sizeof(int) * depth);
+			}
+
+			uint8_t op = opAt(caller, i);
+			if (op == OP_CALL || op == OP_INVOKE)
+			{
+				CallSite* site = &sites[i];
+				int argCount = caller->chunk->code[caller->offsets[i] + (op == OP_CALL ? 1 : 2)];
+				site->slot = depth - argCount - 1;
+				site->callee = findCallee(caller, i, known, targets, &site->check);
+				if (site->callee != NULL && !canInline(function, site->callee, argCount)) site->callee = NULL;
+			}
+
+			applyEffect(caller, i, known, isCaptured);
+
+			int target = caller->targets[i];
+			if (target != -1)
+			{
+				int pops, pushes;
+				stackEffect(caller->chunk, caller->offsets[i], &pops, &pushes);
+				if (mergeState(states[target], known, depth - pops + pushes) && target <= i) isChanged = true;
+			}
+			isLive = fallsThrough(op);
+		}
+	}
+
+	for (int i = 0; i < caller->count; i++)
+	{
+		if (states[i] != NULL) ARENA_FREE_ARRAY(arena, int, states[i], caller->depths[i] + 1);
+	}
+	ARENA_FREE_ARRAY(arena, int*, states, caller->count);
+}
+
+// the return of the body stores its value in the callee's slot, pops the rest and jumps past the call
+static int returnLength(CallSite* site, int index)
+{
+	bool isLast = site->check == OP_CALL && index == site->body.count - 1;		// falls through to the code after the call
+	return 2 + (site->body.depths[index] - 1) + (isLast ? 0 : 3);
+}
+
+// offsets of the body's instructions in its rewritten code, into at, the length of that code returned
+static int layoutBody(CallSite* site, int* at)
+{
+	int length = 0;
+	for (int j = 0; j < site->body.count; j++)
+	{
+		at[j] = length;
+		if (site->body.depths[j] == -1) continue;
+		length += opAt(&site->body, j) == OP_RETURN ? returnLength(site, j) : lengthAt(&site->body, j);
+	}
+	at[site->body.count] = length;
+	return length;
+}
+
+// decodes the callee for the slot it is given in the caller, false if it does not fit there
+static bool prepareSite(CallSite* site, int callLength, Arena* arena)
+{
+	ObjFunction* callee = site->callee;
+	if (!decodeCode(&site->body, &callee->chunk, callee->arity + 1, arena) || site->slot + site->body.maxDepth > UINT8_COUNT)
+	{
+		freeCode(&site->body, arena);
+		return false;
+	}
+
+	int* at = ARENA_ALLOCATE(arena, int, site->body.count + 1);
+	site->bodyLength = layoutBody(site, at);
+	ARENA_FREE_ARRAY(arena, int, at, site->body.count + 1);
+
+	site->length = site->check == OP_CALL ? site->bodyLength : 5 + site->bodyLength + callLength;
+	return true;
+}
+
+// constants the body takes into the caller's table, the guard's function among them
+static int constantsNeeded(CallSite* site)
+{
+	bool isUsed[UINT8_COUNT];
+	memset(isUsed, 0, sizeof(isUsed));
+
+	int count = site->check != OP_CALL ? 1 : 0;
+	for (int j = 0; j < site->body.count; j++)
+	{
+		if (site->body.depths[j] == -1 || !hasConstantOperand(opAt(&site->body, j))) continue;
+		if (!isUsed[operandAt(&site->body, j)]) count++;
+		isUsed[operandAt(&site->body, j)] = true;
+	}
+	return count;
+}
+
+// strings and functions the caller already holds are shared, everything else is added
+static uint8_t addCallerConstant(ObjFunction* function, Value value)
+{
+	ValueArray* constants = &function->chunk.constants;
+	if (IS_OBJ(value))
+	{
+		for (int i = 0; i < constants->count; i++)
+		{
+			if (IS_OBJ(constants->values[i]) && AS_OBJ(constants->values[i]) == AS_OBJ(value)) return (uint8_t)i;
+		}
+	}
+
+	int constant = addConstant(&function->chunk, value);
+	WRITE_BARRIER(function, value);		// function may have been promoted while compiling
+	return (uint8_t)constant;
+}
+
+static void writeShort(uint8_t* code, int end, int distance)
+{
+	code[end - 2] = (distance >> 8) & 0xff;
+	code[end - 1] = distance & 0xff;
+}
+
+// the body with its slots moved up to the callee's, its constants taken over and its returns rewritten, at code
+static void emitBody(ObjFunction* function, CallSite* site, uint8_t* code, Arena* arena)
+{
+	Code* body = &site->body;
+	int* at = ARENA_ALLOCATE(arena, int, body->count + 1);
+	layoutBody(site, at);
+
+	int remap[UINT8_COUNT];
+	for (int k = 0; k < UINT8_COUNT; k++) remap[k] = -1;
+
+	for (int j = 0; j < body->count; j++)
+	{
+		if (body->depths[j] == -1) continue;
+
+		uint8_t op = opAt(body, j);
+		int offset = at[j];
+		if (op == OP_RETURN)
+		{
+			code[offset++] = OP_SET_LOCAL;
+			code[offset++] = (uint8_t)site->slot;
+			for (int k = 1; k < body->depths[j]; k++) code[offset++] = OP_POP;
+
+			if (offset < at[j] + returnLength(site, j))
+			{
+				code[offset] = OP_JUMP;
+				int after = site->length - (site->check != OP_CALL ? 5 : 0);		// past the call left for the guard
+				writeShort(code, offset + 3, after - (offset + 3));
+			}
+			continue;
+		}
+
+		memcpy(&code[offset], &body->chunk->code[body->offsets[j]], lengthAt(body, j));
+		if (hasSlotOperand(op)) code[offset + 1] = (uint8_t)(code[offset + 1] + site->slot);
+		if (hasConstantOperand(op))
+		{
+			uint8_t constant = operandAt(body, j);
+			if (remap[constant] == -1) remap[constant] = addCallerConstant(function, body->chunk->constants.values[constant]);
+			code[offset + 1] = (uint8_t)remap[constant];
+		}
+
+		if (isJump(op))
+		{
+			int end = offset + lengthAt(body, j);
+			int to = at[body->targets[j]];
+			writeShort(code, end, isBackward(op) ? end - to : to - end);
+		}
+	}
+
+	ARENA_FREE_ARRAY(arena, int, at, body->count + 1);
+}
+
+bool inlineCalls(ObjFunction* function, InlineTargets* targets, Arena* arena)
+{
+	Code caller;
+	Chunk* chunk = &function->chunk;
+	if (!decodeCode(&caller, chunk, function->arity + 1, arena) || caller.maxDepth > UINT8_COUNT)
+	{
+		freeCode(&caller, arena);
+		return false;
+	}
+
+	CallSite* sites = ARENA_ALLOCATE(arena, CallSite, caller.count);
+	for (int i = 0; i < caller.count; i++) sites[i].callee = NULL;
+	findCalls(function, &caller, targets, sites, arena);
+
+	// the sites that fit, as long as the constants do
+	int constantCount = chunk->constants.count;
+	bool isInlined = false;
+	for (int i = 0; i < caller.count; i++)
+	{
+		CallSite* site = &sites[i];
+		if (site->callee == NULL) continue;
+		if (!prepareSite(site, lengthAt(&caller, i), arena))
+		{
+			site->callee = NULL;
+			continue;
+		}
+
+		int needed = constantsNeeded(site);
+		if (constantCount + needed > UINT8_COUNT)
+		{
+			freeCode(&site->body, arena);
+			site->callee = NULL;
+			continue;
+		}
+		constantCount += needed;
+		isInlined = true;
+	}
+
+	// the new offset of every instruction, a jump to a call goes to the guard or body written in its place
+	int* newOffsets = ARENA_ALLOCATE(arena, int, caller.count + 1);
+	int size = 0;
+	for (int i = 0; i < caller.count; i++)
+	{
+		newOffsets[i] = size;
+		size += sites[i].callee != NULL ? sites[i].length : lengthAt(&caller, i);
+	}
+	newOffsets[caller.count] = size;
+
+	for (int i = 0; isInlined && i < caller.count; i++)
+	{
+		if (caller.targets[i] == -1) continue;
+
+		int end = newOffsets[i] + lengthAt(&caller, i);
+		int distance = isBackward(opAt(&caller, i)) ? end - newOffsets[caller.targets[i]] : newOffsets[caller.targets[i]] - end;
+		if (distance < 0 || distance > UINT16_MAX) isInlined = false;
+	}
+
+	if (isInlined)
+	{
+		uint8_t* code = ARENA_ALLOCATE(arena, uint8_t, size);
+		int* lines = ARENA_ALLOCATE(arena, int, size);
+
+		for (int i = 0; i < caller.count; i++)
+		{
+			int offset = newOffsets[i];
+			int line = chunk->lines[caller.offsets[i]];
+			for (int k = offset; k < newOffsets[i + 1]; k++) lines[k] = line;		// the inlined code is the call's line
+
+			CallSite* site = &sites[i];
+			if (site->callee == NULL)
+			{
+				memcpy(&code[offset], &chunk->code[caller.offsets[i]], lengthAt(&caller, i));
+				if (caller.targets[i] != -1)
+				{
+					int end = offset + lengthAt(&caller, i);
+					int to = newOffsets[caller.targets[i]];
+					writeShort(code, end, isBackward(opAt(&caller, i)) ? end - to : to - end);
+				}
+				continue;
+			}
+
+			if (site->check != OP_CALL)
+			{
+				code[offset] = site->check;
+				code[offset + 1] = addCallerConstant(function, OBJ_VAL(site->callee));
+				code[offset + 2] = (uint8_t)(caller.depths[i] - site->slot - 1);
+				writeShort(code, offset + 5, site->bodyLength);
+				offset += 5;
+			}
+
+			emitBody(function, site, &code[offset], arena);
+
+			// the call as it was, for when the guard fails
+			if (site->check != OP_CALL) memcpy(&code[offset + site->bodyLength], &chunk->code[caller.offsets[i]], lengthAt(&caller, i));
+		}
+
+		chunk->count = 0;
+		for (int i = 0; i < size; i++) writeChunk(chunk, code[i], lines[i]);
+
+		ARENA_FREE_ARRAY(arena, int, lines, size);
+		ARENA_FREE_ARRAY(arena, uint8_t, code, size);
+	}
+
+	for (int i = 0; i < caller.count; i++)
+	{
+		if (sites[i].callee != NULL) freeCode(&sites[i].body, arena);
+	}
+	ARENA_FREE_ARRAY(arena, int, newOffsets, caller.count + 1);
+	ARENA_FREE_ARRAY(arena, CallSite, sites, caller.count);
+	freeCode(&caller, arena);
+	return isInlined;
+}
@@ -0,0 +1,43 @@
+// inliner, run by the compiler before the passes of optimizer.h when the interpreter is started with -O
+// -> a call to a small function is replaced by the function's body, which runs in the caller's frame on the slots the
+//	callee and its arguments were pushed to: no frame is set up, no arity is checked and nothing is torn down
+// -> the callee has to be known when the caller is compiled: a function declared in the caller, or a global function
+//	or a method declared before the caller, found by name
+// -> only functions without upvalues, that create no closures and do not call themselves by name, are inlined
+// -> a global can be given another function, and a method overridden or shadowed by a field, so those calls are
+//	guarded by OP_CHECK_FUNCTION or OP_CHECK_METHOD, which jump to the call left behind the body when the callee is
+//	not the one inlined; a function declared in the caller whose slot is never assigned needs no guard
+
+#ifndef inliner_h
+#define inliner_h
+
+#include "common.h"
+#include "object.h"
+#include "arena.h"
+
+typedef struct
+{
+	ObjString* name;
+	ObjFunction* function;		// NULL for a method name classes declared with different functions
+} InlineTarget;
+
+// the global functions and methods of one compile, kept in its arena
+typedef struct
+{
+	InlineTarget* functions;
+	int functionCount;
+	int functionCapacity;
+
+	InlineTarget* methods;
+	int methodCount;
+	int methodCapacity;
+} InlineTargets;
+
+void initInlineTargets(InlineTargets* targets);
+void addInlineFunction(InlineTargets* targets, ObjFunction* function, Arena* arena);		// a later declaration of the name replaces it
+void addInlineMethod(InlineTargets* targets, ObjFunction* function, Arena* arena);
+
+// true if the chunk was rewritten, it is then left with jumps the peephole pass removes
+bool inlineCalls(ObjFunction* function, InlineTargets* targets, Arena* arena);
+
+#endif
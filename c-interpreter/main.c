@@ -5,7 +5,10 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "heapreport.h"
+#include "heapsnap.h"
 #include "virtualm.h"
+#include "compiler.h"
 
 // for REPL, the print eval read loop 
 static void repl()
@@ -86,36 +89,156 @@ static char* readFile(const char* path)
 	return buffer;
 }
 
+static void printReports();
+
 // function for loading scripts
 static void runFile(const char* path)
 {
 	char* source = readFile(path);						// get raw source code from the file
 	InterpretResult result = interpret(source);			// get enum type result from VM
 	free(source);	// free the source code
+	printReports();			// scripts stopped by an error are reported as well
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(51);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(61);
 }
 
 
+// prints usage and exits, for arguments that cannot be run
+static void usage()
+{
+	fprintf(stderr, "Usage: cfei [-O] [--gc-threads n] [--gc-compact] [--gc-grow factor] [--gc-initial size] [--gc-min size] [--gc-max size] [--gc-stats] [--alloc-profile size] [path]\n       cfei --snapshot-report file\n");	// fprintf; print on file but not on console, first argument being the file pointer
+																// in this case it prints STANDARD ERROR
+	exit(64);
+}
+
+
+static bool showGCStats = false;		// --gc-stats
+
+// --gc-stats and --alloc-profile, printed to stderr once the program has run, before the vm is freed
+static void printReports()
+{
+	if (showGCStats) printGCStats(&vm.gcStats, stderr);
+	if (vm.profiler.interval != 0) printProfile(&vm.profiler, stderr);
+}
+
+// heap sizes are given in bytes, or with a K, M or G suffix
+static size_t parseSize(const char* text)
+{
+	char* end;
+	double size = strtod(text, &end);
+	if (end == text || size < 0) usage();
+
+	switch (*end)
+	{
+	case 'K': case 'k': size *= 1024; end++; break;
+	case 'M': case 'm': size *= 1024 * 1024; end++; break;
+	case 'G': case 'g': size *= 1024.0 * 1024 * 1024; end++; break;
+	}
+
+	if (*end != '\0') usage();
+	return (size_t)size;
+}
+
+
 int main(int argc, const char* argv[])		// used in the command line, argc being the amount of arguments and argv the array
 {
 	initVM();
 	// the FIRST argument will always be the name of the executable being run(e.g node, python in terminal)
 
-	if (argc == 1)		// if number of argument is one, run the repl 
+	// garbage collector options come before the path
+	GCConfig config;
+	defaultGCConfig(&config);
+	size_t profileInterval = 0;
+
+	// the analysis of a heap snapshot runs no script
+	if (argc == 3 && strcmp(argv[1], "--snapshot-report") == 0)
+	{
+		bool isRead = reportHeapSnapshot(argv[2], stdout);
+		freeVM();
+		if (isRead) return 0;
+
+		fprintf(stderr, "Could not read heap snapshot \"%s\".\n", argv[2]);
+		exit(74);
+	}
+
+	int arg = 1;
+	while (arg < argc && argv[arg][0] == '-')
+	{
+		if (strcmp(argv[arg], "-O") == 0)
+		{
+			setOptimizing(true);
+			arg++;
+			continue;
+		}
+
+		if (strcmp(argv[arg], "--gc-compact") == 0)
+		{
+			config.compacting = true;
+			arg++;
+			continue;
+		}
+
+		if (strcmp(argv[arg], "--gc-stats") == 0)
+		{
+			showGCStats = true;
+			arg++;
+			continue;
+		}
+
+		if (arg + 1 == argc) usage();			// the other options take a value
+		const char* value = argv[arg + 1];
+
+		if (strcmp(argv[arg], "--gc-threads") == 0)
+		{
+			config.threads = atoi(value);
+			if (config.threads < 1 || config.threads > GC_MAX_THREADS) usage();
+		}
+		else if (strcmp(argv[arg], "--gc-grow") == 0)
+		{
+			config.heapGrowFactor = strtod(value, NULL);
+			if (config.heapGrowFactor < 1) usage();
+		}
+		else if (strcmp(argv[arg], "--gc-initial") == 0)
+		{
+			config.initialHeap = parseSize(value);
+		}
+		else if (strcmp(argv[arg], "--gc-min") == 0)
+		{
+			config.minHeap = parseSize(value);
+		}
+		else if (strcmp(argv[arg], "--gc-max") == 0)
+		{
+			config.maxHeap = parseSize(value);
+		}
+		else if (strcmp(argv[arg], "--alloc-profile") == 0)
+		{
+			profileInterval = parseSize(value);		// mean bytes between two samples
+			if (profileInterval == 0) usage();
+		}
+		else
+		{
+			usage();
+		}
+		arg += 2;
+	}
+
+	configureGC(&config);
+	startProfiler(&vm.profiler, profileInterval);
+	enableSnapshotSignal();			// a running script can be asked for a heap snapshot, see heapsnap.h
+
+	if (arg == argc)		// no path left, run the repl 
 	{
 		repl();
+		printReports();
 	}
-	else if (argc == 2)	// if number of arguments is two, the second one being the file, run the second file
+	else if (arg == argc - 1)	// one argument left, the file to run
 	{
-		runFile(argv[1]);
+		runFile(argv[arg]);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: cfei [path]\n");	// fprintf; print on file but not on console, first argument being the file pointer
-													// in this case it prints STANDARD ERROR
-		exit(64);
+		usage();
 	}
 
 	freeVM();
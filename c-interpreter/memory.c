@@ -1,56 +1,526 @@
+#include <limits.h>
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "memory.h"
 #include "virtualm.h"
 #include "compiler.h"
+#include "heap.h"
+#include "platform.h"
+#include "profiler.h"
 
 // for garbage collector debugging
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-// growth factor for garbage collection heap
-#define GC_HEAP_GROW_FACTOR 2
+// bytes allocated between minor collections in generational mode
+#define GC_NURSERY_SIZE (256 * 1024)
 
-// A void pointer is a pointer that has no associated data type with it.
-// A void pointer can hold address of any type and can be typcasted to any type.
-void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+// bytes allocated between two slices of incremental marking
+#define GC_SLICE_BYTES (64 * 1024)
+
+// gray objects needed before tracing is split across the marking threads
+#define GC_PARALLEL_MIN 64
+
+// old objects checked by each allocation while a lazy sweep is pending
+#define GC_SWEEP_SLICE 256
+#define GC_COMPACT_MIN_PAGES 16		// heaps smaller than 1MB are not worth compacting
+
+// arrays reallocate hands out as cells of vm.buffers instead of realloc'd memory
+#define IS_BUFFER_CELL(size) ((size) > 0 && (size) <= MAX_CELL_SIZE)
+
+static void collectYoungGarbage();
+static void beginMarking();
+static void markSlice();
+static void finishCollection();
+static void sweepSlice(int budget);
+static void finishSweep();
+static void stopMarkWorkers();
+static double recordPause(double start);
+
+// a gray stack could not grow, some marked objects were not pushed and the heap has to be scanned for them
+static volatile bool grayOverflow = false;
+
+// live objects, counted as they are blackened by a full marking, each marking thread counts its own
+static bool isCountingLive = false;
+static HeapCensus markCensus;
+static THREAD_LOCAL HeapCensus* localCensus = NULL;
+
+// bytes freed by the sweep of the running full collection
+static size_t sweptBytes = 0;
+
+static void overflowGray()
+{
+	atomicTestAndSet(&grayOverflow);		// marking threads may all run out of memory at once
+}
+
+
+/*		parallel marking
+-> each marking thread has its own gray stack, a thread that runs out of gray objects steals half of another's stack
+-> objects are claimed with an atomic or of their mark bit, so every object is blackened exactly once
+-> the program stays paused, the main thread marks along with the workers and waits until all of them are idle
+*/
+
+typedef struct
+{
+	Obj** items;
+	int count;
+	int capacity;
+	volatile bool isLocked;		// spinlock, held very briefly by the owner and by thieves
+} GrayStack;
+
+typedef struct
+{
+	GrayStack gray;
+	GrayStack stolen;		// objects taken from another thread, moved into gray without holding both locks
+	Thread thread;
+	int index;
+	long seenEpoch;			// last parallel trace the thread took part in
+	HeapCensus census;		// live objects the thread blackened during the running full collection
+} MarkWorker;
+
+static MarkWorker markWorkers[GC_MAX_THREADS];		// worker 0 is the main thread
+static int markWorkerCount = 0;			// threads started so far, including the main thread
+static int markThreadCount;				// threads taking part in the running trace
+static bool isParallelMarking = false;
+static volatile long activeMarkers;		// marking threads that may still produce gray objects
+
+// the workers sleep between collections, markEpoch counts the parallel traces started
+static Mutex markMutex;
+static Condition markStart;
+static Condition markDone;
+static long markEpoch = 0;
+static int markFinished;
+static bool markStop = false;
+
+static THREAD_LOCAL GrayStack* localGray = NULL;		// gray stack of the marking thread
+
+static void lockGray(GrayStack* stack)
+{
+	while (atomicTestAndSet(&stack->isLocked)) yieldThread();
+}
+
+static void unlockGray(GrayStack* stack)
+{
+	atomicClear(&stack->isLocked);
+}
+
+// returns false if there is no memory for it, the stack is left as it was
+static bool growGray(GrayStack* stack, int count)
+{
+	if (stack->capacity >= count) return true;
+
+	int capacity = stack->capacity;
+	while (capacity < count) capacity = GROW_CAPACITY(capacity);
+	Obj** items = realloc(stack->items, sizeof(Obj*) * capacity);		// grown by marker threads, which must not allocate from the heap
+	if (items == NULL) return false;
+
+	stack->items = items;
+	stack->capacity = capacity;
+	return true;
+}
+
+static void pushGray(GrayStack* stack, Obj* object)
+{
+	lockGray(stack);
+	if (growGray(stack, stack->count + 1)) stack->items[stack->count++] = object;
+	else overflowGray();
+	unlockGray(stack);
+}
+
+static bool popGray(GrayStack* stack, Obj** object)
+{
+	bool found = false;
+	lockGray(stack);
+	if (stack->count > 0)
+	{
+		*object = stack->items[--stack->count];
+		found = true;
+	}
+	unlockGray(stack);
+	return found;
+}
+
+// takes the older half of a victim's stack, those objects tend to lead to the larger subgraphs
+static bool stealGray(MarkWorker* thief, int workerCount)
+{
+	for (int i = 1; i < workerCount; i++)
+	{
+		GrayStack* victim = &markWorkers[(thief->index + i) % workerCount].gray;
+
+		GrayStack* loot = &thief->stolen;		// only the thief uses it, no lock needed
+
+		lockGray(victim);
+		int taken = (victim->count + 1) / 2;
+		if (taken == 0)
+		{
+			unlockGray(victim);
+			continue;
+		}
+
+		if (!growGray(loot, taken))		// the victim keeps its objects
+		{
+			unlockGray(victim);
+			return false;
+		}
+		memcpy(loot->items, victim->items, sizeof(Obj*) * taken);
+		memmove(victim->items, victim->items + taken, sizeof(Obj*) * (victim->count - taken));
+		victim->count -= taken;
+		unlockGray(victim);
+
+		lockGray(&thief->gray);
+		if (growGray(&thief->gray, thief->gray.count + taken))
+		{
+			memcpy(thief->gray.items + thief->gray.count, loot->items, sizeof(Obj*) * taken);
+			thief->gray.count += taken;
+		}
+		else
+		{
+			overflowGray();			// the objects are marked already, the heap scan finds them
+		}
+		unlockGray(&thief->gray);
+		return true;
+	}
+	return false;
+}
+
+static bool hasGrayWork(int workerCount)
+{
+	bool found = false;
+	for (int i = 0; i < workerCount && !found; i++)
+	{
+		lockGray(&markWorkers[i].gray);
+		found = markWorkers[i].gray.count > 0;
+		unlockGray(&markWorkers[i].gray);
+	}
+	return found;
+}
+
+static void blackenObject(Obj* object);
+
+// blackens objects until every marking thread is out of work
+// a thread only goes idle with an empty stack, and only active threads fill stacks, so once no thread
+// is active there is no gray object left anywhere
+static void drainMarkWorker(MarkWorker* worker, int workerCount)
+{
+	localGray = &worker->gray;
+	localCensus = &worker->census;
+
+	for (;;)
+	{
+		Obj* object;
+		while (popGray(&worker->gray, &object)) blackenObject(object);
+
+		if (stealGray(worker, workerCount)) continue;
+
+		atomicDecrement(&activeMarkers);
+		for (;;)
+		{
+			if (atomicLoad(&activeMarkers) == 0)
+			{
+				localGray = NULL;
+				localCensus = NULL;
+				return;
+			}
+
+			if (hasGrayWork(workerCount))
+			{
+				atomicIncrement(&activeMarkers);		// active before the steal, so nobody sees zero while we hold work
+				if (stealGray(worker, workerCount)) break;
+				atomicDecrement(&activeMarkers);
+			}
+			yieldThread();
+		}
+	}
+}
+
+static void markWorkerThread(void* arg)
+{
+	MarkWorker* worker = (MarkWorker*)arg;
+
+	for (;;)
+	{
+		lockMutex(&markMutex);
+		while (markEpoch == worker->seenEpoch && !markStop) waitCondition(&markStart, &markMutex);
+		worker->seenEpoch = markEpoch;
+		bool stop = markStop;
+		unlockMutex(&markMutex);
+
+		if (stop) return;
+
+		// vm.gcThreads may have been lowered since the thread started, extra threads sit the trace out
+		if (worker->index < markThreadCount) drainMarkWorker(worker, markThreadCount);
+
+		lockMutex(&markMutex);
+		markFinished++;
+		wakeAll(&markDone);
+		unlockMutex(&markMutex);
+	}
+}
+
+// starts the worker threads the first time they are needed, returns the number of marking threads
+static int startMarkWorkers()
+{
+	if (markWorkerCount == 0)
+	{
+		initMutex(&markMutex);
+		initCondition(&markStart);
+		initCondition(&markDone);
+		markWorkers[0].index = 0;
+		markWorkerCount = 1;
+	}
+
+	while (markWorkerCount < vm.gcThreads)
+	{
+		MarkWorker* worker = &markWorkers[markWorkerCount];
+		worker->index = markWorkerCount;
+		worker->seenEpoch = markEpoch;
+		if (!startThread(&worker->thread, markWorkerThread, worker)) break;
+		markWorkerCount++;
+	}
+
+	if (vm.gcThreads > markWorkerCount) vm.gcThreads = markWorkerCount;		// mark with the threads we could start
+	return vm.gcThreads;
+}
+
+static void stopMarkWorkers()
+{
+	if (markWorkerCount == 0) return;
+
+	lockMutex(&markMutex);
+	markStop = true;
+	wakeAll(&markStart);
+	unlockMutex(&markMutex);
+
+	for (int i = 1; i < markWorkerCount; i++) joinThread(markWorkers[i].thread);
+	for (int i = 0; i < markWorkerCount; i++)
+	{
+		free(markWorkers[i].gray.items);
+		free(markWorkers[i].stolen.items);
+		markWorkers[i].gray.items = NULL;
+		markWorkers[i].gray.capacity = 0;
+		markWorkers[i].stolen.items = NULL;
+		markWorkers[i].stolen.capacity = 0;
+	}
+
+	freeCondition(&markStart);
+	freeCondition(&markDone);
+	freeMutex(&markMutex);
+	markWorkerCount = 0;
+	markStop = false;
+}
+
+static void traceReferencesParallel()
+{
+	int workerCount = startMarkWorkers();
+	if (workerCount < 2) return;		// no threads, the caller keeps marking alone
+
+	// hand out the gray objects found so far
+	for (int i = 0; i < vm.grayCount; i++)
+	{
+		GrayStack* stack = &markWorkers[i % workerCount].gray;
+		if (growGray(stack, stack->count + 1)) stack->items[stack->count++] = vm.grayStack[i];
+		else overflowGray();
+	}
+	vm.grayCount = 0;
+
+	isParallelMarking = true;
+	markThreadCount = workerCount;
+	atomicStore(&activeMarkers, workerCount);
+
+	lockMutex(&markMutex);
+	markFinished = 0;
+	markEpoch++;
+	wakeAll(&markStart);
+	unlockMutex(&markMutex);
+
+	drainMarkWorker(&markWorkers[0], workerCount);		// the main thread marks as well
+
+	lockMutex(&markMutex);
+	while (markFinished < markWorkerCount - 1) waitCondition(&markDone, &markMutex);
+	unlockMutex(&markMutex);
+
+	isParallelMarking = false;
+}
+
+/*		end of parallel marking		 */
+
+
+// gives up on an allocation, interpret reports it as a runtime error and the vm can be used again
+// only called outside of a collection, after a full one, so the collector is never left half way
+void outOfMemory(int reason)
+{
+	if (vm.memoryError == NULL)			// the vm is being set up, there is no script to stop
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	longjmp(*vm.memoryError, reason);
+}
+
+// the system refused the memory even after a full collection, the allocation was counted already
+static void allocationFailed(size_t oldSize, size_t newSize)
+{
+	vm.bytesAllocated -= newSize - oldSize;
+	if (newSize > oldSize) vm.youngBytes -= newSize - oldSize;
+	outOfMemory(OUT_OF_MEMORY_SYSTEM);
+}
+
+// counts every allocation and runs the collector when needed, before the memory is handed out
+static void collectIfNeeded(size_t oldSize, size_t newSize)
 {
+	// over the heap limit, a full collection is the last chance to make room before the script is stopped
+	if (vm.maxHeap != 0 && newSize > oldSize && vm.bytesAllocated + (newSize - oldSize) > vm.maxHeap)
+	{
+		collectGarbage();
+		if (vm.bytesAllocated + (newSize - oldSize) > vm.maxHeap) outOfMemory(OUT_OF_MEMORY_LIMIT);
+	}
+
 	vm.bytesAllocated += newSize - oldSize;		// self adjusting heap for garbage collection
 
 	if (newSize > oldSize)		// when allocating NEW memory, not when freeing as collecGarbage will cal void* reallocate itself
 	{
+		vm.youngBytes += newSize - oldSize;
+
 #ifdef DEBUG_STRESS_GC
-		collectGarbage();
+		if (vm.generational) collectYoungGarbage();
+		else collectGarbage();
 #endif
 	
-		// run collecter if bytesAllocated is above threshold
-		if (vm.bytesAllocated > vm.nextGC)
+		if (vm.isSweeping)		// the last collection is still freeing its garbage, pay for a bit of it
 		{
-			collectGarbage();
+			double start = wallClock();
+			sweepSlice(GC_SWEEP_SLICE);
+			recordPauseTime(&vm.gcStats.sweepPauses, recordPause(start));
+		}
+		
+		if (vm.isMarking)		// an incremental cycle is running, do a bounded amount of marking
+		{
+			vm.sliceBytes += newSize - oldSize;
+
+			// the program allocates faster than the slices mark, finish the cycle at once
+			if (vm.bytesAllocated > vm.nextGC * vm.heapGrowFactor) finishCollection();
+			else if (vm.sliceBytes > GC_SLICE_BYTES) markSlice();
+		}
+		else if (!vm.isSweeping && vm.bytesAllocated > vm.nextGC)		// run collecter if bytesAllocated is above threshold
+		{
+			if (vm.incremental) beginMarking();
+			else finishCollection();
+		}
+		else if (vm.generational && vm.youngBytes > GC_NURSERY_SIZE)		// cheap collection of the young objects only
+		{
+			collectYoungGarbage();
 		}
-	
 	}
+}
+
+// A void pointer is a pointer that has no associated data type with it.
+// A void pointer can hold address of any type and can be typcasted to any type.
+void* reallocate(void* pointer, size_t oldSize, size_t newSize)
+{
+	collectIfNeeded(oldSize, newSize);
+	if (newSize > oldSize) PROFILE_ALLOCATION(NULL, SAMPLE_ARRAY, newSize - oldSize);
+
+	// small arrays are cells of vm.buffers, so compaction can move them, oldSize tells where pointer came from
+	bool wasCell = IS_BUFFER_CELL(oldSize);
+	bool isCell = IS_BUFFER_CELL(newSize);
 
 	if (newSize == 0)
 	{
-		free(pointer);
+		if (wasCell) freeCell(&vm.buffers, pointer);
+		else free(pointer);
 		return NULL;
 	}
 
-	// C realloc
-	void* result = realloc(pointer, newSize);
+	if (!wasCell && !isCell)
+	{
+		// C realloc
+		void* result = realloc(pointer, newSize);
+
+		// if there is not enought memory, realloc will return null, free all the garbage and try once more
+		if (result == NULL)
+		{
+			collectGarbage();
+			result = realloc(pointer, newSize);
+			if (result == NULL) allocationFailed(oldSize, newSize);
+		}
+
+		return result;
+	}
+
+	if (wasCell && isCell && (oldSize + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT == (newSize + CELL_ALIGNMENT - 1) / CELL_ALIGNMENT)
+	{
+		return pointer;			// same size class, the cell already fits
+	}
 
-	// if there is not enought memory, realloc will return null
-	if (result == NULL) exit(1);	// exit with code 1
+	// moving between cells, or between a cell and realloc'd memory
+	void* result = isCell ? allocateCell(&vm.buffers, newSize) : malloc(newSize);
+	if (result == NULL)
+	{
+		collectGarbage();
+		result = isCell ? allocateCell(&vm.buffers, newSize) : malloc(newSize);
+		if (result == NULL) allocationFailed(oldSize, newSize);
+	}
 
+	if (pointer != NULL)
+	{
+		memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+		if (wasCell) freeCell(&vm.buffers, pointer);
+		else free(pointer);
+	}
 	return result;
 }
 
+// objects get a cell of the page heap instead of realloc'd memory
+void* allocateObjectMemory(size_t size)
+{
+	collectIfNeeded(0, size);
+	if (size > MAX_CELL_SIZE) allocationFailed(0, size);		// no collection makes room for it
+
+	// in generational mode new objects start young, until they survive a collection
+	// the list grows before the cell is taken, a collection must not find a cell that is not an object yet
+	if (vm.generational && vm.youngCapacity < vm.youngCount + 1)
+	{
+		int capacity = GROW_CAPACITY(vm.youngCapacity);
+		// not counted as heap, growing it from reallocate could start a collection for the object being allocated
+		Obj** young = realloc(vm.youngObjects, sizeof(Obj*) * capacity);
+		if (young != NULL)
+		{
+			vm.youngObjects = young;
+			vm.youngCapacity = capacity;
+		}
+		else
+		{
+			collectGarbage();			// every young object is promoted, the list starts over
+			if (vm.youngCapacity < vm.youngCount + 1) allocationFailed(0, size);
+		}
+	}
+
+	void* object = allocateCell(&vm.heap, size);
+	if (object == NULL)
+	{
+		collectGarbage();
+		object = allocateCell(&vm.heap, size);
+		if (object == NULL) allocationFailed(0, size);
+	}
+
+	if (vm.isMarking) setCellMarked(object);		// objects created during incremental marking survive the cycle
+	if (vm.generational) vm.youngObjects[vm.youngCount++] = (Obj*)object;
+
+	return object;
+}
+
+
+// the object itself is in a heap cell, freeing it only updates the count, the cell is given back by the caller
+#define FREE_OBJECT(type, object) (vm.bytesAllocated -= sizeof(type))
 
 // you can pass in a'lower' struct pointer, in this case Obj*, and get the higher level which is ObjFunction
-void freeObject(Obj* object)		// to handle different types
+// frees everything the object owns
+static void releaseObject(Obj* object)		// to handle different types
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void*)object, object->type);
@@ -59,22 +529,34 @@ void freeObject(Obj* object)		// to handle different types
 	switch (object->type)
 	{
 	case OBJ_BOUND_METHOD:
-		FREE(ObjBoundMethod, object);
+		FREE_OBJECT(ObjBoundMethod, object);
+		break;
+
+	case OBJ_BYTES:
+	{
+		ObjBytes* bytes = (ObjBytes*)object;
+		if (bytes->parent == NULL)		// slices do not own their storage
+		{
+			if (bytes->isMapped) unmapBytes(bytes);
+			else FREE_ARRAY(uint8_t, bytes->data, bytes->length);
+		}
+		FREE_OBJECT(ObjBytes, object);
 		break;
+	}
 	
 	case OBJ_CLASS:
 	{
 		// free class type
 		ObjClass* kelas = (ObjClass*)object;
 		freeTable(&kelas->methods);
-		FREE(ObjClass, object);
+		FREE_OBJECT(ObjClass, object);
 		break;
 	}
 	case OBJ_INSTANCE:
 	{
 		ObjInstance* instance = (ObjInstance*)object;
 		freeTable(&instance->fields);
-		FREE(ObjInstance, object);
+		FREE_OBJECT(ObjInstance, object);
 		break;
 	}
 	case OBJ_CLOSURE:
@@ -83,34 +565,115 @@ void freeObject(Obj* object)		// to handle different types
 		ObjClosure* closure = (ObjClosure*)object;
 		FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);		
 		
-		FREE(ObjClosure, object);		// only free the closure, not the function itself
+		FREE_OBJECT(ObjClosure, object);		// only free the closure, not the function itself
 		break;
 	}
 	case OBJ_FUNCTION:		// return bits(chunk) borrowed to the operating syste,
 	{
 		ObjFunction* function = (ObjFunction*)object;
 		freeChunk(&function->chunk);
-		FREE(ObjFunction, object);
+		FREE_OBJECT(ObjFunction, object);
 		break;
 	}
 	case OBJ_NATIVE:
 	{
-		FREE(ObjNative, object);
+		FREE_OBJECT(ObjNative, object);
 		break;
 	}
 	case OBJ_STRING: 
 	{
 		ObjString* string = (ObjString*)object;
-		FREE_ARRAY(char, string->chars, string->length + 1);
-		FREE(ObjString, object);
+		if (string->owner == NULL) FREE_ARRAY(char, string->chars, string->length + 1);		// views do not own their chars
+		FREE_OBJECT(ObjString, object);
+		break;
+	}
+	case OBJ_STRING_BUILDER:
+	{
+		ObjStringBuilder* builder = (ObjStringBuilder*)object;
+		FREE_ARRAY(char, builder->chars, builder->capacity);
+		FREE_OBJECT(ObjStringBuilder, object);
 		break;
 	}
 	case OBJ_UPVALUE:
 	{
-		FREE(ObjUpvalue, object);
+		FREE_OBJECT(ObjUpvalue, object);
+		break;
+	}
+	case OBJ_WEAK_MAP:
+	{
+		ObjWeakMap* map = (ObjWeakMap*)object;
+		FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+		FREE_OBJECT(ObjWeakMap, object);
+		break;
+	}
+	case OBJ_WEAK_REF:
+		FREE_OBJECT(ObjWeakRef, object);
 		break;
 	}
+}
+
+void freeObject(Obj* object)
+{
+	releaseObject(object);
+	freeCell(&vm.heap, object);
+}
+
+// bytes the object counts for in vm.bytesAllocated, its own and those of the arrays releaseObject frees
+size_t objectBytes(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+	case OBJ_BYTES:
+	{
+		ObjBytes* bytes = (ObjBytes*)object;
+		bool ownsData = bytes->parent == NULL && !bytes->isMapped;
+		return sizeof(ObjBytes) + (ownsData ? bytes->length : 0);
+	}
+	case OBJ_CLASS: return sizeof(ObjClass) + TABLE_BYTES(((ObjClass*)object)->methods.capacity);
+	case OBJ_INSTANCE: return sizeof(ObjInstance) + TABLE_BYTES(((ObjInstance*)object)->fields.capacity);
+	case OBJ_CLOSURE: return sizeof(ObjClosure) + sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+	case OBJ_FUNCTION:
+	{
+		Chunk* chunk = &((ObjFunction*)object)->chunk;
+		return sizeof(ObjFunction) + (sizeof(uint8_t) + sizeof(int)) * chunk->capacity + sizeof(Value) * chunk->constants.capacity;
+	}
+	case OBJ_NATIVE: return sizeof(ObjNative);
+	case OBJ_STRING:
+	{
+		ObjString* string = (ObjString*)object;
+		return sizeof(ObjString) + (string->owner == NULL ? string->length + 1 : 0);
+	}
+	case OBJ_STRING_BUILDER: return sizeof(ObjStringBuilder) + ((ObjStringBuilder*)object)->capacity;
+	case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	case OBJ_WEAK_MAP: return sizeof(ObjWeakMap) + sizeof(WeakEntry) * ((ObjWeakMap*)object)->capacity;
+	case OBJ_WEAK_REF: return sizeof(ObjWeakRef);
+	}
+	return 0;
+}
+
+// a full marking starts, nothing is counted yet
+static void startCensus()
+{
+	memset(&markCensus, 0, sizeof(HeapCensus));
+	for (int i = 0; i < GC_MAX_THREADS; i++) memset(&markWorkers[i].census, 0, sizeof(HeapCensus));
+	isCountingLive = true;
+}
+
+// the marking is done, the counts of every thread make up the live objects of the statistics
+static void finishCensus()
+{
+	HeapCensus* live = &vm.gcStats.live;
+	*live = markCensus;
+	for (int i = 0; i < GC_MAX_THREADS; i++)
+	{
+		for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+		{
+			live->objects[type] += markWorkers[i].census.objects[type];
+			live->bytes[type] += markWorkers[i].census.bytes[type];
+		}
 	}
+	isCountingLive = false;
 }
 
 /*		garbage collection		 */	
@@ -118,21 +681,38 @@ void freeObject(Obj* object)		// to handle different types
 void markObject(Obj* object)
 {
 	if (object == NULL) return;				// in some places the pointer is empty
-	if (object->isMarked) return;			// object is already marked
+	if (vm.isMinorGC && object->isOld) return;		// minor collections do not trace the old generation
 	
-	object->isMarked = true;
-
-	// create a worklist of grayobjects to traverse later, use a stack to implement it
-	if (vm.grayCapacity < vm.grayCount + 1)			// if need more space, allocate
-	{	
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);			// use native realloc here
+	if (isParallelMarking)		// another thread may reach the object at the same time, only one of them claims it
+	{
+		if (!claimCell(object)) return;
+		pushGray(localGray, object);
 	}
+	else
+	{
+		if (isCellMarked(object)) return;			// object is already marked
+		setCellMarked(object);
+
+		// create a worklist of grayobjects to traverse later, use a stack to implement it
+		if (vm.grayCapacity < vm.grayCount + 1)			// if need more space, allocate
+		{
+			int capacity = GROW_CAPACITY(vm.grayCapacity);
+			Obj** stack = realloc(vm.grayStack, sizeof(Obj*) * capacity);			// use native realloc here
+
+			// no memory for the work list, the object stays marked and the heap scan finds it
+			if (stack == NULL)
+			{
+				overflowGray();
+				return;
+			}
 
-	if (vm.grayStack == NULL) exit(1);			// if fail to allocate memory for the gray stack	
+			vm.grayStack = stack;
+			vm.grayCapacity = capacity;
+		}
 
-	// add the 'gray' object to the working list
-	vm.grayStack[vm.grayCount++] = object;
+		// add the 'gray' object to the working list
+		vm.grayStack[vm.grayCount++] = object;
+	}
 
 #ifdef DEBUG_LOG_GC
 	printf("%p marked ", (void*)object);
@@ -191,6 +771,13 @@ static void markRoots()
 // actual tracing of each gray object and marking it black
 static void blackenObject(Obj* object)
 {
+	if (isCountingLive)
+	{
+		HeapCensus* census = localCensus != NULL ? localCensus : &markCensus;
+		census->objects[object->type]++;
+		census->bytes[object->type] += objectBytes(object);
+	}
+
 #ifdef DEBUG_LOG_GC
 	printf("%p blackened ", (void*)object);
 	printValue(OBJ_VAL(object));
@@ -208,6 +795,10 @@ static void blackenObject(Obj* object)
 		break;
 	}
 
+	case OBJ_BYTES:			// slices keep the buffer owning their storage alive
+		markObject((Obj*)((ObjBytes*)object)->parent);
+		break;
+
 	case OBJ_UPVALUE:		// simply mark the closed value
 		markValue(((ObjUpvalue*)object)->closed);
 		break;
@@ -247,87 +838,889 @@ static void blackenObject(Obj* object)
 		markTable(&instance->fields);
 		break;
 	}
-		// these two objects contain NO OUTGOING REFERENCES there is nothing to traverse
+	case OBJ_STRING:		// views keep their owner alive
+		markObject((Obj*)((ObjString*)object)->owner);
+		break;
+
+		// these objects contain NO OUTGOING REFERENCES there is nothing to traverse
 	case OBJ_NATIVE:
-	case OBJ_STRING:
+	case OBJ_STRING_BUILDER:
+		break;
+
+		// only weak ones, traceWeak handles them once the marking is done
+	case OBJ_WEAK_MAP:
+	case OBJ_WEAK_REF:
 		break;
 	}
 }
 
 
-// traversing the gray stack work list
-static void traceReferences()
+// blackens every marked object again, after a gray stack overflowed some of them were never blackened
+// blackening twice is harmless, only children that are not marked yet are pushed
+static bool rescanOverflow()
 {
-	while (vm.grayCount > 0)
-	{
-		// pop Obj* (pointer) from the stack
-		// note how -- is the prefix; subtract first then use it as an index
-		// --vm.grayCount already decreases its count, hence everything is already 'popped'
-		Obj* object = vm.grayStack[--vm.grayCount];			
-		blackenObject(object);
-	}
-}
+	if (!grayOverflow) return false;
+	grayOverflow = false;
 
+	// most of the objects were counted already, the census skips the ones only the scan finds
+	bool wasCounting = isCountingLive;
+	isCountingLive = false;
 
-// sweeping all unreachable values
-static void sweep()
-{
-	Obj* previous = NULL;
-	Obj* object = vm.objects;		// linked intrusive list of Objects in the VM
-	
-	while (object != NULL)
+#ifdef DEBUG_LOG_GC
+	printf("--Gray Stack Overflow, rescanning the heap\n");
+#endif
+
+	for (Page* page = vm.heap.pages; page != NULL; page = page->next)
 	{
-		if (object->isMarked)		// object marked, do not free
+		for (int word = 0; word < page->wordCount; word++)
 		{
-			object->isMarked = false;			// reset the marking to 'white'
-			previous = object;
-			object = object->next;
-		}
-		else      // free the unreachable object
-		{
-			Obj* unreached = object;
-			object = object->next;
-
-			if (previous != NULL)	// link to previous object if previous not null
+			uint64_t marked = page->marked[word] & page->allocated[word];
+			while (marked != 0)
 			{
-				previous->next = object;
+				blackenObject((Obj*)cellAt(page, word * 64 + lowestBit(marked)));
+				marked &= marked - 1;
 			}
-			else             // if not set the next as the start of the list
+		}
+	}
+
+	isCountingLive = wasCounting;
+	return true;
+}
+
+// traversing the gray stack work list
+static void traceReferences()
+{
+	do
+	{
+		while (vm.grayCount > 0)
+		{
+			// enough gray objects to share, the marking threads take over the rest of the trace
+			if (vm.gcThreads > 1 && vm.grayCount >= GC_PARALLEL_MIN)
 			{
-				vm.objects = object;	
+				traceReferencesParallel();
+				if (vm.grayCount == 0) break;
 			}
 
-			freeObject(unreached);			// method that actually frees the object
+			// pop Obj* (pointer) from the stack
+			// note how -- is the prefix; subtract first then use it as an index
+			// --vm.grayCount already decreases its count, hence everything is already 'popped'
+			Obj* object = vm.grayStack[--vm.grayCount];			
+			blackenObject(object);
+		}
+	} while (rescanOverflow());
+}
+
+
+bool isWhite(Obj* object)
+{
+	if (vm.isMinorGC && object->isOld) return false;		// old objects survive minor collections
+	return !isCellMarked(object);
+}
+
+
+/*		weak references
+-> weak references and weak maps are listed in vm.weakObjects, blackening them marks nothing
+-> once the marking is done, the value of every entry whose key was reached is marked, which may reach more keys,
+	until nothing changes; a value reachable only from its own key does not keep the entry alive
+-> then references to unreached objects are cleared and entries with unreached keys dropped, before the sweep
+	frees them, unreached weak objects leave the list
+-> minor collections do the same over the young objects, old ones count as reached
+*/
+
+// grows the list before a weak object is allocated, registerWeak then cannot fail
+void reserveWeak()
+{
+	if (vm.weakCapacity >= vm.weakCount + 1) return;
+
+	int capacity = GROW_CAPACITY(vm.weakCapacity);
+	Obj** objects = realloc(vm.weakObjects, sizeof(Obj*) * capacity);		// the collector's own list, outside the counted heap
+	if (objects == NULL)
+	{
+		collectGarbage();			// unreached weak objects leave the list
+		if (vm.weakCapacity >= vm.weakCount + 1) return;
+		allocationFailed(0, sizeof(Obj*));
+	}
+
+	vm.weakObjects = objects;
+	vm.weakCapacity = capacity;
+}
+
+void registerWeak(Obj* object)
+{
+	vm.weakObjects[vm.weakCount++] = object;
+}
+
+// marks the values of reached keys in reached maps, true if any was marked
+static bool markEphemerons()
+{
+	bool isMarked = false;
+	for (int i = 0; i < vm.weakCount; i++)
+	{
+		Obj* object = vm.weakObjects[i];
+		if (object->type != OBJ_WEAK_MAP || isWhite(object)) continue;
+
+		ObjWeakMap* map = (ObjWeakMap*)object;
+		for (int j = 0; j < map->capacity; j++)
+		{
+			WeakEntry* entry = &map->entries[j];
+			if (entry->key == NULL || isWhite(entry->key)) continue;
+			if (!IS_OBJ(entry->value) || !isWhite(AS_OBJ(entry->value))) continue;
+
+			markValue(entry->value);
+			isMarked = true;
 		}
 	}
+	return isMarked;
 }
 
-void collectGarbage()
+static void clearWeak()
+{
+	int kept = 0;
+	for (int i = 0; i < vm.weakCount; i++)
+	{
+		Obj* object = vm.weakObjects[i];
+		if (isWhite(object)) continue;			// the sweep frees it
+		vm.weakObjects[kept++] = object;
+
+		if (object->type == OBJ_WEAK_REF)
+		{
+			ObjWeakRef* ref = (ObjWeakRef*)object;
+			if (ref->target != NULL && isWhite(ref->target)) ref->target = NULL;
+			continue;
+		}
+
+		ObjWeakMap* map = (ObjWeakMap*)object;
+		for (int j = 0; j < map->capacity; j++)
+		{
+			WeakEntry* entry = &map->entries[j];
+			if (entry->key == NULL || !isWhite(entry->key)) continue;
+
+			entry->key = NULL;				// a tombstone, like weakMapDelete leaves
+			entry->value = BOOL_VAL(true);
+			map->count--;
+			map->tombstones++;
+		}
+	}
+	vm.weakCount = kept;
+}
+
+// after traceReferences, before anything unreached is freed
+static void traceWeak()
+{
+	if (vm.weakCount == 0) return;
+
+	while (markEphemerons()) traceReferences();
+	clearWeak();
+}
+
+/*		end of weak references		*/
+
+
+/*		generational garbage collection		
+-> most objects die young, a minor collection only marks and sweeps the objects allocated since the last collection
+-> survivors are promoted to the old generation, which only full collections trace and sweep
+-> old objects are treated as marked, so an old object pointing to a young one has to be remembered by the
+	write barrier and traced as an extra root
+*/
+
+// the barrier runs in the middle of a store and cannot collect, if the list cannot grow the object is left out and
+// the next collection is a full one, which traces old objects too
+void rememberObject(Obj* object)
+{
+	if (object->isRemembered) return;
+
+	if (vm.rememberedCapacity < vm.rememberedCount + 1)
+	{
+		int capacity = GROW_CAPACITY(vm.rememberedCapacity);
+		Obj** remembered = realloc(vm.remembered, sizeof(Obj*) * capacity);
+		if (remembered == NULL)
+		{
+			vm.rememberedOverflow = true;
+			return;
+		}
+
+		vm.remembered = remembered;
+		vm.rememberedCapacity = capacity;
+	}
+
+	object->isRemembered = true;
+	vm.remembered[vm.rememberedCount++] = object;
+}
+
+void writeBarrier(Obj* owner, Obj* value)
+{
+	// objects waiting for the lazy sweep are promoted by it, marked means they survived
+	if ((owner->isOld || (vm.isSweeping && isCellMarked(owner))) && !value->isOld) rememberObject(owner);
+
+	// while incremental marking runs, owner may already be blackened and would not be traced again
+	// old objects waiting for the lazy sweep are still marked, that does not count
+	if (vm.isMarking && isCellMarked(owner) && !isCellMarked(value)) markObject(value);
+}
+
+static void clearRemembered()
+{
+	for (int i = 0; i < vm.rememberedCount; i++)
+	{
+		vm.remembered[i]->isRemembered = false;
+	}
+	vm.rememberedCount = 0;
+}
+
+// young objects are swept one by one, survivors are promoted to the old generation where they are
+static void sweepYoung()
+{
+	double start = wallClock();
+	size_t before = vm.bytesAllocated;
+
+	for (int i = 0; i < vm.youngCount; i++)
+	{
+		Obj* object = vm.youngObjects[i];
+		if (isCellMarked(object))
+		{
+			clearCellMark(object);
+			object->isOld = true;
+		}
+		else
+		{
+			freeObject(object);
+		}
+	}
+
+	vm.youngCount = 0;
+
+	vm.gcStats.lastMinorFreed = before - vm.bytesAllocated;
+	vm.gcStats.freedBytes += before - vm.bytesAllocated;
+	recordPauseTime(&vm.gcStats.sweepPauses, wallClock() - start);
+}
+
+// the collector runs inside reallocate, every call stops the program for a while, returns the pause
+static double recordPause(double start)
+{
+	double pause = wallClock() - start;
+	if (pause > vm.maxPause) vm.maxPause = pause;
+	recordPauseTime(&vm.gcStats.pauses, pause);
+	return pause;
+}
+
+static void collectYoungGarbage()
+{
+	// young objects are marked by the running incremental cycle, or wait for the lazy sweep
+	if (vm.isMarking || vm.isSweeping) return;
+
+	// an old object missing from the remembered list would not keep its young objects alive
+	if (vm.rememberedOverflow)
+	{
+		collectGarbage();
+		return;
+	}
+
+	double start = wallClock();
+
+#ifdef DEBUG_LOG_GC
+	printf("--Minor Garbage Collection Begin\n");
+	size_t before = vm.bytesAllocated;
+#endif
+
+	vm.isMinorGC = true;
+	vm.gcStats.minorCollections++;
+
+	markRoots();
+
+	// remembered old objects are roots for their young references
+	for (int i = 0; i < vm.rememberedCount; i++)
+	{
+		blackenObject(vm.remembered[i]);
+	}
+	traceReferences();
+	traceWeak();
+	recordPauseTime(&vm.gcStats.markPauses, wallClock() - start);
+	if (vm.profiler.objectCount > 0) profileSurvivors();
+
+	tableRemoveWhite(&vm.strings);
+
+	clearRemembered();				// after promotion there are no old to young references left
+	sweepYoung();
+
+	vm.isMinorGC = false;
+	vm.youngBytes = 0;
+
+	recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+	printf("--Minor Garbage Collection End\n");
+	printf("	collected %zd bytes (from %zd to %zd) next at %zd\n",
+		before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+/*		end of generational garbage collection		 */
+
+/*		incremental garbage collection
+-> a full collection is split into slices, beginMarking only grays the roots and every GC_SLICE_BYTES of allocation
+	a slice blackens a bounded number of gray objects
+-> the write barrier keeps marked objects from pointing to unmarked ones, and objects created in the meantime
+	start marked
+-> the stack, globals and compiler are not behind the barrier, so the roots are marked again before the sweep
+*/
+
+static void beginMarking()
 {
+	double start = wallClock();
+
+	finishSweep();			// marks left over from the last collection would count as reached
+
+#ifdef DEBUG_LOG_GC
+	printf("--Incremental Marking Begin\n");
+#endif
+
+	vm.isMarking = true;
+	vm.sliceBytes = 0;
+	startCensus();
+
+	double markStart = wallClock();
+	markRoots();
+	recordPauseTime(&vm.gcStats.markPauses, wallClock() - markStart);
+
+	recordPause(start);
+}
+
+// marks the rest of the heap, then sweeps the young objects and leaves the old ones to the lazy sweep
+static void markToEnd()
+{
+	finishSweep();
+
 #ifdef DEBUG_LOG_GC
 	printf("--Garbage Collection Begin\n");
-	size_t before = vm.bytesAllocated;
 #endif
 
+	if (!vm.isMarking) startCensus();		// not incremental, the whole marking happens now
+	vm.gcStats.fullCollections++;
+
+	double markStart = wallClock();
 	markRoots();			// function to start traversing the graph, from the root and marking them
 	traceReferences();		// tracing each gray marked object
+	traceWeak();			// values of weak maps whose keys were reached, then the weak references are cleared
+	vm.lastMarkTime = wallClock() - markStart;
+	recordPauseTime(&vm.gcStats.markPauses, vm.lastMarkTime);
+	finishCensus();
+	if (vm.profiler.objectCount > 0) profileSurvivors();
 
 	// removing intern strings, BEFORE the sweep so the pointers can still access its memory
 	// function defined in hahst.c
 	tableRemoveWhite(&vm.strings);
 
-	sweep();				// free all unreachable roots
+	clearRemembered();			// before the sweep, remembered objects may be freed
+	vm.rememberedOverflow = false;		// the whole heap was traced, objects the list missed included
+
+	// every page is left to the lazy sweep, young objects included, it promotes the survivors
+	prepareSweep(&vm.heap);
+	vm.sweepCursor = &vm.heap.pages;
+	vm.sweepBefore = vm.bytesAllocated;
+	sweptBytes = 0;
+	vm.isSweeping = true;
+	vm.youngCount = 0;
+	vm.youngBytes = 0;
+	vm.isMarking = false;
+}
+
+/*		lazy sweeping
+-> after marking, the pages are not swept immediately, prepareSweep flags all of them and drops the available lists
+-> every allocation sweeps at least a page and about GC_SWEEP_SLICE cells, dead objects are freed and each
+	swept page is either given back to the operating system or its free cells are reused
+-> the marks live in side bitmaps, survivors are found a word at a time and the bitmaps are cleared with it
+-> new objects come from new pages or pages already swept, so the sweep never sees them
+-> the next collection cannot start before the sweep is done, nextGC is adjusted once it is
+-> minor collections wait as well, objects still to be swept keep their marks
+*/
+
+// works on whole bitmap words, the cells of dead objects are not written to and old survivors are not touched at all
+static void sweepPage(Page* page)
+{
+	for (int word = 0; word < page->wordCount; word++)
+	{
+		uint64_t marked = page->marked[word];
+		uint64_t dead = page->allocated[word] & ~marked;
+
+		while (dead != 0)
+		{
+			releaseObject((Obj*)cellAt(page, word * 64 + lowestBit(dead)));
+			dead &= dead - 1;		// clear the lowest bit
+		}
+
+		// every survivor of a full collection is old, only young ones need their header written
+		uint64_t survivors = vm.generational ? marked : 0;
+		while (survivors != 0)
+		{
+			Obj* object = (Obj*)cellAt(page, word * 64 + lowestBit(survivors));
+			if (!object->isOld) object->isOld = true;
+			survivors &= survivors - 1;
+		}
+
+		page->allocated[word] = marked;
+		page->marked[word] = 0;
+	}
+}
 
-	// adjust size of threshold
-	vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+// compacts at the next safe point if enough of the page memory would be given back
+static void requestCompaction()
+{
+	int pages = vm.heap.pageCount + vm.heap.emptyCount + vm.buffers.pageCount + vm.buffers.emptyCount;
+	if (pages < GC_COMPACT_MIN_PAGES) return;
+
+	int reclaimable = reclaimablePages(&vm.heap) + reclaimablePages(&vm.buffers);
+	if ((double)reclaimable / pages > vm.compactThreshold) vm.compactPending = true;
+}
+
+static void sweepSlice(int budget)
+{
+	while (budget > 0 && *vm.sweepCursor != NULL)
+	{
+		Page* page = *vm.sweepCursor;
+		if (!page->needsSweep)			// created after marking ended
+		{
+			vm.sweepCursor = &page->next;
+			continue;
+		}
+
+		budget -= page->liveCount;
+		size_t before = vm.bytesAllocated;
+		sweepPage(page);
+		sweptBytes += before - vm.bytesAllocated;
+		if (finishPageSweep(&vm.heap, vm.sweepCursor)) vm.sweepCursor = &page->next;		// else it was unlinked
+	}
+
+	if (*vm.sweepCursor == NULL && vm.isSweeping)		// last page of the sweep
+	{
+		// adjust size of threshold, within the configured bounds
+		vm.nextGC = (size_t)(vm.bytesAllocated * vm.heapGrowFactor);
+		if (vm.nextGC < vm.minHeap) vm.nextGC = vm.minHeap;
+		if (vm.maxHeap != 0 && vm.nextGC > vm.maxHeap) vm.nextGC = vm.maxHeap;
 
 #ifdef DEBUG_LOG_GC
-	printf("--Garbage Collection End\n");
-	printf("	collected %zd bytes (from %zd to %zd) next at %zd\n",
-		before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+		printf("--Garbage Collection End\n");
+		printf("	collected %zd bytes (from %zd to %zd) next at %zd\n",
+			vm.sweepBefore - vm.bytesAllocated, vm.sweepBefore, vm.bytesAllocated, vm.nextGC);
+#endif
+
+		vm.isSweeping = false;
+		vm.gcStats.lastFullFreed = sweptBytes;
+		vm.gcStats.freedBytes += sweptBytes;
+
+		if (vm.compacting) requestCompaction();
+	}
+}
+
+static void finishSweep()
+{
+	if (!vm.isSweeping) return;
+
+	double start = wallClock();
+	sweepSlice(INT_MAX);
+	recordPauseTime(&vm.gcStats.sweepPauses, wallClock() - start);
+}
+
+/*		end of lazy sweeping		 */
+
+// ends the collection cycle, returns to the program before the old objects are swept
+static void finishCollection()
+{
+	double start = wallClock();
+	markToEnd();
+	recordPause(start);
+}
+
+static void markSlice()
+{
+	double start = wallClock();
+	int work = 0;
+
+	while (vm.grayCount > 0 && work < vm.markSliceWork)
+	{
+		blackenObject(vm.grayStack[--vm.grayCount]);
+		work++;
+
+		// reading the clock is not free, check the time budget every few objects
+		if (vm.markSliceTime > 0 && work % 64 == 0 && wallClock() - start > vm.markSliceTime) break;
+	}
+	recordPauseTime(&vm.gcStats.markPauses, wallClock() - start);
+
+	vm.sliceBytes = 0;
+
+#ifdef DEBUG_LOG_GC
+	printf("--Marking Slice blackened %d, %d gray left\n", work, vm.grayCount);
 #endif
+
+	if (vm.grayCount == 0) markToEnd();
+
+	recordPause(start);
+}
+
+// runs a full collection from the current roots
+// a running incremental cycle is finished first, its roots are older and the objects allocated since start marked,
+// so its garbage is only part of what is unreachable now
+void collectGarbage()
+{
+	double start = wallClock();
+	if (vm.isMarking) markToEnd();
+	markToEnd();
+	finishSweep();
+	recordPause(start);
+}
+
+void forEachLiveObject(void (*visit)(Obj* object))
+{
+	collectGarbage();			// the sweep is finished too, every allocated cell is a live object
+
+	for (Page* page = vm.heap.pages; page != NULL; page = page->next)
+	{
+		for (int word = 0; word < page->wordCount; word++)
+		{
+			uint64_t live = page->allocated[word];
+			while (live != 0)
+			{
+				visit((Obj*)cellAt(page, word * 64 + lowestBit(live)));
+				live &= live - 1;
+			}
+		}
+	}
+}
+
+/*		end of incremental garbage collection		 */
+
+
+/*		compaction
+-> objects never move otherwise, long running programs leave pages with a few live objects each after a load spike
+-> a compacting collection moves the objects of the sparsest pages into the free cells of the others and gives the
+	emptied pages back to the operating system, then does the same for the buffers the objects own
+-> a moved object leaves its new address in its old cell, then every pointer into an evacuated page is forwarded:
+	the value stack, call frames, open upvalues, globals, interned strings and the fields of every live object
+-> buffers have one owner that moves them, except the chars of views and the data of slices which point into
+	the buffer of their owner, they find its new address in the old cell
+-> objects only move at safe points of the interpreter loop, where no C local holds an object pointer,
+	the compiler is done by then and has no roots
+-> compaction is optional, when it is on a full collection that leaves more than vm.compactThreshold of the page
+	memory to give back asks the interpreter for one
+*/
+
+static Obj* forward(Obj* object)
+{
+	if (object != NULL && pageOf(object)->isEvacuating) return *(Obj**)object;
+	return object;
+}
+
+#define FORWARD(type, pointer) ((pointer) = (type*)forward((Obj*)(pointer)))
+
+static void forwardValue(Value* value)
+{
+	if (IS_OBJ(*value)) *value = OBJ_VAL(forward(AS_OBJ(*value)));
+}
+
+static void forwardArray(ValueArray* array)
+{
+	for (int i = 0; i < array->count; i++) forwardValue(&array->values[i]);
+}
+
+// moving a key does not change its hash, the entries stay where they are
+static void forwardTable(Table* table)
+{
+	for (int i = 0; i < table->capacity; i++)
+	{
+		Entry* entry = &table->entries[i];
+		FORWARD(ObjString, entry->key);
+		forwardValue(&entry->value);
+	}
+}
+
+// the same fields blackenObject traces
+static void forwardObject(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD:
+	{
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		forwardValue(&bound->receiver);
+		FORWARD(ObjClosure, bound->method);
+		break;
+	}
+	case OBJ_BYTES:
+		FORWARD(ObjBytes, ((ObjBytes*)object)->parent);
+		break;
+	case OBJ_CLASS:
+	{
+		ObjClass* kelas = (ObjClass*)object;
+		FORWARD(ObjString, kelas->name);
+		forwardTable(&kelas->methods);
+		break;
+	}
+	case OBJ_CLOSURE:
+	{
+		ObjClosure* closure = (ObjClosure*)object;
+		FORWARD(ObjFunction, closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++) FORWARD(ObjUpvalue, closure->upvalues[i]);
+		break;
+	}
+	case OBJ_FUNCTION:
+	{
+		ObjFunction* function = (ObjFunction*)object;
+		FORWARD(ObjString, function->name);
+		forwardArray(&function->chunk.constants);
+		break;
+	}
+	case OBJ_INSTANCE:
+	{
+		ObjInstance* instance = (ObjInstance*)object;
+		FORWARD(ObjClass, instance->kelas);
+		forwardTable(&instance->fields);
+		break;
+	}
+	case OBJ_STRING:
+		FORWARD(ObjString, ((ObjString*)object)->owner);
+		break;
+	case OBJ_UPVALUE:
+	{
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		forwardValue(&upvalue->closed);
+		FORWARD(ObjUpvalue, upvalue->next);
+		break;
+	}
+	case OBJ_WEAK_MAP:
+	{
+		ObjWeakMap* map = (ObjWeakMap*)object;
+		for (int i = 0; i < map->capacity; i++)
+		{
+			WeakEntry* entry = &map->entries[i];
+			if (entry->key == NULL) continue;
+			FORWARD(Obj, entry->key);
+			forwardValue(&entry->value);
+		}
+		map->isStale = map->count > 0;			// keys are hashed by address, the next lookup rehashes
+		break;
+	}
+	case OBJ_WEAK_REF:
+		FORWARD(Obj, ((ObjWeakRef*)object)->target);
+		break;
+	case OBJ_NATIVE:
+	case OBJ_STRING_BUILDER:
+		break;
+	}
+}
+
+static void moveObject(Page* page, int index)
+{
+	Obj* object = (Obj*)cellAt(page, index);
+	Obj* copy = (Obj*)allocateCell(&vm.heap, page->cellSize);
+	memcpy(copy, object, page->cellSize);
+
+	// a closed upvalue points at its own closed field
+	if (object->type == OBJ_UPVALUE && ((ObjUpvalue*)object)->location == &((ObjUpvalue*)object)->closed)
+	{
+		((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+	}
+
+	*(Obj**)object = copy;			// the old cell is released with its page
+}
+
+// size is what the owner allocated, it tells whether the buffer is a cell at all
+static void* moveBuffer(void* buffer, size_t size)
+{
+	if (buffer == NULL || !IS_BUFFER_CELL(size) || !pageOf(buffer)->isEvacuating) return buffer;
+
+	void* copy = allocateCell(&vm.buffers, size);
+	memcpy(copy, buffer, size);
+	*(void**)buffer = copy;			// for views into the buffer
+	return copy;
+}
+
+#define MOVE_BUFFER(type, pointer, count) \
+	((pointer) = (type*)moveBuffer((pointer), sizeof(type) * (count)))
+
+// the entries of a table and the control bytes after them are one buffer
+#define MOVE_TABLE(table) \
+	((table).entries = (Entry*)moveBuffer((table).entries, TABLE_BYTES((table).capacity)))
+
+// pointer inside a buffer of ownerSize bytes that may have moved, it must not point past the end of the buffer
+static void* forwardInterior(void* pointer, size_t ownerSize)
+{
+	if (pointer == NULL || !IS_BUFFER_CELL(ownerSize)) return pointer;
+
+	Page* page = pageOf(pointer);
+	if (!page->isEvacuating) return pointer;
+
+	uint8_t* cell = (uint8_t*)cellAt(page, cellIndex(page, pointer));
+	return *(uint8_t**)cell + ((uint8_t*)pointer - cell);
+}
+
+static void moveOwnedBuffers(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BYTES:
+	{
+		ObjBytes* bytes = (ObjBytes*)object;
+		if (bytes->parent == NULL && !bytes->isMapped) MOVE_BUFFER(uint8_t, bytes->data, bytes->length);
+		break;
+	}
+	case OBJ_CLASS:
+		MOVE_TABLE(((ObjClass*)object)->methods);
+		break;
+	case OBJ_CLOSURE:
+		MOVE_BUFFER(ObjUpvalue*, ((ObjClosure*)object)->upvalues, ((ObjClosure*)object)->upvalueCount);
+		break;
+	case OBJ_FUNCTION:
+	{
+		Chunk* chunk = &((ObjFunction*)object)->chunk;
+		MOVE_BUFFER(uint8_t, chunk->code, chunk->capacity);
+		MOVE_BUFFER(int, chunk->lines, chunk->capacity);
+		MOVE_BUFFER(Value, chunk->constants.values, chunk->constants.capacity);
+		break;
+	}
+	case OBJ_INSTANCE:
+		MOVE_TABLE(((ObjInstance*)object)->fields);
+		break;
+	case OBJ_STRING:
+	{
+		ObjString* string = (ObjString*)object;
+		if (string->owner == NULL) MOVE_BUFFER(char, string->chars, string->length + 1);
+		break;
+	}
+	case OBJ_STRING_BUILDER:
+		MOVE_BUFFER(char, ((ObjStringBuilder*)object)->chars, ((ObjStringBuilder*)object)->capacity);
+		break;
+	case OBJ_WEAK_MAP:
+		MOVE_BUFFER(WeakEntry, ((ObjWeakMap*)object)->entries, ((ObjWeakMap*)object)->capacity);
+		break;
+	case OBJ_BOUND_METHOD:
+	case OBJ_NATIVE:
+	case OBJ_UPVALUE:
+	case OBJ_WEAK_REF:
+		break;
+	}
+}
+
+// after every owner moved its buffers
+static void forwardViews(Obj* object)
+{
+	if (object->type == OBJ_STRING && ((ObjString*)object)->owner != NULL)
+	{
+		ObjString* view = (ObjString*)object;
+		// an empty view may point at the end of the owner's chars, it is never read from
+		if (view->length == 0) view->chars = view->owner->chars;
+		else view->chars = (char*)forwardInterior(view->chars, view->owner->length + 1);
+	}
+	else if (object->type == OBJ_BYTES && ((ObjBytes*)object)->parent != NULL && !((ObjBytes*)object)->isMapped)
+	{
+		ObjBytes* slice = (ObjBytes*)object;
+		if (slice->length == 0) slice->data = slice->parent->data;
+		else slice->data = (uint8_t*)forwardInterior(slice->data, slice->parent->length);
+	}
+}
+
+// calls visit on every allocated cell of the pages that are not evacuated
+static void forEachCell(Heap* heap, void (*visit)(Obj*))
+{
+	for (Page* page = heap->pages; page != NULL; page = page->next)
+	{
+		if (page->isEvacuating) continue;
+
+		for (int word = 0; word < page->wordCount; word++)
+		{
+			uint64_t live = page->allocated[word];
+			while (live != 0)
+			{
+				visit((Obj*)cellAt(page, word * 64 + lowestBit(live)));
+				live &= live - 1;
+			}
+		}
+	}
+}
+
+static void compactObjects()
+{
+	if (selectEvacuation(&vm.heap) == 0) return;
+
+	Page* firstPage = vm.heap.pages;		// new pages are linked in front, they have nothing to evacuate
+	for (Page* page = firstPage; page != NULL; page = page->next)
+	{
+		if (!page->isEvacuating) continue;
+
+		for (int word = 0; word < page->wordCount; word++)
+		{
+			uint64_t live = page->allocated[word];
+			while (live != 0)
+			{
+				moveObject(page, word * 64 + lowestBit(live));
+				live &= live - 1;
+			}
+		}
+	}
+
+	// roots, the same ones markRoots marks
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) forwardValue(slot);
+	for (int i = 0; i < vm.frameCount; i++) FORWARD(ObjClosure, vm.frames[i].closure);
+	FORWARD(ObjUpvalue, vm.openUpvalues);
+	forwardTable(&vm.globals);
+	forwardTable(&vm.strings);
+	FORWARD(ObjString, vm.initString);
+	for (int i = 0; i < vm.youngCount; i++) FORWARD(Obj, vm.youngObjects[i]);
+	for (int i = 0; i < vm.profiler.objectCount; i++) FORWARD(Obj, vm.profiler.objects[i].object);
+	for (int i = 0; i < vm.weakCount; i++) FORWARD(Obj, vm.weakObjects[i]);
+
+	forEachCell(&vm.heap, forwardObject);
+	releaseEvacuated(&vm.heap);
+}
+
+static void compactBuffers()
+{
+	if (selectEvacuation(&vm.buffers) == 0) return;
+
+	// the running functions' code may move, keep where each frame is
+	size_t offsets[FRAMES_MAX];
+	for (int i = 0; i < vm.frameCount; i++)
+	{
+		offsets[i] = vm.frames[i].ip - vm.frames[i].closure->function->chunk.code;
+	}
+
+	MOVE_TABLE(vm.globals);
+	MOVE_TABLE(vm.strings);
+	forEachCell(&vm.heap, moveOwnedBuffers);
+	forEachCell(&vm.heap, forwardViews);
+
+	for (int i = 0; i < vm.frameCount; i++)
+	{
+		vm.frames[i].ip = vm.frames[i].closure->function->chunk.code + offsets[i];
+	}
+
+	releaseEvacuated(&vm.buffers);
 }
 
+void compactHeap()
+{
+	double start = wallClock();
+
+	// a full collection first, afterwards every allocated cell is live and no cycle is running
+	markToEnd();
+	finishSweep();
+	vm.compactPending = false;
+	vm.gcStats.compactions++;
+
+#ifdef DEBUG_LOG_GC
+	printf("--Compaction Begin, %d object pages %d buffer pages\n", vm.heap.pageCount, vm.buffers.pageCount);
+#endif
+
+	compactObjects();
+	compactBuffers();
+	trimMallocHeap();			// larger arrays freed since the spike stay with malloc, ask it to give them back
+
+#ifdef DEBUG_LOG_GC
+	printf("--Compaction End, %d object pages %d buffer pages\n", vm.heap.pageCount, vm.buffers.pageCount);
+#endif
+
+	recordPause(start);
+}
+
+/*		end of compaction		 */
+
 
 /*		end of garbage collection		 */
 
@@ -335,14 +1728,19 @@ void collectGarbage()
 
 void freeObjects()			// free from VM
 {
-	Obj* object = vm.objects;
-	// free from the whole list
-	while (object != NULL)
+	for (Page* page = vm.heap.pages; page != NULL; page = page->next)
 	{
-		Obj* next = object->next;
-		freeObject(object);
-		object = next;
+		for (int i = 0; i < page->cellCount; i++)
+		{
+			if (isAllocated(page, i)) releaseObject((Obj*)cellAt(page, i));
+		}
 	}
+	freeHeap(&vm.heap);
+	freeHeap(&vm.buffers);		// the globals and strings tables are freed before, every buffer is gone
+	free(vm.youngObjects);
+	free(vm.weakObjects);
 
+	stopMarkWorkers();
 	free(vm.grayStack);			// free gray marked obj stack used for garbage collection
+	free(vm.remembered);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"			
+#include "heap.h"
 
 // macro to allocate memory, usedin obj/heap
 // use reallocate as malloc here; start from null pointer, old size is 0, and new size is count
@@ -44,10 +45,36 @@
 // void* mean it first accepts a data type
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+// memory for a new object, from the page heap instead of realloc, counted and collected like reallocate
+void* allocateObjectMemory(size_t size);
+
 // garbace collection, using mark-sweep/tracing
 void markObject(Obj* object);
 void markValue(Value value);
-void collectGarbage();
+void collectGarbage();			// full collection of both generations
+void outOfMemory(int reason);		// stops the script with OUT_OF_MEMORY_LIMIT or _SYSTEM, call after a full collection
+void compactHeap();				// full collection that also moves objects, only where no C local holds an object pointer
+bool isWhite(Obj* object);		// not reached by the running collection
+
+// runs a full collection, then visits every object left, visit must not allocate
+void forEachLiveObject(void (*visit)(Obj* object));
+size_t objectBytes(Obj* object);	// its own size and the arrays it owns, as counted in vm.bytesAllocated
+
+// weak references and weak maps are listed for the collector, reserve before allocating one and register it after
+void reserveWeak();
+void registerWeak(Obj* object);
+
+// write barrier, used after storing value into a field of owner
+// -> generational: old objects pointing to young objects are remembered and traced as roots by minor collections
+// -> incremental: a marked object must never point to an unmarked one, so the stored value is marked (Dijkstra barrier)
+// outside of a collection cycle nothing is marked, the fast path only checks the owner's header and mark bit
+#define WRITE_BARRIER(owner, value)		\
+	do {	\
+		if (IS_OBJ(value) && (((Obj*)(owner))->isOld || isCellMarked(owner))) writeBarrier((Obj*)(owner), AS_OBJ(value));	\
+	} while (false)
+
+void writeBarrier(Obj* owner, Obj* value);
+void rememberObject(Obj* object);
 
 void freeObjects();			
 
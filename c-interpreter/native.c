@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "heapsnap.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "virtualm.h"
+#include "weakmap.h"
+
+// check the number of arguments passed to a native function
+static bool checkArity(const char* name, int expected, int argCount)
+{
+	if (argCount == expected) return true;
+
+	nativeError("%s() expected %d arguments but got %d.", name, expected, argCount);
+	return false;
+}
+
+
+#define MAX_EXACT_INTEGER 9007199254740992.0		// 2^53, doubles past it skip integers
+
+// number arguments used as sizes, offsets and indexes must be non negative integers
+// -> the range is tested on the double, casting NaN, infinities or values past the integer type is undefined
+static bool checkIndex(const char* name, Value value, size_t* index)
+{
+	double number = IS_NUMBER(value) ? AS_NUMBER(value) : -1;
+	if (!(number >= 0 && number <= MAX_EXACT_INTEGER && number < (double)SIZE_MAX) || number != (double)(size_t)number)
+	{
+		nativeError("%s() expects a non negative integer.", name);
+		return false;
+	}
+
+	*index = (size_t)number;
+	return true;
+}
+
+
+static Value clockNative(int argCount, Value* args)
+{
+	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);		// returns elapsed time since program was running
+}
+
+
+// longest time the program was stopped by the garbage collector, in milliseconds
+static Value gcMaxPauseNative(int argCount, Value* args)
+{
+	if (!checkArity("gcMaxPause", 0, argCount)) return NULL_VAL;
+	return NUMBER_VAL(vm.maxPause * 1000);
+}
+
+// gcCollect() runs a full collection, returns how long marking the heap took in milliseconds
+static Value gcCollectNative(int argCount, Value* args)
+{
+	if (!checkArity("gcCollect", 0, argCount)) return NULL_VAL;
+	collectGarbage();
+	return NUMBER_VAL(vm.lastMarkTime * 1000);
+}
+
+// string views are not null terminated, compare with the length
+static bool isName(Value value, const char* name)
+{
+	if (!IS_STRING(value)) return false;
+
+	ObjString* string = AS_STRING(value);
+	return (size_t)string->length == strlen(name) && memcmp(string->chars, name, string->length) == 0;
+}
+
+// pause histograms: gcStat("pauses") is the count, gcStat("pauses", "total" or "max") in milliseconds,
+// gcStat("pauses", 99) the 99th percentile in milliseconds, rounded up to its histogram bucket
+static Value pauseStat(PauseHistogram* histogram, int argCount, Value* args)
+{
+	if (argCount == 1) return NUMBER_VAL((double)histogram->count);
+	if (IS_NUMBER(args[1]) && AS_NUMBER(args[1]) >= 0 && AS_NUMBER(args[1]) <= 100)
+	{
+		return NUMBER_VAL(pausePercentile(histogram, AS_NUMBER(args[1])) * 1000);
+	}
+	if (isName(args[1], "total")) return NUMBER_VAL(histogram->total * 1000);
+	if (isName(args[1], "max")) return NUMBER_VAL(histogram->max * 1000);
+	return nativeError("gcStat() expects \"total\", \"max\" or a percentile for pauses.");
+}
+
+// live objects of the last full marking: gcStat("liveBytes") for all of them, gcStat("liveBytes", "string") for one type
+static Value liveStat(bool isBytes, int argCount, Value* args)
+{
+	HeapCensus* live = &vm.gcStats.live;
+	double total = 0;
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+	{
+		if (argCount == 2 && !isName(args[1], objTypeName((ObjType)i))) continue;
+		total += isBytes ? (double)live->bytes[i] : (double)live->objects[i];
+	}
+	return NUMBER_VAL(total);
+}
+
+// gcStat(name) -> number, statistics of the garbage collector, see gcstats.h
+static Value gcStatNative(int argCount, Value* args)
+{
+	if (argCount != 1 && argCount != 2) return nativeError("gcStat() expected 1 or 2 arguments but got %d.", argCount);
+	if (!IS_STRING(args[0])) return nativeError("gcStat() expects the name of a statistic.");
+
+	Value name = args[0];
+	GCStats* stats = &vm.gcStats;
+
+	if (isName(name, "pauses")) return pauseStat(&stats->pauses, argCount, args);
+	if (isName(name, "markPauses")) return pauseStat(&stats->markPauses, argCount, args);
+	if (isName(name, "sweepPauses")) return pauseStat(&stats->sweepPauses, argCount, args);
+	if (isName(name, "liveObjects")) return liveStat(false, argCount, args);
+	if (isName(name, "liveBytes")) return liveStat(true, argCount, args);
+
+	if (argCount == 1)
+	{
+		if (isName(name, "minorCollections")) return NUMBER_VAL((double)stats->minorCollections);
+		if (isName(name, "fullCollections")) return NUMBER_VAL((double)stats->fullCollections);
+		if (isName(name, "compactions")) return NUMBER_VAL((double)stats->compactions);
+		if (isName(name, "freedBytes")) return NUMBER_VAL((double)stats->freedBytes);
+		if (isName(name, "lastFullFreed")) return NUMBER_VAL((double)stats->lastFullFreed);
+		if (isName(name, "lastMinorFreed")) return NUMBER_VAL((double)stats->lastMinorFreed);
+		if (isName(name, "heapBytes")) return NUMBER_VAL((double)vm.bytesAllocated);
+		if (isName(name, "nextGC")) return NUMBER_VAL((double)vm.nextGC);
+	}
+
+	return nativeError("gcStat() has no statistic \"%.*s\" taking %d arguments.", AS_STRING(name)->length, AS_STRING(name)->chars, argCount);
+}
+
+
+// heapSnapshot(path) writes every live object and reference to the file, returns the number of objects
+// the file is read back with cfei --snapshot-report path
+static Value heapSnapshotNative(int argCount, Value* args)
+{
+	if (!checkArity("heapSnapshot", 1, argCount)) return NULL_VAL;
+	if (!IS_STRING(args[0])) return nativeError("heapSnapshot() expects a file path.");
+
+	ObjString* path = internString(AS_STRING(args[0]));		// views are not null terminated
+	push(OBJ_VAL(path));
+	long count = writeHeapSnapshot(path->chars);
+	pop();
+
+	if (count < 0) return nativeError("Could not write heap snapshot \"%s\".", path->chars);
+	return NUMBER_VAL((double)count);
+}
+
+
+
+/* weak references and weak maps */
+
+// weakRef(object) -> a reference that does not keep object alive, weakGet(ref) is the object or null once collected
+static Value weakRefNative(int argCount, Value* args)
+{
+	if (!checkArity("weakRef", 1, argCount)) return NULL_VAL;
+	if (!IS_OBJ(args[0])) return nativeError("weakRef() expects an object.");
+	return OBJ_VAL(newWeakRef(AS_OBJ(args[0])));
+}
+
+static Value weakGetNative(int argCount, Value* args)
+{
+	if (!checkArity("weakGet", 1, argCount)) return NULL_VAL;
+	if (!IS_WEAK_REF(args[0])) return nativeError("weakGet() expects a weak reference.");
+
+	Obj* target = AS_WEAK_REF(args[0])->target;
+	return target == NULL ? NULL_VAL : OBJ_VAL(target);
+}
+
+static Value weakMapNative(int argCount, Value* args)
+{
+	if (!checkArity("weakMap", 0, argCount)) return NULL_VAL;
+	return OBJ_VAL(newWeakMap());
+}
+
+// keys are compared by identity, strings are values and cannot be weak keys
+static bool checkWeakKey(const char* name, int expected, int argCount, Value* args)
+{
+	if (!checkArity(name, expected, argCount)) return false;
+
+	if (!IS_WEAK_MAP(args[0]))
+	{
+		nativeError("%s() expects a weak map.", name);
+		return false;
+	}
+	if (!IS_OBJ(args[1]) || IS_STRING(args[1]))
+	{
+		nativeError("%s() expects an object other than a string as key.", name);
+		return false;
+	}
+	return true;
+}
+
+// mapGet(map, key) -> the value, or null if the key is not in the map
+static Value mapGetNative(int argCount, Value* args)
+{
+	if (!checkWeakKey("mapGet", 2, argCount, args)) return NULL_VAL;
+
+	Value value;
+	if (!weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value)) return NULL_VAL;
+	return value;
+}
+
+// mapSet(map, key, value) -> value
+static Value mapSetNative(int argCount, Value* args)
+{
+	if (!checkWeakKey("mapSet", 3, argCount, args)) return NULL_VAL;
+	weakMapSet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), args[2]);
+	return args[2];
+}
+
+static Value mapHasNative(int argCount, Value* args)
+{
+	if (!checkWeakKey("mapHas", 2, argCount, args)) return NULL_VAL;
+
+	Value value;
+	return BOOL_VAL(weakMapGet(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]), &value));
+}
+
+// mapDelete(map, key) -> true if the key was in the map
+static Value mapDeleteNative(int argCount, Value* args)
+{
+	if (!checkWeakKey("mapDelete", 2, argCount, args)) return NULL_VAL;
+	return BOOL_VAL(weakMapDelete(AS_WEAK_MAP(args[0]), AS_OBJ(args[1])));
+}
+
+/* string builders */
+static Value builderNative(int argCount, Value* args)
+{
+	if (!checkArity("builder", 0, argCount)) return NULL_VAL;
+	return OBJ_VAL(newStringBuilder());
+}
+
+// append(builder, value) -> builder, so appends can be chained
+static Value appendNative(int argCount, Value* args)
+{
+	if (!checkArity("append", 2, argCount)) return NULL_VAL;
+	if (!IS_STRING_BUILDER(args[0])) return nativeError("append() expects a string builder.");
+
+	ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+	Value value = args[1];
+
+	if (IS_STRING(value))
+	{
+		appendStringBuilder(builder, AS_STRING(value)->chars, AS_STRING(value)->length);
+	}
+	else if (IS_NUMBER(value))
+	{
+		char buffer[32];
+		int length = snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));		// same format as printValue
+		appendStringBuilder(builder, buffer, length);
+	}
+	else if (IS_BOOL(value))
+	{
+		if (AS_BOOL(value)) appendStringBuilder(builder, "true", 4);
+		else appendStringBuilder(builder, "false", 5);
+	}
+	else if (IS_NULL(value))
+	{
+		appendStringBuilder(builder, "null", 4);
+	}
+	else
+	{
+		return nativeError("append() can only append strings, numbers, booleans and null.");
+	}
+
+	return args[0];
+}
+
+// finish(builder) -> the built string; the builder is emptied
+static Value finishNative(int argCount, Value* args)
+{
+	if (!checkArity("finish", 1, argCount)) return NULL_VAL;
+	if (!IS_STRING_BUILDER(args[0])) return nativeError("finish() expects a string builder.");
+
+	return OBJ_VAL(finishStringBuilder(AS_STRING_BUILDER(args[0])));
+}
+
+
+/* string views */
+
+// substring(string, start, end) -> view of characters [start, end), shares the chars of string
+static Value substringNative(int argCount, Value* args)
+{
+	if (!checkArity("substring", 3, argCount)) return NULL_VAL;
+	if (!IS_STRING(args[0])) return nativeError("substring() expects a string.");
+
+	ObjString* string = AS_STRING(args[0]);
+	size_t start, end;
+	if (!checkIndex("substring", args[1], &start) || !checkIndex("substring", args[2], &end)) return NULL_VAL;
+	if (start > end || end > (size_t)string->length) return nativeError("Substring [%zu, %zu) out of bounds for length %d.", start, end, string->length);
+
+	return OBJ_VAL(sliceString(string, (int)start, (int)end));
+}
+
+// indexOf(string, needle, from) -> index of the first match at or after from, -1 if there is none
+static Value indexOfNative(int argCount, Value* args)
+{
+	if (!checkArity("indexOf", 3, argCount)) return NULL_VAL;
+	if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return nativeError("indexOf() expects two strings.");
+
+	ObjString* string = AS_STRING(args[0]);
+	ObjString* needle = AS_STRING(args[1]);
+	size_t from;
+	if (!checkIndex("indexOf", args[2], &from)) return NULL_VAL;
+	if (from > (size_t)string->length || (size_t)needle->length > (size_t)string->length) return NUMBER_VAL(-1);
+
+	size_t last = (size_t)(string->length - needle->length);		// start of the last place the needle fits
+	for (size_t i = from; i <= last; i++)
+	{
+		if (memcmp(string->chars + i, needle->chars, needle->length) == 0) return NUMBER_VAL((double)i);
+	}
+
+	return NUMBER_VAL(-1);
+}
+
+
+/* byte buffers */
+static Value bytesNative(int argCount, Value* args)
+{
+	if (!checkArity("bytes", 1, argCount)) return NULL_VAL;
+
+	size_t length;
+	if (!checkIndex("bytes", args[0], &length)) return NULL_VAL;
+	return OBJ_VAL(newBytes(length));
+}
+
+static Value mapFileNative(int argCount, Value* args)
+{
+	if (!checkArity("mapFile", 1, argCount)) return NULL_VAL;
+	if (!IS_STRING(args[0])) return nativeError("mapFile() expects a file path.");
+
+	ObjString* path = internString(AS_STRING(args[0]));		// views are not null terminated
+	push(OBJ_VAL(path));
+	ObjBytes* bytes = mapBytesFile(path->chars);
+	pop();
+
+	if (bytes == NULL) return nativeError("Could not map file \"%s\".", path->chars);
+	return OBJ_VAL(bytes);
+}
+
+// slice(bytes, start, end) -> view of [start, end) sharing the storage of bytes
+static Value sliceNative(int argCount, Value* args)
+{
+	if (!checkArity("slice", 3, argCount)) return NULL_VAL;
+	if (!IS_BYTES(args[0])) return nativeError("slice() expects a byte buffer.");
+
+	ObjBytes* bytes = AS_BYTES(args[0]);
+	size_t start, end;
+	if (!checkIndex("slice", args[1], &start) || !checkIndex("slice", args[2], &end)) return NULL_VAL;
+	if (start > end || end > bytes->length) return nativeError("Slice [%zu, %zu) out of bounds for %zu bytes.", start, end, bytes->length);
+
+	return OBJ_VAL(sliceBytes(bytes, start, end));
+}
+
+// integer fields are 1, 2, 4 or 8 bytes wide, little endian unless bigEndian is true
+static bool checkField(const char* name, Value* args, ObjBytes** bytes, size_t* offset, size_t* width)
+{
+	if (!IS_BYTES(args[0]))
+	{
+		nativeError("%s() expects a byte buffer.", name);
+		return false;
+	}
+	*bytes = AS_BYTES(args[0]);
+
+	if (!checkIndex(name, args[1], offset) || !checkIndex(name, args[2], width)) return false;
+	if (*width != 1 && *width != 2 && *width != 4 && *width != 8)
+	{
+		nativeError("%s() width must be 1, 2, 4 or 8.", name);
+		return false;
+	}
+	if (*offset > (*bytes)->length || *width > (*bytes)->length - *offset)
+	{
+		nativeError("%s() field at %zu is out of bounds for %zu bytes.", name, *offset, (*bytes)->length);
+		return false;
+	}
+
+	return true;
+}
+
+static uint64_t readField(uint8_t* data, size_t width, bool bigEndian)
+{
+	uint64_t result = 0;
+	for (size_t i = 0; i < width; i++)
+	{
+		uint8_t byte = bigEndian ? data[i] : data[width - 1 - i];		// most significant byte first
+		result = (result << 8) | byte;
+	}
+	return result;
+}
+
+// readUInt(bytes, offset, width, bigEndian)
+static Value readUIntNative(int argCount, Value* args)
+{
+	if (!checkArity("readUInt", 4, argCount)) return NULL_VAL;
+
+	ObjBytes* bytes;
+	size_t offset, width;
+	if (!checkField("readUInt", args, &bytes, &offset, &width)) return NULL_VAL;
+
+	return NUMBER_VAL((double)readField(bytes->data + offset, width, !isFalsey(args[3])));
+}
+
+// readInt(bytes, offset, width, bigEndian), two's complement
+static Value readIntNative(int argCount, Value* args)
+{
+	if (!checkArity("readInt", 4, argCount)) return NULL_VAL;
+
+	ObjBytes* bytes;
+	size_t offset, width;
+	if (!checkField("readInt", args, &bytes, &offset, &width)) return NULL_VAL;
+
+	uint64_t field = readField(bytes->data + offset, width, !isFalsey(args[3]));
+	if (width < 8 && (field >> (width * 8 - 1)) & 1)		// sign extend
+	{
+		field |= ~(uint64_t)0 << (width * 8);
+	}
+	return NUMBER_VAL((double)(int64_t)field);
+}
+
+// writeInt(bytes, offset, width, value, bigEndian), the integer part of value is truncated to the field width
+static Value writeIntNative(int argCount, Value* args)
+{
+	if (!checkArity("writeInt", 5, argCount)) return NULL_VAL;
+
+	ObjBytes* bytes;
+	size_t offset, width;
+	if (!checkField("writeInt", args, &bytes, &offset, &width)) return NULL_VAL;
+	if (bytes->isMapped) return nativeError("writeInt() cannot write to a mapped file.");
+	if (!IS_NUMBER(args[3])) return nativeError("writeInt() expects a number to write.");
+
+	// anything a 64 bit integer cannot hold, NaN and infinities included, has no defined conversion
+	double number = AS_NUMBER(args[3]);
+	if (!(number >= -9223372036854775808.0 && number < 18446744073709551616.0)) return nativeError("writeInt() expects a value that fits 64 bits.");
+
+	uint64_t field = number < 0 ? (uint64_t)(int64_t)number : (uint64_t)number;
+	bool bigEndian = !isFalsey(args[4]);
+
+	for (size_t i = 0; i < width; i++)			// least significant byte first
+	{
+		size_t index = bigEndian ? width - 1 - i : i;
+		bytes->data[offset + index] = (uint8_t)(field & 0xff);
+		field >>= 8;
+	}
+
+	return NULL_VAL;
+}
+
+// length(value) for strings, string builders and byte buffers
+static Value lengthNative(int argCount, Value* args)
+{
+	if (!checkArity("length", 1, argCount)) return NULL_VAL;
+
+	if (IS_STRING(args[0])) return NUMBER_VAL(AS_STRING(args[0])->length);
+	if (IS_STRING_BUILDER(args[0])) return NUMBER_VAL(AS_STRING_BUILDER(args[0])->length);
+	if (IS_BYTES(args[0])) return NUMBER_VAL((double)AS_BYTES(args[0])->length);
+	if (IS_WEAK_MAP(args[0])) return NUMBER_VAL(AS_WEAK_MAP(args[0])->count);
+
+	return nativeError("length() expects a string, string builder, byte buffer or weak map.");
+}
+
+
+static void defineNative(const char* name, NativeFn function)
+{
+	push(OBJ_VAL(copyString(name, (int)strlen(name))));			// strlen to get char* length
+	push(OBJ_VAL(newNative(function)));
+	tableSet(&vm.globals, AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
+	pop();
+	pop();
+}
+
+void defineNatives()
+{
+	defineNative("clock", clockNative);
+	defineNative("gcMaxPause", gcMaxPauseNative);
+	defineNative("gcCollect", gcCollectNative);
+	defineNative("gcStat", gcStatNative);
+	defineNative("heapSnapshot", heapSnapshotNative);
+
+	defineNative("weakRef", weakRefNative);
+	defineNative("weakGet", weakGetNative);
+	defineNative("weakMap", weakMapNative);
+	defineNative("mapGet", mapGetNative);
+	defineNative("mapSet", mapSetNative);
+	defineNative("mapHas", mapHasNative);
+	defineNative("mapDelete", mapDeleteNative);
+
+	defineNative("builder", builderNative);
+	defineNative("append", appendNative);
+	defineNative("finish", finishNative);
+
+	defineNative("substring", substringNative);
+	defineNative("indexOf", indexOfNative);
+
+	defineNative("bytes", bytesNative);
+	defineNative("mapFile", mapFileNative);
+	defineNative("slice", sliceNative);
+	defineNative("readUInt", readUIntNative);
+	defineNative("readInt", readIntNative);
+	defineNative("writeInt", writeIntNative);
+	defineNative("length", lengthNative);
+}
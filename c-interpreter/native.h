@@ -0,0 +1,11 @@
+// native functions, built in functions written in C and exposed to the user as globals
+#ifndef native_h
+#define native_h
+
+#include "common.h"
+#include "value.h"
+
+// define every native function in the VM's global table, called from initVM()
+void defineNatives();
+
+#endif
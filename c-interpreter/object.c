@@ -1,9 +1,20 @@
 #include <stdio.h>
 #include <string.h>		//memcpy
 
+// for mapping files into byte buffers
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "hasht.h"
 #include "value.h"
 #include "virtualm.h"
@@ -19,14 +30,11 @@
 
 static Obj* allocateObject(size_t size, ObjType type)
 {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);		// allocate memory for obj
+	Obj* object = (Obj*)allocateObjectMemory(size);		// allocate memory for obj, a cell of the page heap
 	object->type = type;
-	object->isMarked = false;
-
-	// every time an object is allocated, insert to the list
-	// insert as the HEAD; the latest one inserted will be at the start
-	object->next = vm.objects;			// vm from virtualm.h, with extern
-	vm.objects = object;		
+	object->isOld = false;
+	object->isRemembered = false;
+	PROFILE_ALLOCATION(object, type, size);
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zd for %d\n", (void*)object, size, type);			// %ld prints LONG INT
@@ -43,6 +51,8 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 	ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
 	bound->receiver = receiver;
 	bound->method = method;
+	WRITE_BARRIER(bound, receiver);
+	WRITE_BARRIER(bound, OBJ_VAL(method));
 	return bound;
 }
 
@@ -64,18 +74,28 @@ ObjClosure* newClosure(ObjFunction* function)
 	closure->function = function;
 	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
+	WRITE_BARRIER(closure, OBJ_VAL(function));
 	return closure;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash)			// pass in hash
+// a string that owns its chars, not hashed nor interned yet
+static ObjString* allocateString(char* chars, int length)
 {
 	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
 	string->length = length;
 	string->chars = chars;
-	string->hash = hash;
+	string->hash = 0;
+	string->owner = NULL;
+	string->isInterned = false;
+	return string;
+}
+
+// the string becomes the one in vm.strings with its contents, it must have been hashed and looked up
+static ObjString* addInterned(ObjString* string)
+{
+	string->isInterned = true;
 
 	push(OBJ_VAL(string));		// garbage collection
-	//printf("allocate\n");
 	tableSet(&vm.strings, string, NULL_VAL);		// for string interning
 	pop();			// garbage collection
 
@@ -87,6 +107,7 @@ ObjClass* newClass(ObjString* name)
 	ObjClass* kelas = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);		// kelas not class for compiling in c++
 	kelas->name = name;
 	initTable(&kelas->methods);
+	WRITE_BARRIER(kelas, OBJ_VAL(name));
 	return kelas;
 }
 
@@ -97,6 +118,7 @@ ObjInstance* newInstance(ObjClass* kelas)
 	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
 	instance->kelas = kelas;
 	initTable(&instance->fields);		// memory address of the fields
+	WRITE_BARRIER(instance, OBJ_VAL(kelas));
 	return instance;
 }
 
@@ -122,36 +144,69 @@ ObjNative* newNative(NativeFn function)
 
 
 
-// hash function, the FNV-1a
+/*	hash function, 8 bytes at a time
+-> every word is folded into the hash with a rotate, an xor and a multiply, the length is mixed in first so the
+	last 1 to 7 bytes can be read without padding
+-> the words are read with memcpy of a constant size, which compiles to a single load and has no alignment requirement
+-> the final mix spreads every bit over the whole hash, tables use both its low bits and its top 7 bits
+-> 0 is left for strings that are not hashed yet
+*/
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
 static uint32_t hashString(const char* key, int length)
 {
-	uint32_t hash = 2116136261u;		// initial hash value, u at end means unsigned
+	uint64_t hash = (uint64_t)length * HASH_MULTIPLIER;
+	uint64_t word;
 
-	for (int i = 0; i < length; i++)	// traverse through the data to be hashed
+	int i = 0;
+	for (; i + 8 <= length; i += 8)
 	{
-		hash ^= key[i];			// munge the bits from the string key to the hash value; ^= is a bitwise operator
-		hash *= 16777619;
+		memcpy(&word, key + i, 8);
+		hash = (((hash << 5) | (hash >> 59)) ^ word) * HASH_MULTIPLIER;
 	}
 
-	return hash;
-}
-
+	// the last 4 to 7 bytes are two 4 byte reads that may overlap, 1 to 3 bytes are read one by one
+	int rest = length - i;
+	const char* tail = key + i;
+	if (rest >= 4)
+	{
+		uint32_t low, high;
+		memcpy(&low, tail, 4);
+		memcpy(&high, tail + rest - 4, 4);
+		word = (uint64_t)high << 32 | low;
+		hash = (((hash << 5) | (hash >> 59)) ^ word) * HASH_MULTIPLIER;
+	}
+	else if (rest > 0)
+	{
+		word = (uint64_t)(uint8_t)tail[0] | (uint64_t)(uint8_t)tail[rest / 2] << 8 | (uint64_t)(uint8_t)tail[rest - 1] << 16;
+		hash = (((hash << 5) | (hash >> 59)) ^ word) * HASH_MULTIPLIER;
+	}
 
-// shorten than copyString because owernship of the char* itself is declared in concatenate(), hence no need to declare memory again
-ObjString* takeString(char* chars, int length)
-{
-	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	// the finalizer of MurmurHash3
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
 
+	return (uint32_t)hash != 0 ? (uint32_t)hash : 1;
+}
 
-	if (interned != NULL)		// if the same string already exists
-	{
-		FREE_ARRAY(char, chars, length + 1);		// free the memory for use
-		return interned;
-	}
+static uint32_t stringHash(ObjString* string)
+{
+	if (string->hash == 0) string->hash = hashString(string->chars, string->length);
+	return string->hash;
+}
 
 
-	return allocateString(chars, length, hash);
+/*	strings made at runtime, by concatenation or string builders, are neither hashed nor interned
+-> most of them are printed, appended or thrown away and never compared, a string read from a file would otherwise be
+	hashed and looked up in vm.strings in full before the program sees it
+-> equality compares them by contents, internString() hashes and interns one when it is needed as a table key
+*/
+ObjString* takeString(char* chars, int length)
+{
+	return allocateString(chars, length);
 }
 
 // copy string from source code to memory
@@ -167,7 +222,50 @@ ObjString* copyString(const char* chars, int length)
 	memcpy(heapChars, chars, length);			// copy memory from one location to another; memcpy(*to, *from, size_t (from))
 	heapChars[length] = '\0';		// '\0', a null terminator used to signify the end of the string, placed at the end
 
-	return allocateString(heapChars, length, hash);
+	ObjString* string = allocateString(heapChars, length);
+	string->hash = hash;
+	return addInterned(string);
+}
+
+// views share the chars of their owner, nothing is copied, hashed or looked up in vm.strings
+ObjString* sliceString(ObjString* string, int start, int end)
+{
+	ObjString* owner = string->owner != NULL ? string->owner : string;		// never chain views
+	char* chars = string->chars + start;
+
+	ObjString* view = ALLOCATE_OBJ(ObjString, OBJ_STRING);			// string is on the stack, safe if the GC runs here
+	view->length = end - start;
+	view->chars = chars;
+	view->hash = 0;
+	view->owner = owner;
+	view->isInterned = false;
+	WRITE_BARRIER(view, OBJ_VAL(owner));
+	return view;
+}
+
+// views are copied into an owned, null terminated string before interning, a string that owns its chars is interned
+// itself unless vm.strings has one with the same contents already
+ObjString* internString(ObjString* string)
+{
+	if (string->isInterned) return string;
+	if (string->owner != NULL) return copyString(string->chars, string->length);
+
+	ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, stringHash(string));
+	if (interned != NULL) return interned;
+
+	return addInterned(string);
+}
+
+bool stringsEqual(ObjString* a, ObjString* b)
+{
+	if (a == b) return true;
+	if (a->isInterned && b->isInterned) return false;		// equal interned strings share the same pointer
+	if (a->length != b->length) return false;
+
+	// hashes are only compared when both strings have one, hashing just to compare would read them to the end while
+	// memcmp stops at the first difference
+	if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+	return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 
@@ -180,6 +278,178 @@ ObjUpvalue* newUpvalue(Value* slot)
 	return upvalue;
 }
 
+// string builders
+ObjStringBuilder* newStringBuilder()
+{
+	ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+	builder->length = 0;
+	builder->capacity = 0;
+	builder->chars = NULL;
+	return builder;
+}
+
+// builder must be reachable(e.g. on the stack) as growing the buffer can trigger the garbage collector
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length)
+{
+	if (builder->capacity < builder->length + length + 1)		// + 1 keeps room for the null terminator in finish
+	{
+		int oldCapacity = builder->capacity;
+		int capacity = GROW_CAPACITY(oldCapacity);
+		while (capacity < builder->length + length + 1) capacity = GROW_CAPACITY(capacity);
+
+		builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+		builder->capacity = capacity;
+	}
+
+	memcpy(builder->chars + builder->length, chars, length);
+	builder->length += length;
+}
+
+// hand the buffer over to an ObjString without copying it
+ObjString* finishStringBuilder(ObjStringBuilder* builder)
+{
+	int length = builder->length;
+	
+	// takeString expects a buffer of exactly length + 1, shrink before handing it over
+	char* chars = GROW_ARRAY(char, builder->chars, builder->capacity, length + 1);
+	chars[length] = '\0';
+
+	// detach the buffer first; takeString may collect garbage
+	builder->chars = NULL;
+	builder->length = 0;
+	builder->capacity = 0;
+
+	return takeString(chars, length);
+}
+
+// byte buffers
+ObjBytes* newBytes(size_t length)
+{
+	// allocate storage before the object, like closures do with their upvalue array
+	uint8_t* data = ALLOCATE(uint8_t, length);
+	if (length > 0) memset(data, 0, length);
+
+	ObjBytes* bytes = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);
+	bytes->data = data;
+	bytes->length = length;
+	bytes->parent = NULL;
+	bytes->isMapped = false;
+	return bytes;
+}
+
+// slices always point at the buffer that owns the storage, so slices of slices do not form chains
+ObjBytes* sliceBytes(ObjBytes* bytes, size_t start, size_t end)
+{
+	ObjBytes* owner = bytes->parent != NULL ? bytes->parent : bytes;
+	uint8_t* data = bytes->data + start;
+
+	ObjBytes* slice = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);		// bytes is on the stack, safe if the GC runs here
+	slice->data = data;
+	slice->length = end - start;
+	slice->parent = owner;
+	slice->isMapped = owner->isMapped;
+	WRITE_BARRIER(slice, OBJ_VAL(owner));
+	return slice;
+}
+
+// map a file read-only, the contents are paged in by the OS on access and never copied into the heap
+// -> the object is allocated before the file is mapped, an allocation that fails cannot leak the mapping
+ObjBytes* mapBytesFile(const char* path)
+{
+	ObjBytes* bytes = ALLOCATE_OBJ(ObjBytes, OBJ_BYTES);		// empty until mapped, left to the collector on failure
+	bytes->data = NULL;
+	bytes->length = 0;
+	bytes->parent = NULL;
+	bytes->isMapped = true;
+
+	uint8_t* data = NULL;
+	size_t length = 0;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return NULL;
+	}
+	length = (size_t)size.QuadPart;
+
+	if (length > 0)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping != NULL)
+		{
+			data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);		// the view keeps the mapping alive
+		}
+	}
+	CloseHandle(file);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	length = (size_t)info.st_size;
+
+	if (length > 0)
+	{
+		void* mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapped != MAP_FAILED) data = (uint8_t*)mapped;
+	}
+	close(fd);			// the mapping stays valid after the descriptor is closed
+#endif
+
+	if (length > 0 && data == NULL) return NULL;
+
+	bytes->data = data;
+	bytes->length = length;
+	return bytes;
+}
+
+void unmapBytes(ObjBytes* bytes)
+{
+	if (bytes->data == NULL) return;		// empty files are never mapped
+
+#ifdef _WIN32
+	UnmapViewOfFile(bytes->data);
+#else
+	munmap(bytes->data, bytes->length);
+#endif
+}
+
+
+// weak objects
+// the collector's list of weak objects grows first, a collection run by the allocation must not miss the new one
+ObjWeakRef* newWeakRef(Obj* target)
+{
+	reserveWeak();
+	ObjWeakRef* ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+	ref->target = target;
+	registerWeak((Obj*)ref);
+	return ref;
+}
+
+ObjWeakMap* newWeakMap()
+{
+	reserveWeak();
+	ObjWeakMap* map = ALLOCATE_OBJ(ObjWeakMap, OBJ_WEAK_MAP);
+	map->count = 0;
+	map->tombstones = 0;
+	map->capacity = 0;
+	map->entries = NULL;
+	map->isStale = false;
+	registerWeak((Obj*)map);
+	return map;
+}
+
 static void printFunction(ObjFunction* function)
 {
 	if (function->name == NULL)
@@ -198,6 +468,9 @@ void printObject(Value value)
 	case OBJ_BOUND_METHOD:
 		printFunction(AS_BOUND_METHOD(value)->method->function);
 		break;
+	case OBJ_BYTES:
+		printf("<bytes %zu>", AS_BYTES(value)->length);
+		break;
 	case OBJ_CLASS:
 		printf("%s", AS_CLASS(value)->name->chars);
 		break;
@@ -214,11 +487,20 @@ void printObject(Value value)
 		printf("<native fun>");
 		break;
 	case OBJ_STRING:
-		printf("%s", AS_CSTRING(value));
+		printf("%.*s", AS_STRING(value)->length, AS_CSTRING(value));		// views are not null terminated
+		break;
+	case OBJ_STRING_BUILDER:
+		printf("%.*s", AS_STRING_BUILDER(value)->length, AS_STRING_BUILDER(value)->chars);
 		break;
 	case OBJ_UPVALUE:
 		printf("upvalue");
 		break;
+	case OBJ_WEAK_MAP:
+		printf("<weak map %d>", AS_WEAK_MAP(value)->count);
+		break;
+	case OBJ_WEAK_REF:
+		printf("<weak ref>");
+		break;
 	default:
 		return;
 	}
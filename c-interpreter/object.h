@@ -19,6 +19,10 @@
 #define IS_NATIVE(value)	isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)	isObjType(value, OBJ_STRING)		// takes in raw Value, not raw Obj*
 #define IS_CLOSURE(value)	isObjType(value, OBJ_CLOSURE)
+#define IS_STRING_BUILDER(value)	isObjType(value, OBJ_STRING_BUILDER)
+#define IS_BYTES(value)		isObjType(value, OBJ_BYTES)
+#define IS_WEAK_REF(value)	isObjType(value, OBJ_WEAK_REF)
+#define IS_WEAK_MAP(value)	isObjType(value, OBJ_WEAK_MAP)
 
 // macros to tell that it is safe when creating a tag, by returning the requested type
 // take a Value that is expected to conatin a pointer to the heap, first returns pointer second the charray itself
@@ -30,30 +34,45 @@
 #define AS_STRING(value)	((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)	(((ObjString*)AS_OBJ(value))->chars)		// get chars(char*) from ObjString pointer
 #define AS_FUNCTION(value)	((ObjFunction*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value)	((ObjStringBuilder*)AS_OBJ(value))
+#define AS_BYTES(value)		((ObjBytes*)AS_OBJ(value))
+#define AS_WEAK_REF(value)	((ObjWeakRef*)AS_OBJ(value))
+#define AS_WEAK_MAP(value)	((ObjWeakMap*)AS_OBJ(value))
 #define AS_NATIVE(value)	\
 	(((ObjNative*)AS_OBJ(value))->function)
 
 typedef enum
 {
 	OBJ_BOUND_METHOD,
+	OBJ_BYTES,
 	OBJ_INSTANCE,
 	OBJ_CLASS,
 	OBJ_CLOSURE,
 	OBJ_FUNCTION,
 	OBJ_NATIVE,
 	OBJ_STRING,
-	OBJ_UPVALUE
+	OBJ_STRING_BUILDER,
+	OBJ_UPVALUE,
+	OBJ_WEAK_MAP,
+	OBJ_WEAK_REF
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_WEAK_REF + 1)		// follows the last type
 
+
+/* object header, 3 bytes
+-> objects live in the pages of vm.heap, the collector finds every object there, there is no list through them
+-> marks for mark-sweep garbage collection are in the side bitmaps of the page, see heap.h
+-> the header is bytes only, so an object's int and bool fields come right after it and share the first 8 bytes
+	instead of starting a word of their own, object types keep their small fields first for that
+*/
 struct Obj					// as no typedef is used, 'struct' itself will always havae to be typed
 {
-	ObjType type;
-	struct Obj* next;		// linked list or intrusive list, to avoid memory leaks, obj itself as a node
-							// traverse the list to find every object that has been allocated on the heap
+	uint8_t type;			// an ObjType
 
-	// for mark-sweep garbage collection
-	bool isMarked;
+	// for generational garbage collection
+	bool isOld;				// survived a collection, only traced by full collections
+	bool isRemembered;		// old object in the remembered set, may point to young objects
 };
 
 // for functions and calls
@@ -84,11 +103,11 @@ typedef struct
 {
 	// points to an ObjFunction and Obj header
 	Obj obj;					// Obj header
+	int upvalueCount;
 	ObjFunction* function;
 	
 	// for upvalues
 	ObjUpvalue** upvalues;		// array of upvalue pointers
-	int upvalueCount;
 } ObjClosure;
 
 
@@ -105,12 +124,68 @@ typedef struct {
 struct ObjString			// using struct inheritance
 {
 	Obj obj;
+	bool isInterned;	// interned strings are unique and compared by pointer
 	int length;
-	char* chars;
-	uint32_t hash;		// for hash table, for cache(temporary storage area); each ObjString has a hash code for itself
+	uint32_t hash;		// for hash table, 0 until the string is interned, strings made at runtime are not
+	char* chars;		// null terminated, except for views
+
+	// views point into the chars of an owner string instead of copying them
+	// like strings made at runtime they are not hashed nor interned, internString() does that when a view is needed
+	// as a table key
+	struct ObjString* owner;		// NULL if the string owns its chars
 };
 
 
+// mutable string buffer, appending is amortized O(1) unlike concatenating ObjStrings
+// nothing is hashed or interned, finishStringBuilder() hands the buffer over to an ObjString
+typedef struct
+{
+	Obj obj;
+	int length;
+	int capacity;
+	char* chars;		// not null terminated while building
+} ObjStringBuilder;
+
+
+// raw byte buffer for binary data, never copied or interned like ObjString
+// slices are views that share the storage of the buffer they were cut from
+typedef struct ObjBytes
+{
+	Obj obj;
+	bool isMapped;				// storage is a read-only file mapping, not on the heap
+	uint8_t* data;				// first byte of this buffer, points into the parent's storage for slices
+	size_t length;
+	struct ObjBytes* parent;	// buffer that owns the storage, kept alive by the GC; NULL if this buffer owns it
+} ObjBytes;
+
+
+// weak references, the collector does not keep the target alive and clears the reference once nothing else reaches it
+typedef struct
+{
+	Obj obj;
+	Obj* target;				// NULL once collected
+} ObjWeakRef;
+
+// weak keyed map, an ephemeron table: an entry is dropped when its key is only reached through the map, and its value
+// is kept alive by the key, not by the map, so a value referring back to its own key does not keep the entry alive
+// -> keys are objects compared by identity and hashed by address, see weakmap.h
+typedef struct
+{
+	Obj* key;					// NULL for empty entries and tombstones, tombstones hold true
+	Value value;
+} WeakEntry;
+
+typedef struct
+{
+	Obj obj;
+	bool isStale;				// compaction moved keys, their addresses no longer match the buckets
+	int count;					// live entries
+	int tombstones;
+	int capacity;
+	WeakEntry* entries;
+} ObjWeakMap;
+
+
 // class object type
 typedef struct
 {
@@ -144,8 +219,26 @@ ObjNative* newNative(NativeFn function);
 ObjClosure* newClosure(ObjFunction* function);			// create closure from ObjFunction
 ObjUpvalue* newUpvalue(Value* slot);
 
-ObjString* takeString(char* chars, int length);			// create ObjString ptr from raw Cstring
+// string builders
+ObjStringBuilder* newStringBuilder();
+void appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length);
+ObjString* finishStringBuilder(ObjStringBuilder* builder);		// builder is emptied and can be reused
+
+// byte buffers
+ObjBytes* newBytes(size_t length);				// zero filled
+ObjBytes* sliceBytes(ObjBytes* bytes, size_t start, size_t end);		// zero-copy view of [start, end)
+ObjBytes* mapBytesFile(const char* path);		// read-only mapping of a whole file, NULL if it cannot be mapped
+void unmapBytes(ObjBytes* bytes);				// used when freeing a mapped buffer
+
+// weak references and weak maps, registered with the collector which clears them
+ObjWeakRef* newWeakRef(Obj* target);
+ObjWeakMap* newWeakMap();
+
+ObjString* takeString(char* chars, int length);			// create ObjString ptr from raw Cstring, not interned
 ObjString* copyString(const char* chars, int length);	// note: const inside parameter means that parameter cannot be changed
+ObjString* sliceString(ObjString* string, int start, int end);		// zero-copy view of chars [start, end)
+ObjString* internString(ObjString* string);				// the interned string with the same contents
+bool stringsEqual(ObjString* a, ObjString* b);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type)				// inline function, initialized in .h file
@@ -0,0 +1,780 @@
+#include <string.h>
+
+#include "optimizer.h"
+#include "ssa.h"
+
+// a computed subexpression replaced by a load of its temporary has to save more than the store it adds
+#define CSE_MIN_INSTRUCTIONS 3
+
+// fixpoint rounds of dead code elimination, each round can only find what the last one uncovered
+#define DCE_MAX_ROUNDS 4
+
+typedef struct
+{
+	SsaFunction* ssa;
+	int* numbers;				// value number of each OP value, the value itself until an equal one is found
+	int* matches;				// instruction computing the same value that dominates each instruction, -1 for none
+	int tempWriters[UINT8_COUNT];		// instruction storing each temporary
+} Optimizer;
+
+static SsaInstruction* instructionAt(SsaFunction* ssa, int block, int position)
+{
+	return &ssa->instructions[ssa->blocks[block].instructions[position]];
+}
+
+static bool isKept(SsaFunction* ssa, int block, int position)
+{
+	SsaInstruction* instruction = instructionAt(ssa, block, position);
+	return instruction->block == block && !instruction->isRemoved;
+}
+
+static int input(SsaFunction* ssa, SsaInstruction* instruction, int index)
+{
+	return ssa->inputs[instruction->inputs + index];
+}
+
+static uint8_t inputType(SsaFunction* ssa, SsaInstruction* instruction, int index)
+{
+	return ssa->values[input(ssa, instruction, index)].type;
+}
+
+static bool isLoad(uint8_t op)
+{
+	return op == OP_CONSTANT || op == OP_NULL || op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL;
+}
+
+// pushes a value computed from the values it pops and nothing else, the same operands give the same result
+static bool isComputation(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_NEGATE:
+	case OP_NOT:
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool isPure(uint8_t op)
+{
+	return isLoad(op) || isComputation(op);
+}
+
+// the remainder is taken of integers in C, a zero divisor would bring the process down
+static bool isSafeDivisor(SsaFunction* ssa, int value)
+{
+	SsaValue* divisor = &ssa->values[resolveValue(ssa, value)];
+	if (divisor->kind != VALUE_CONSTANT) return false;
+
+	SsaInstruction* load = &ssa->instructions[divisor->instruction];
+	if (load->op != OP_CONSTANT || !IS_NUMBER(ssa->chunk->constants.values[load->operand])) return false;
+
+	double number = AS_NUMBER(ssa->chunk->constants.values[load->operand]);
+	return number >= 1 && number < 2147483648.0;
+}
+
+// whether the instruction may stop the program with a runtime error, from what is known of its operand types
+static bool canFail(SsaFunction* ssa, SsaInstruction* instruction)
+{
+	switch (instruction->op)
+	{
+	case OP_CONSTANT:
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_POP:
+	case OP_NOT:
+	case OP_EQUAL:
+		return false;
+
+	case OP_NEGATE:
+		return inputType(ssa, instruction, 0) != SSA_TYPE_NUMBER;
+
+	case OP_MODULO:
+		if (!isSafeDivisor(ssa, input(ssa, instruction, 1))) return true;
+		// fall through
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_GREATER:
+	case OP_LESS:
+		return inputType(ssa, instruction, 0) != SSA_TYPE_NUMBER || inputType(ssa, instruction, 1) != SSA_TYPE_NUMBER;
+
+	case OP_ADD:
+	{
+		uint8_t a = inputType(ssa, instruction, 0);
+		uint8_t b = inputType(ssa, instruction, 1);
+		return !(a == b && (a == SSA_TYPE_NUMBER || a == SSA_TYPE_STRING));
+	}
+
+	default:
+		return true;
+	}
+}
+
+// the types a computation can produce, from those of its operands
+static uint8_t computedType(SsaFunction* ssa, SsaInstruction* instruction)
+{
+	switch (instruction->op)
+	{
+	case OP_NEGATE:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+		return SSA_TYPE_NUMBER;
+
+	case OP_NOT:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+		return SSA_TYPE_BOOL;
+
+	// both numbers or both strings, anything else is an error
+	case OP_ADD:
+		return inputType(ssa, instruction, 0) & inputType(ssa, instruction, 1) & (SSA_TYPE_NUMBER | SSA_TYPE_STRING);
+
+	default:
+		return SSA_TYPE_ANY;
+	}
+}
+
+// computations and phis start out with no type and gather the types that can reach them, loops go round until nothing changes
+static void inferTypes(SsaFunction* ssa)
+{
+	for (int v = 0; v < ssa->valueCount; v++)
+	{
+		SsaValue* value = &ssa->values[v];
+		bool isComputed = value->kind == VALUE_OP && isComputation(ssa->instructions[value->instruction].op);
+		if (value->kind == VALUE_PHI || isComputed || (value->kind == VALUE_COPY && value->type == 0)) value->type = 0;
+	}
+
+	// copies checked by their instruction keep the type they were given, the others take their source's
+	bool* isChecked = ARENA_ALLOCATE(ssa->arena, bool, ssa->valueCount);
+	for (int v = 0; v < ssa->valueCount; v++) isChecked[v] = ssa->values[v].kind == VALUE_COPY && ssa->values[v].type != 0;
+
+	bool isChanged = true;
+	while (isChanged)
+	{
+		isChanged = false;
+		for (int v = 0; v < ssa->valueCount; v++)
+		{
+			SsaValue* value = &ssa->values[v];
+			uint8_t type = value->type;
+
+			if (value->kind == VALUE_COPY && !isChecked[v]) type = ssa->values[value->source].type;
+			else if (value->kind == VALUE_OP && isComputation(ssa->instructions[value->instruction].op))
+			{
+				type = computedType(ssa, &ssa->instructions[value->instruction]);
+			}
+			else if (value->kind == VALUE_PHI)
+			{
+				SsaBlock* block = &ssa->blocks[value->block];
+				for (int p = 0; p < block->predCount; p++) type |= ssa->values[phiOperand(ssa, v, p)].type;
+			}
+
+			if (type != value->type)
+			{
+				value->type = type;
+				isChanged = true;
+			}
+		}
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, bool, isChecked, ssa->valueCount);
+}
+
+// loads of locals holding a constant load the constant instead, the store may then be dead
+static int propagateCopies(SsaFunction* ssa)
+{
+	int changes = 0;
+	for (int i = 0; i < ssa->instructionCount; i++)
+	{
+		SsaInstruction* instruction = &ssa->instructions[i];
+		if (instruction->op != OP_GET_LOCAL || instruction->isTemp || ssa->blocks[instruction->block].order == -1) continue;
+
+		SsaValue* source = &ssa->values[resolveValue(ssa, input(ssa, instruction, 0))];
+		if (source->kind != VALUE_CONSTANT) continue;
+
+		SsaInstruction* load = &ssa->instructions[source->instruction];
+		instruction->op = load->op;
+		instruction->operand = load->operand;
+		instruction->length = load->length;
+		instruction->offset = -1;
+		instruction->inputCount = 0;
+		changes++;
+	}
+	return changes;
+}
+
+// numbers past the values for constants, equal constants share one
+static int constantNumber(SsaFunction* ssa, SsaInstruction* load)
+{
+	if (load->op != OP_CONSTANT) return ssa->valueCount + UINT8_COUNT + load->op;
+
+	// numbers by their bits, 0 and -0 differ and NaN is itself
+	ValueArray* constants = &ssa->chunk->constants;
+	Value constant = constants->values[load->operand];
+	for (int i = 0; i < load->operand; i++)
+	{
+		Value other = constants->values[i];
+		double a = IS_NUMBER(constant) ? AS_NUMBER(constant) : 0;
+		double b = IS_NUMBER(other) ? AS_NUMBER(other) : 0;
+		bool isSame = IS_NUMBER(constant) ? IS_NUMBER(other) && memcmp(&a, &b, sizeof(double)) == 0 :
+			IS_OBJ(constant) && IS_OBJ(other) && AS_OBJ(other) == AS_OBJ(constant);
+		if (isSame) return ssa->valueCount + i;
+	}
+	return ssa->valueCount + load->operand;
+}
+
+static int valueNumber(Optimizer* optimizer, int value)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	int resolved = resolveValue(ssa, value);
+	SsaValue* definition = &ssa->values[resolved];
+
+	if (definition->kind == VALUE_CONSTANT) return constantNumber(ssa, &ssa->instructions[definition->instruction]);
+	if (definition->kind == VALUE_OP) return optimizer->numbers[resolved];
+	return resolved;
+}
+
+static bool isCommutative(SsaFunction* ssa, SsaInstruction* instruction)
+{
+	if (instruction->op == OP_MULTIPLY || instruction->op == OP_EQUAL) return true;
+	return instruction->op == OP_ADD && inputType(ssa, instruction, 0) == SSA_TYPE_NUMBER && inputType(ssa, instruction, 1) == SSA_TYPE_NUMBER;
+}
+
+static void operandNumbers(Optimizer* optimizer, SsaInstruction* instruction, int* a, int* b)
+{
+	*a = valueNumber(optimizer, input(optimizer->ssa, instruction, 0));
+	*b = instruction->inputCount > 1 ? valueNumber(optimizer, input(optimizer->ssa, instruction, 1)) : -1;
+	if (*b < *a && isCommutative(optimizer->ssa, instruction))
+	{
+		int swap = *a;
+		*a = *b;
+		*b = swap;
+	}
+}
+
+static uint32_t hashOperands(uint8_t op, int a, int b)
+{
+	uint32_t hash = op;
+	hash = hash * 16777619u ^ (uint32_t)a;
+	hash = hash * 16777619u ^ (uint32_t)b;
+	return hash ^ (hash >> 15);
+}
+
+// a run of pure instructions inside one block computing the value of the last, none of them storing a temporary
+// -> what replacing or removing them needs, counts the instructions that are kept, -1 if the run does not qualify
+static int pureRun(SsaFunction* ssa, int block, int start, int end, bool allowTemps)
+{
+	if (start < 0) return -1;
+
+	int count = 0;
+	for (int position = start; position <= end; position++)
+	{
+		if (!isKept(ssa, block, position)) continue;
+		SsaInstruction* instruction = instructionAt(ssa, block, position);
+		if (!isPure(instruction->op)) return -1;
+		if (instruction->temp != -1 && !allowTemps) return -1;
+		count++;
+	}
+	return count;
+}
+
+static void removeRun(SsaFunction* ssa, int block, int start, int end)
+{
+	for (int position = start; position <= end; position++)
+	{
+		if (isKept(ssa, block, position)) instructionAt(ssa, block, position)->isRemoved = true;
+	}
+}
+
+// the run computing a value becomes a load of the temporary holding it
+static int replaceWithLoad(Optimizer* optimizer, int block, int position, int temp)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	SsaInstruction* replaced = instructionAt(ssa, block, position);
+	int value = replaced->value;
+	int start = replaced->start;
+
+	int load = addSsaInstruction(ssa, OP_GET_LOCAL, (uint8_t)temp, replaced->line);
+	removeRun(ssa, block, start, position);
+
+	SsaInstruction* instruction = &ssa->instructions[load];
+	instruction->isTemp = true;
+	instruction->value = value;
+	instruction->start = position;
+	instruction->block = block;
+	ssa->blocks[block].instructions[position] = load;
+	return load;
+}
+
+static int tempOf(Optimizer* optimizer, int writer)
+{
+	SsaInstruction* instruction = &optimizer->ssa->instructions[writer];
+	if (instruction->temp != -1) return instruction->temp;
+
+	int temp = addSsaTemp(optimizer->ssa);
+	if (temp == -1) return -1;
+	instruction->temp = temp;
+	optimizer->tempWriters[temp] = writer;
+	return temp;
+}
+
+// dominator based value numbering, a computation repeated where an equal one has always run loads its result instead
+// -> equal values are found going down the reverse postorder, then each block is replaced from its end so the
+//	largest repeated subexpression goes and the ones inside it with it
+static int eliminateCommonSubexpressions(Optimizer* optimizer)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	int instructionCount = ssa->instructionCount;		// the loads replacing computations are added after these
+	int tableSize = 16;
+	while (tableSize < instructionCount * 2) tableSize *= 2;
+
+	int* buckets = ARENA_ALLOCATE(ssa->arena, int, tableSize);
+	int* chain = ARENA_ALLOCATE(ssa->arena, int, instructionCount);
+	for (int i = 0; i < tableSize; i++) buckets[i] = -1;
+
+	for (int i = 0; i < ssa->rpoCount; i++)
+	{
+		int b = ssa->rpo[i];
+		for (int position = 0; position < ssa->blocks[b].count; position++)
+		{
+			int index = ssa->blocks[b].instructions[position];
+			SsaInstruction* instruction = &ssa->instructions[index];
+			if (!isKept(ssa, b, position) || !isComputation(instruction->op)) continue;
+
+			int a, c;
+			operandNumbers(optimizer, instruction, &a, &c);
+			uint32_t bucket = hashOperands(instruction->op, a, c) & (tableSize - 1);
+
+			for (int other = buckets[bucket]; other != -1; other = chain[other])
+			{
+				SsaInstruction* candidate = &ssa->instructions[other];
+				if (candidate->op != instruction->op || !dominates(ssa, candidate->block, b)) continue;
+
+				int otherA, otherC;
+				operandNumbers(optimizer, candidate, &otherA, &otherC);
+				if (otherA != a || otherC != c) continue;
+
+				optimizer->matches[index] = other;
+				optimizer->numbers[instruction->value] = optimizer->numbers[candidate->value];
+				break;
+			}
+
+			if (optimizer->matches[index] != -1) continue;
+			chain[index] = buckets[bucket];
+			buckets[bucket] = index;
+		}
+	}
+
+	int changes = 0;
+	for (int i = 0; i < ssa->rpoCount; i++)
+	{
+		int b = ssa->rpo[i];
+		for (int position = ssa->blocks[b].count - 1; position >= 0; position--)
+		{
+			int index = ssa->blocks[b].instructions[position];
+			SsaInstruction* instruction = &ssa->instructions[index];
+			if (!isKept(ssa, b, position) || optimizer->matches[index] == -1) continue;
+			if (pureRun(ssa, b, instruction->start, position, false) < CSE_MIN_INSTRUCTIONS) continue;
+
+			int temp = tempOf(optimizer, optimizer->matches[index]);
+			if (temp == -1) break;
+
+			int start = instruction->start;
+			replaceWithLoad(optimizer, b, position, temp);
+			position = start;		// the instructions in between are gone
+			changes++;
+		}
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, chain, instructionCount);
+	ARENA_FREE_ARRAY(ssa->arena, int, buckets, tableSize);
+	return changes;
+}
+
+typedef struct
+{
+	int header;
+	int preheader;
+	bool* isInLoop;
+	int* outsidePreds;		// preds of the header entering the loop
+	int outsideCount;
+} Loop;
+
+// the value every edge into the loop brings in a slot, -1 if they differ
+static int valueOnEntry(SsaFunction* ssa, Loop* loop, int slot)
+{
+	if (slot >= ssa->blocks[loop->header].depth) return -1;
+
+	int value = -1;
+	for (int p = 0; p < loop->outsideCount; p++)
+	{
+		int entering = resolveValue(ssa, ssa->blocks[loop->outsidePreds[p]].exit[slot]);
+		if (value != -1 && entering != value) return -1;
+		value = entering;
+	}
+	return value;
+}
+
+// every instruction in the run computes the same value on every iteration
+static bool isInvariantRun(Optimizer* optimizer, Loop* loop, int block, int start, int end)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	for (int position = start; position <= end; position++)
+	{
+		if (!isKept(ssa, block, position)) continue;
+		SsaInstruction* instruction = instructionAt(ssa, block, position);
+		if (instruction->op != OP_GET_LOCAL) continue;
+
+		// a temporary is loop invariant when it is stored outside the loop, it is stored once
+		if (instruction->isTemp)
+		{
+			if (loop->isInLoop[ssa->instructions[optimizer->tempWriters[instruction->operand]].block]) return false;
+			continue;
+		}
+
+		// the slot has to hold the same value in front of the loop, a store inside could have put an outside value there
+		int value = valueOnEntry(ssa, loop, instruction->operand);
+		if (value == -1 || value != resolveValue(ssa, input(ssa, instruction, 0))) return false;
+	}
+	return true;
+}
+
+// an instruction that can fail keeps its place among the others that can fail or have an effect
+// -> only the loop header runs on every entry before anything else, and only its quiet start can be skipped over
+static bool canFailFirst(SsaFunction* ssa, Loop* loop, int block, int start)
+{
+	if (block != loop->header) return false;
+
+	for (int position = 0; position < start; position++)
+	{
+		if (!isKept(ssa, block, position)) continue;
+		SsaInstruction* instruction = instructionAt(ssa, block, position);
+		if (!isPure(instruction->op) && instruction->op != OP_SET_LOCAL && instruction->op != OP_POP) return false;
+		if (canFail(ssa, instruction)) return false;
+	}
+	return true;
+}
+
+static bool runCanFail(SsaFunction* ssa, int block, int start, int end)
+{
+	for (int position = start; position <= end; position++)
+	{
+		if (isKept(ssa, block, position) && canFail(ssa, instructionAt(ssa, block, position))) return true;
+	}
+	return false;
+}
+
+// the run moves to the end of the preheader and stores its value in a temporary, a load of it takes its place
+static bool hoistRun(Optimizer* optimizer, Loop* loop, int block, int start, int end)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	if (loop->preheader == -1)
+	{
+		loop->preheader = addPreheader(ssa, loop->header);
+		if (loop->preheader == -1) return false;
+	}
+
+	int top = ssa->blocks[block].instructions[end];
+	int temp = tempOf(optimizer, top);
+	if (temp == -1) return false;
+
+	for (int position = start; position <= end; position++)
+	{
+		if (!isKept(ssa, block, position)) continue;
+		int index = ssa->blocks[block].instructions[position];
+		appendToBlock(ssa, loop->preheader, index);
+
+		SsaInstruction* instruction = &ssa->instructions[index];
+		instruction->start = -1;
+		if (instruction->value != -1) ssa->values[instruction->value].block = loop->preheader;
+	}
+	appendToBlock(ssa, loop->preheader, addSsaInstruction(ssa, OP_POP, 0, ssa->instructions[top].line));
+
+	int load = addSsaInstruction(ssa, OP_GET_LOCAL, (uint8_t)temp, ssa->instructions[top].line);
+	SsaInstruction* instruction = &ssa->instructions[load];
+	instruction->isTemp = true;
+	instruction->value = ssa->instructions[top].value;
+	instruction->start = end;
+	instruction->block = block;
+	ssa->blocks[block].instructions[end] = load;
+	return true;
+}
+
+// the runs of one block that can leave the loop, found from the end so each is as long as it gets, moved in their order
+static int hoistFromBlock(Optimizer* optimizer, Loop* loop, int block)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	int* starts = ARENA_ALLOCATE(ssa->arena, int, ssa->blocks[block].count);
+	int* ends = ARENA_ALLOCATE(ssa->arena, int, ssa->blocks[block].count);
+	int runCount = 0;
+
+	for (int position = ssa->blocks[block].count - 1; position >= 0; position--)
+	{
+		if (!isKept(ssa, block, position)) continue;
+		SsaInstruction* instruction = instructionAt(ssa, block, position);
+		if (!isComputation(instruction->op)) continue;
+
+		int start = instruction->start;
+		if (pureRun(ssa, block, start, position, true) < 2) continue;
+		if (!isInvariantRun(optimizer, loop, block, start, position)) continue;
+		if (runCanFail(ssa, block, start, position) && !canFailFirst(ssa, loop, block, start)) continue;
+
+		starts[runCount] = start;
+		ends[runCount++] = position;
+		position = start;
+	}
+
+	int changes = 0;
+	for (int i = runCount - 1; i >= 0; i--)
+	{
+		if (!hoistRun(optimizer, loop, block, starts[i], ends[i])) break;
+		changes++;
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, ends, ssa->blocks[block].count);
+	ARENA_FREE_ARRAY(ssa->arena, int, starts, ssa->blocks[block].count);
+	return changes;
+}
+
+// natural loops from their back edges, outer loops come first in the reverse postorder and are done first
+// -> what an outer loop hoisted is stored before the inner loops, and counts as invariant there
+static int hoistLoopInvariants(Optimizer* optimizer)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	int blockCount = ssa->blockCount * 2;		// room for a preheader in front of every block
+	bool* isInLoop = ARENA_ALLOCATE(ssa->arena, bool, blockCount);
+	int* worklist = ARENA_ALLOCATE(ssa->arena, int, blockCount);
+	int changes = 0;
+
+	for (int i = 0; i < ssa->rpoCount; i++)
+	{
+		int header = ssa->rpo[i];
+		SsaBlock* block = &ssa->blocks[header];
+
+		memset(isInLoop, 0, blockCount);
+		isInLoop[header] = true;
+		int top = 0;
+		bool isHeader = false;
+		for (int p = 0; p < block->predCount; p++)
+		{
+			int pred = block->preds[p];
+			if (!dominates(ssa, header, pred)) continue;
+			isHeader = true;		// a back edge, from the header itself for a loop of one block
+			if (isInLoop[pred]) continue;
+			isInLoop[pred] = true;
+			worklist[top++] = pred;
+		}
+		if (!isHeader) continue;
+
+		while (top > 0)
+		{
+			SsaBlock* inside = &ssa->blocks[worklist[--top]];
+			for (int p = 0; p < inside->predCount; p++)
+			{
+				int pred = inside->preds[p];
+				if (isInLoop[pred]) continue;
+				isInLoop[pred] = true;
+				worklist[top++] = pred;
+			}
+		}
+
+		Loop loop;
+		loop.header = header;
+		loop.preheader = -1;
+		loop.isInLoop = isInLoop;
+		loop.outsidePreds = ARENA_ALLOCATE(ssa->arena, int, block->predCount);
+		loop.outsideCount = 0;
+		for (int p = 0; p < block->predCount; p++)
+		{
+			if (!isInLoop[block->preds[p]]) loop.outsidePreds[loop.outsideCount++] = block->preds[p];
+		}
+
+		int predCount = block->predCount;
+		for (int j = i; j < ssa->rpoCount && loop.outsideCount > 0; j++)
+		{
+			if (isInLoop[ssa->rpo[j]]) changes += hoistFromBlock(optimizer, &loop, ssa->rpo[j]);
+		}
+		ARENA_FREE_ARRAY(ssa->arena, int, loop.outsidePreds, predCount);
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, worklist, blockCount);
+	ARENA_FREE_ARRAY(ssa->arena, bool, isInLoop, blockCount);
+	return changes;
+}
+
+static void markLive(SsaFunction* ssa, int value, int* worklist, int* top)
+{
+	if (ssa->values[value].isLive) return;
+	ssa->values[value].isLive = true;
+	worklist[(*top)++] = value;
+}
+
+// a value is live when a kept instruction other than a store reads it, or a copy or phi of it is live
+static void markLiveValues(SsaFunction* ssa)
+{
+	int* worklist = ARENA_ALLOCATE(ssa->arena, int, ssa->valueCount);
+	int top = 0;
+	for (int v = 0; v < ssa->valueCount; v++) ssa->values[v].isLive = false;
+
+	for (int b = 0; b < ssa->blockCount; b++)
+	{
+		SsaBlock* block = &ssa->blocks[b];
+		if (block->order == -1) continue;
+
+		for (int position = 0; position < block->count; position++)
+		{
+			if (!isKept(ssa, b, position)) continue;
+			SsaInstruction* instruction = instructionAt(ssa, b, position);
+			if (instruction->op == OP_SET_LOCAL) continue;
+			for (int i = 0; i < instruction->inputCount; i++) markLive(ssa, input(ssa, instruction, i), worklist, &top);
+		}
+	}
+
+	while (top > 0)
+	{
+		int live = worklist[--top];
+		SsaValue* value = &ssa->values[live];
+		if (value->kind == VALUE_COPY) markLive(ssa, value->source, worklist, &top);
+
+		// a phi found trivial copies the value its operands resolve to, the stores of every one of them are still needed
+		if (value->slot == -1) continue;
+
+		for (int p = 0; p < ssa->blocks[value->block].predCount; p++) markLive(ssa, phiOperand(ssa, live, p), worklist, &top);
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, worklist, ssa->valueCount);
+}
+
+// stores nothing reads, and expression statements that compute a value without failing only to pop it
+static int eliminateDeadCode(SsaFunction* ssa)
+{
+	int changes = 0;
+	for (int round = 0; round < DCE_MAX_ROUNDS; round++)
+	{
+		int roundChanges = 0;
+		markLiveValues(ssa);
+
+		for (int b = 0; b < ssa->blockCount; b++)
+		{
+			SsaBlock* block = &ssa->blocks[b];
+			if (block->order == -1) continue;
+
+			for (int position = 0; position < block->count; position++)
+			{
+				if (!isKept(ssa, b, position)) continue;
+				SsaInstruction* instruction = instructionAt(ssa, b, position);
+				if (instruction->op != OP_SET_LOCAL || instruction->isTemp || ssa->values[instruction->value].isLive) continue;
+
+				instruction->isRemoved = true;
+				roundChanges++;
+			}
+
+			for (int position = 0; position < block->count; position++)
+			{
+				if (!isKept(ssa, b, position)) continue;
+				SsaInstruction* instruction = instructionAt(ssa, b, position);
+				if (!isPure(instruction->op)) continue;
+
+				int pop = position + 1;
+				while (pop < block->count && !isKept(ssa, b, pop)) pop++;
+				if (pop == block->count || instructionAt(ssa, b, pop)->op != OP_POP) continue;
+
+				if (pureRun(ssa, b, instruction->start, position, false) < 1) continue;
+				if (runCanFail(ssa, b, instruction->start, position)) continue;
+
+				removeRun(ssa, b, instruction->start, pop);
+				roundChanges++;
+			}
+		}
+
+		changes += roundChanges;
+		if (roundChanges == 0) break;
+	}
+	return changes;
+}
+
+// temporaries whose loads were all replaced or removed are not stored, the others are numbered again from 0
+static void dropUnusedTemps(Optimizer* optimizer)
+{
+	SsaFunction* ssa = optimizer->ssa;
+	int renumbered[UINT8_COUNT];
+	bool isUsed[UINT8_COUNT];
+	memset(isUsed, 0, sizeof(isUsed));
+
+	for (int b = 0; b < ssa->blockCount; b++)
+	{
+		for (int position = 0; position < ssa->blocks[b].count; position++)
+		{
+			SsaInstruction* instruction = instructionAt(ssa, b, position);
+			if (isKept(ssa, b, position) && instruction->isTemp) isUsed[instruction->operand] = true;
+		}
+	}
+
+	int count = 0;
+	for (int t = 0; t < ssa->tempCount; t++)
+	{
+		SsaInstruction* writer = &ssa->instructions[optimizer->tempWriters[t]];
+		if (!isUsed[t] || writer->isRemoved)
+		{
+			writer->temp = -1;
+			continue;
+		}
+		renumbered[t] = count;
+		writer->temp = count++;
+	}
+
+	for (int i = 0; i < ssa->instructionCount; i++)
+	{
+		SsaInstruction* instruction = &ssa->instructions[i];
+		if (instruction->isTemp && !instruction->isRemoved && instruction->block != -1) instruction->operand = (uint8_t)renumbered[instruction->operand];
+	}
+	ssa->tempCount = count;
+}
+
+bool optimizeFunction(ObjFunction* function, Arena* arena)
+{
+	SsaFunction ssa;
+	if (!buildSsa(&ssa, function, arena))
+	{
+		freeSsa(&ssa);
+		return false;
+	}
+
+	Optimizer optimizer;
+	optimizer.ssa = &ssa;
+	optimizer.numbers = ARENA_ALLOCATE(arena, int, ssa.valueCount);
+	optimizer.matches = ARENA_ALLOCATE(arena, int, ssa.instructionCount);
+	int valueCount = ssa.valueCount;
+	int instructionCount = ssa.instructionCount;
+	for (int v = 0; v < valueCount; v++) optimizer.numbers[v] = v;
+	for (int i = 0; i < instructionCount; i++) optimizer.matches[i] = -1;
+
+	inferTypes(&ssa);
+	int changes = propagateCopies(&ssa);
+	changes += eliminateCommonSubexpressions(&optimizer);
+	changes += hoistLoopInvariants(&optimizer);
+	changes += eliminateDeadCode(&ssa);
+	dropUnusedTemps(&optimizer);
+
+	bool isRewritten = changes > 0 && emitSsa(&ssa);
+
+	ARENA_FREE_ARRAY(arena, int, optimizer.matches, instructionCount);
+	ARENA_FREE_ARRAY(arena, int, optimizer.numbers, valueCount);
+	freeSsa(&ssa);
+	return isRewritten;
+}
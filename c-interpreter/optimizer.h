@@ -0,0 +1,18 @@
+// optimizing middle end, run by the compiler after the peephole pass when the interpreter is started with -O
+// -> each function is lifted into SSA form (ssa.h) and goes through copy propagation, common subexpression
+//	elimination, loop invariant code motion and dead code elimination before it is written back as bytecode
+// -> values that have to outlive the instruction computing them, a subexpression used again or one hoisted out of
+//	a loop, are kept in temporary slots the function gets on top of its arguments
+// -> off by default, the passes cost more than they save for the REPL and short scripts
+
+#ifndef optimizer_h
+#define optimizer_h
+
+#include "common.h"
+#include "object.h"
+#include "arena.h"
+
+// the graph comes from the compile arena and is given back before returning, true if the chunk was rewritten
+bool optimizeFunction(ObjFunction* function, Arena* arena);
+
+#endif
@@ -0,0 +1,255 @@
+#include <string.h>
+
+#include "peephole.h"
+#include "object.h"
+
+// jumps followed through other jumps, a guard against chains that go round in a circle
+#define THREAD_MAX_STEPS 8
+
+typedef struct
+{
+	int offset;			// where the compiler put it
+	int newOffset;		// where it goes, for removed instructions that of the next instruction kept
+	int length;			// opcode and operands
+	uint8_t op;
+	int target;			// instruction a jump goes to, -1 for every other instruction
+	bool isLive;		// reachable and not rewritten away
+	bool isTarget;		// a live jump goes to it, code cannot be merged across it
+} Instruction;
+
+// the load that reads back what the store wrote
+static uint8_t loadFor(uint8_t store)
+{
+	switch (store)
+	{
+	case OP_SET_LOCAL: return OP_GET_LOCAL;
+	case OP_SET_GLOBAL: return OP_GET_GLOBAL;
+	case OP_SET_UPVALUE: return OP_GET_UPVALUE;
+	default: return OP_RETURN;		// not a store, no load matches
+	}
+}
+
+// the compiler does not share constants, two global names are the same when their interned strings are
+static bool sameVariable(Chunk* chunk, Instruction* store, Instruction* load)
+{
+	uint8_t a = chunk->code[store->offset + 1];
+	uint8_t b = chunk->code[load->offset + 1];
+	if (store->op != OP_SET_GLOBAL) return a == b;
+	return AS_OBJ(chunk->constants.values[a]) == AS_OBJ(chunk->constants.values[b]);
+}
+
+// first instruction kept at or after index, count if there is none
+static int nextLive(Instruction* instructions, int count, int index)
+{
+	while (index < count && !instructions[index].isLive) index++;
+	return index;
+}
+
+// offsets only shrink, a jump that spans no more than 16 bits of the compiled code fits in the rewritten one
+static bool canJump(Instruction* instructions, int from, int to)
+{
+	Instruction* jump = &instructions[from];
+	int end = jump->offset + jump->length;
+	int distance = to > from ? instructions[to].offset - end : end - instructions[to].offset;
+
+	if (distance > UINT16_MAX) return false;
+	if (jump->op == OP_JUMP || jump->op == OP_LOOP) return true;		// written as whichever of the two fits the direction
+	return to > from;
+}
+
+// follow a jump through jumps it would take right after landing, conditional jumps see the same condition again
+static void threadJump(Instruction* instructions, int index)
+{
+	Instruction* jump = &instructions[index];
+	bool isConditional = jump->op == OP_JUMP_IF_FALSE;
+	if (!isConditional && jump->op != OP_JUMP && jump->op != OP_LOOP) return;
+
+	int target = jump->target;
+	for (int steps = 0; steps < THREAD_MAX_STEPS; steps++)
+	{
+		Instruction* next = &instructions[target];
+		bool isTaken = next->op == OP_JUMP || next->op == OP_LOOP || (isConditional && next->op == OP_JUMP_IF_FALSE);
+		if (!isTaken || next->target == target) break;
+
+		target = next->target;
+		if (canJump(instructions, index, target)) jump->target = target;
+	}
+}
+
+static void markReachable(Instruction* instructions, int count, int* worklist)
+{
+	int top = 0;
+	instructions[0].isLive = true;
+	worklist[top++] = 0;
+
+	while (top > 0)
+	{
+		int index = worklist[--top];
+		Instruction* instruction = &instructions[index];
+
+		int successors[2];
+		int successorCount = 0;
+		if (instruction->target != -1) successors[successorCount++] = instruction->target;
+		if (fallsThrough(instruction->op) && index + 1 < count) successors[successorCount++] = index + 1;
+
+		for (int i = 0; i < successorCount; i++)
+		{
+			if (instructions[successors[i]].isLive) continue;
+			instructions[successors[i]].isLive = true;
+			worklist[top++] = successors[i];
+		}
+	}
+}
+
+// SET x, POP, GET x leaves the value on the stack where SET x alone does
+static void mergeStoreLoad(Chunk* chunk, Instruction* instructions, int count, int index)
+{
+	Instruction* store = &instructions[index];
+	uint8_t load = loadFor(store->op);
+	if (load == OP_RETURN) return;
+
+	int pop = nextLive(instructions, count, index + 1);
+	if (pop == count || instructions[pop].op != OP_POP || instructions[pop].isTarget) return;
+
+	int get = nextLive(instructions, count, pop + 1);
+	if (get == count || instructions[get].op != load || instructions[get].isTarget) return;
+	if (!sameVariable(chunk, store, &instructions[get])) return;
+
+	instructions[pop].isLive = false;
+	instructions[get].isLive = false;
+}
+
+// OP_NOT in front of a conditional branch, the branch tests the other way round instead
+// -> OP_JUMP_IF_FALSE leaves its condition on the stack, only when both ways pop it straight away is it never seen
+static void mergeNot(Instruction* instructions, int count, int index)
+{
+	int branchIndex = nextLive(instructions, count, index + 1);
+	if (branchIndex == count || instructions[branchIndex].isTarget) return;
+
+	Instruction* branch = &instructions[branchIndex];
+	switch (branch->op)
+	{
+	case OP_LOOP_IF_FALSE: branch->op = OP_LOOP_IF_TRUE; break;
+	case OP_LOOP_IF_TRUE: branch->op = OP_LOOP_IF_FALSE; break;
+
+	case OP_JUMP_IF_FALSE:
+	{
+		int fallThrough = nextLive(instructions, count, branchIndex + 1);
+		int target = nextLive(instructions, count, branch->target);
+		if (fallThrough == count || instructions[fallThrough].op != OP_POP) return;
+		if (target == count || instructions[target].op != OP_POP) return;
+
+		branch->op = OP_JUMP_IF_TRUE;
+		break;
+	}
+
+	default:
+		return;
+	}
+
+	instructions[index].isLive = false;		// jumps to the OP_NOT land on the branch, with the same value on the stack
+}
+
+// a jump to the instruction after it does nothing, none of these pop
+static void dropEmptyJumps(Instruction* instructions, int count)
+{
+	int next = count;		// first instruction kept after the one looked at
+	for (int i = count - 1; i >= 0; i--)
+	{
+		Instruction* instruction = &instructions[i];
+		if (!instruction->isLive) continue;
+
+		bool isEmpty = (instruction->op == OP_JUMP || instruction->op == OP_JUMP_IF_FALSE || instruction->op == OP_JUMP_IF_TRUE) &&
+			instruction->target > i && nextLive(instructions, count, instruction->target) == next;
+		if (isEmpty) instruction->isLive = false;
+		else next = i;
+	}
+}
+
+static void writeJump(Chunk* chunk, Instruction* instructions, Instruction* jump)
+{
+	int end = jump->newOffset + jump->length;
+	int to = instructions[jump->target].newOffset;		// removed targets already point at the next instruction kept
+
+	// jumps threaded into a loop go back
+	if (jump->op == OP_JUMP || jump->op == OP_LOOP) jump->op = to >= end ? OP_JUMP : OP_LOOP;
+
+	int distance = isBackward(jump->op) ? end - to : to - end;
+	chunk->code[jump->newOffset] = jump->op;
+	chunk->code[end - 2] = (distance >> 8) & 0xff;
+	chunk->code[end - 1] = distance & 0xff;
+}
+
+void optimizeChunk(Chunk* chunk, Arena* arena)
+{
+	int codeCount = chunk->count;
+	int count = 0;
+	for (int offset = 0; offset < codeCount; offset += instructionLength(chunk, offset)) count++;
+
+	Instruction* instructions = ARENA_ALLOCATE(arena, Instruction, count);
+	int* indexOf = ARENA_ALLOCATE(arena, int, codeCount);		// instruction starting at each offset, reused as the worklist
+
+	for (int i = 0, offset = 0; i < count; i++)
+	{
+		Instruction* instruction = &instructions[i];
+		instruction->offset = offset;
+		instruction->length = instructionLength(chunk, offset);
+		instruction->op = chunk->code[offset];
+		instruction->isLive = false;
+		instruction->isTarget = false;
+		indexOf[offset] = i;
+		offset += instruction->length;
+	}
+
+	// every jump lands on an instruction, endCompiler emits its return after all jumps are patched
+	for (int i = 0; i < count; i++)
+	{
+		Instruction* instruction = &instructions[i];
+		instruction->target = -1;
+		if (!isJump(instruction->op)) continue;
+
+		instruction->target = indexOf[jumpTarget(chunk, instruction->offset)];
+	}
+
+	for (int i = 0; i < count; i++) threadJump(instructions, i);
+
+	markReachable(instructions, count, indexOf);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (instructions[i].isLive && instructions[i].target != -1) instructions[instructions[i].target].isTarget = true;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!instructions[i].isLive) continue;
+		if (instructions[i].op == OP_NOT) mergeNot(instructions, count, i);
+		else mergeStoreLoad(chunk, instructions, count, i);
+	}
+
+	dropEmptyJumps(instructions, count);
+
+	// every instruction kept moves down or stays, it is never written over before it is read
+	int offset = 0;
+	for (int i = 0; i < count; i++)
+	{
+		instructions[i].newOffset = offset;
+		if (instructions[i].isLive) offset += instructions[i].length;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		Instruction* instruction = &instructions[i];
+		if (!instruction->isLive) continue;
+
+		memmove(&chunk->code[instruction->newOffset], &chunk->code[instruction->offset], instruction->length);
+		memmove(&chunk->lines[instruction->newOffset], &chunk->lines[instruction->offset], sizeof(int) * instruction->length);
+		chunk->code[instruction->newOffset] = instruction->op;
+		if (instruction->target != -1) writeJump(chunk, instructions, instruction);
+	}
+
+	chunk->count = offset;
+
+	ARENA_FREE_ARRAY(arena, int, indexOf, codeCount);
+	ARENA_FREE_ARRAY(arena, Instruction, instructions, count);
+}
@@ -0,0 +1,18 @@
+// peephole pass, run by the compiler over every chunk it finishes
+// -> the single pass compiler cannot look ahead, so it leaves sequences a second look can shorten:
+//	a store followed by POP and a load of the same variable, jumps landing on other jumps, OP_NOT in front of a
+//	conditional jump, and code after OP_RETURN or a jump that nothing jumps to
+// -> the chunk is decoded into instructions, rewritten, and written back in place with its jump offsets and lines
+//	recomputed, code only ever gets shorter so every jump that fitted in 16 bits still fits
+
+#ifndef peephole_h
+#define peephole_h
+
+#include "common.h"
+#include "chunk.h"
+#include "arena.h"
+
+// the instruction table comes from the compile arena and is given back before returning
+void optimizeChunk(Chunk* chunk, Arena* arena);
+
+#endif
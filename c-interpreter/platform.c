@@ -0,0 +1,310 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L		// clock_gettime and sched_yield are POSIX, not C99
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE				// MAP_ANONYMOUS
+#endif
+#include <malloc.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+
+/* threads */
+
+// the thread entry point has a different signature on each platform, start every thread through this
+typedef struct
+{
+	ThreadFn function;
+	void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI runThread(LPVOID param)
+#else
+static void* runThread(void* param)
+#endif
+{
+	ThreadStart start = *(ThreadStart*)param;
+	free(param);
+	start.function(start.arg);
+	return 0;
+}
+
+bool startThread(Thread* thread, ThreadFn function, void* arg)
+{
+	ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+	if (start == NULL) return false;
+	start->function = function;
+	start->arg = arg;
+
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, runThread, start, 0, NULL);
+	if (*thread != NULL) return true;
+#else
+	if (pthread_create(thread, NULL, runThread, start) == 0) return true;
+#endif
+
+	free(start);
+	return false;
+}
+
+void joinThread(Thread thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
+
+void yieldThread()
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+
+/* locks */
+
+void initMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void freeMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void lockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void unlockMutex(Mutex* mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void initCondition(Condition* condition)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
+
+void freeCondition(Condition* condition)
+{
+#ifdef _WIN32
+	(void)condition;		// windows condition variables need no cleanup
+#else
+	pthread_cond_destroy(condition);
+#endif
+}
+
+void waitCondition(Condition* condition, Mutex* mutex)
+{
+#ifdef _WIN32
+	SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void wakeAll(Condition* condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
+
+
+/* atomics */
+
+bool atomicTestAndSet(volatile bool* flag)
+{
+#ifdef _WIN32
+	return _InterlockedExchange8((volatile char*)flag, 1) != 0;
+#else
+	return __atomic_exchange_n(flag, true, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void atomicClear(volatile bool* flag)
+{
+#ifdef _WIN32
+	_InterlockedExchange8((volatile char*)flag, 0);
+#else
+	__atomic_store_n(flag, false, __ATOMIC_SEQ_CST);
+#endif
+}
+
+long atomicIncrement(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedIncrement(value);
+#else
+	return __atomic_add_fetch(value, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+long atomicDecrement(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedDecrement(value);
+#else
+	return __atomic_sub_fetch(value, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+long atomicLoad(volatile long* value)
+{
+#ifdef _WIN32
+	return _InterlockedCompareExchange(value, 0, 0);		// exchanges only if it is already 0, always returns the value
+#else
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void atomicStore(volatile long* value, long newValue)
+{
+#ifdef _WIN32
+	_InterlockedExchange(value, newValue);
+#else
+	__atomic_store_n(value, newValue, __ATOMIC_SEQ_CST);
+#endif
+}
+
+uint64_t atomicLoadBits(volatile uint64_t* bits)
+{
+#ifdef _WIN32
+	return (uint64_t)_InterlockedCompareExchange64((volatile __int64*)bits, 0, 0);
+#else
+	return __atomic_load_n(bits, __ATOMIC_SEQ_CST);
+#endif
+}
+
+uint64_t atomicOrBits(volatile uint64_t* bits, uint64_t mask)
+{
+#ifdef _WIN32
+	return (uint64_t)_InterlockedOr64((volatile __int64*)bits, (__int64)mask);
+#else
+	return __atomic_fetch_or(bits, mask, __ATOMIC_SEQ_CST);
+#endif
+}
+
+
+/* pages */
+
+void* allocatePages(size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);		// 64KB aligned already
+#else
+	// map twice the size and unmap what lies outside the aligned block
+	uint8_t* mapped = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED) return NULL;
+
+	uint8_t* aligned = (uint8_t*)(((uintptr_t)mapped + size - 1) & ~(uintptr_t)(size - 1));
+	if (aligned > mapped) munmap(mapped, aligned - mapped);
+	if (aligned + size < mapped + size * 2) munmap(aligned + size, mapped + size * 2 - (aligned + size));
+	return aligned;
+#endif
+}
+
+void freePages(void* pages, size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(pages, 0, MEM_RELEASE);
+#else
+	munmap(pages, size);
+#endif
+}
+
+
+void trimMallocHeap()
+{
+#if defined(_WIN32)
+	HeapCompact(GetProcessHeap(), 0);
+#elif defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+}
+
+
+/* time */
+
+double wallClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+
+/* signals */
+
+void onUserSignal(void (*handler)(int signal))
+{
+#ifdef _WIN32
+	signal(SIGBREAK, handler);
+#else
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handler;
+	action.sa_flags = SA_RESTART;			// reads of the repl go on after the signal
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR2, &action, NULL);
+#endif
+}
+
+int processId()
+{
+#ifdef _WIN32
+	return (int)GetCurrentProcessId();
+#else
+	return (int)getpid();
+#endif
+}
@@ -0,0 +1,72 @@
+// operating system services the collector needs that standard C99 does not have
+// threads, locks and atomic operations for parallel marking, a wall clock for pause times, and a signal for heap snapshots
+
+#ifndef platform_h
+#define platform_h
+
+#include "common.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+typedef void (*ThreadFn)(void* arg);
+
+// every thread has its own copy of a variable declared THREAD_LOCAL
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// threads, startThread returns false if the thread could not be created
+bool startThread(Thread* thread, ThreadFn function, void* arg);
+void joinThread(Thread thread);
+void yieldThread();
+
+void initMutex(Mutex* mutex);
+void freeMutex(Mutex* mutex);
+void lockMutex(Mutex* mutex);
+void unlockMutex(Mutex* mutex);
+
+// waitCondition releases the mutex while waiting, wakeAll wakes every waiting thread
+void initCondition(Condition* condition);
+void freeCondition(Condition* condition);
+void waitCondition(Condition* condition, Mutex* mutex);
+void wakeAll(Condition* condition);
+
+// atomic operations, all of them are full memory barriers
+bool atomicTestAndSet(volatile bool* flag);		// sets the flag, returns the old value
+void atomicClear(volatile bool* flag);
+long atomicIncrement(volatile long* value);		// returns the new value
+long atomicDecrement(volatile long* value);
+long atomicLoad(volatile long* value);
+void atomicStore(volatile long* value, long newValue);
+uint64_t atomicLoadBits(volatile uint64_t* bits);
+uint64_t atomicOrBits(volatile uint64_t* bits, uint64_t mask);		// returns the old bits
+
+// memory straight from the operating system, aligned to its own size
+// size is 64KB, the allocation granularity on windows, freed memory is returned to the operating system right away
+void* allocatePages(size_t size);
+void freePages(void* pages, size_t size);
+
+// asks the C library to give the free memory inside its heap back to the operating system, free() usually keeps it
+void trimMallocHeap();
+
+// seconds since an arbitrary point, unlike clock() it does not add up the time of every thread
+double wallClock();
+
+// the signal a user sends to ask a running program for something, SIGUSR2, or ctrl+break in a windows console
+// the handler interrupts whatever runs, it may only set a volatile sig_atomic_t flag
+void onUserSignal(void (*handler)(int signal));
+int processId();
+
+#endif
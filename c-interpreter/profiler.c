@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcstats.h"
+#include "memory.h"
+#include "profiler.h"
+#include "virtualm.h"
+
+void initProfiler(Profiler* profiler)
+{
+	profiler->interval = 0;
+	profiler->countdown = 0;
+	profiler->random = 2463534242u;
+	profiler->samples = 0;
+	profiler->siteCount = 0;
+	profiler->siteCapacity = 0;
+	profiler->sites = NULL;
+	profiler->objectCount = 0;
+	profiler->objectCapacity = 0;
+	profiler->objects = NULL;
+}
+
+void freeProfiler(Profiler* profiler)
+{
+	free(profiler->sites);
+	free(profiler->objects);
+	initProfiler(profiler);
+}
+
+// xorshift, the C library rand may be used by the program embedding the vm
+static uint32_t nextRandom(Profiler* profiler)
+{
+	uint32_t x = profiler->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	profiler->random = x;
+	return x;
+}
+
+// anywhere from 1 to twice the interval, the interval on average
+static void scheduleSample(Profiler* profiler)
+{
+	profiler->countdown += (long)(nextRandom(profiler) % (profiler->interval * 2)) + 1;
+}
+
+void startProfiler(Profiler* profiler, size_t interval)
+{
+	profiler->interval = interval;
+	profiler->countdown = 0;
+	if (interval != 0) scheduleSample(profiler);
+}
+
+
+/*		allocation sites		*/
+
+static uint32_t siteHash(uint32_t nameHash, int line)
+{
+	return nameHash ^ ((uint32_t)line * 2654435761u);
+}
+
+static AllocationSite* findSite(AllocationSite* sites, int capacity, const char* name, uint32_t nameHash, int line)
+{
+	uint32_t index = siteHash(nameHash, line) & (capacity - 1);
+	for (;;)
+	{
+		AllocationSite* site = &sites[index];
+		if (site->samples == 0) return site;			// an empty slot, every site in use has a sample
+		if (site->nameHash == nameHash && site->line == line && strcmp(site->name, name) == 0) return site;
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+// NULL if the table cannot grow
+static AllocationSite* siteFor(Profiler* profiler, const char* name, uint32_t nameHash, int line)
+{
+	if (profiler->siteCount + 1 > profiler->siteCapacity / 2)
+	{
+		int capacity = profiler->siteCapacity < 64 ? 64 : profiler->siteCapacity * 2;
+		AllocationSite* sites = (AllocationSite*)calloc(capacity, sizeof(AllocationSite));
+		if (sites == NULL) return NULL;
+
+		// the sampled objects refer to their site by index, they move with it
+		int* moved = (int*)malloc(sizeof(int) * (profiler->siteCapacity + 1));
+		if (moved == NULL)
+		{
+			free(sites);
+			return NULL;
+		}
+
+		for (int i = 0; i < profiler->siteCapacity; i++)
+		{
+			AllocationSite* old = &profiler->sites[i];
+			if (old->samples == 0) continue;
+			AllocationSite* site = findSite(sites, capacity, old->name, old->nameHash, old->line);
+			*site = *old;
+			moved[i] = (int)(site - sites);
+		}
+		for (int i = 0; i < profiler->objectCount; i++)
+		{
+			profiler->objects[i].site = moved[profiler->objects[i].site];
+		}
+
+		free(moved);
+		free(profiler->sites);
+		profiler->sites = sites;
+		profiler->siteCapacity = capacity;
+	}
+
+	AllocationSite* site = findSite(profiler->sites, profiler->siteCapacity, name, nameHash, line);
+	if (site->samples == 0)
+	{
+		strcpy(site->name, name);
+		site->nameHash = nameHash;
+		site->line = line;
+		profiler->siteCount++;
+	}
+	return site;
+}
+
+// follows the object until its first collection, it is just not followed if there is no room
+static void followObject(Profiler* profiler, Obj* object, int site)
+{
+	if (profiler->objectCapacity < profiler->objectCount + 1)
+	{
+		int capacity = GROW_CAPACITY(profiler->objectCapacity);
+		SampledObject* objects = (SampledObject*)realloc(profiler->objects, sizeof(SampledObject) * capacity);
+		if (objects == NULL) return;
+
+		profiler->objects = objects;
+		profiler->objectCapacity = capacity;
+	}
+
+	SampledObject* sampled = &profiler->objects[profiler->objectCount++];
+	sampled->object = object;
+	sampled->site = site;
+	sampled->isBornMarked = vm.isMarking;
+}
+
+void sampleAllocation(Obj* object, int kind, size_t size)
+{
+	Profiler* profiler = &vm.profiler;
+	scheduleSample(profiler);
+	if (profiler->countdown <= 0) profiler->countdown = 1;		// one sample for an allocation much larger than the interval
+
+	// the running function and line, natives count for the line that called them
+	char name[SITE_NAME_MAX];
+	uint32_t nameHash = 0;
+	int line = 0;
+
+	if (vm.frameCount == 0)
+	{
+		strcpy(name, "compiler");
+	}
+	else
+	{
+		CallFrame* frame = &vm.frames[vm.frameCount - 1];
+		ObjFunction* function = frame->closure->function;
+		size_t instruction = frame->ip > function->chunk.code ? frame->ip - function->chunk.code - 1 : 0;		// ip is past the instruction
+		line = function->chunk.lines[instruction];
+
+		if (function->name == NULL)
+		{
+			strcpy(name, "script");
+		}
+		else
+		{
+			int length = function->name->length < SITE_NAME_MAX - 1 ? function->name->length : SITE_NAME_MAX - 1;
+			memcpy(name, function->name->chars, length);
+			name[length] = '\0';
+			nameHash = function->name->hash;
+		}
+	}
+
+	AllocationSite* site = siteFor(profiler, name, nameHash, line);
+	if (site == NULL) return;
+
+	profiler->samples++;
+	site->samples++;
+	site->bytes += size;
+	site->kinds[kind]++;
+
+	if (object != NULL) followObject(profiler, object, (int)(site - profiler->sites));
+}
+
+void profileSurvivors()
+{
+	Profiler* profiler = &vm.profiler;
+	int kept = 0;
+
+	for (int i = 0; i < profiler->objectCount; i++)
+	{
+		SampledObject* sampled = &profiler->objects[i];
+		// this cycle tells nothing about it, wait for the next one
+		// one born marked is promoted by the cycle, and minor collections count old objects as marked
+		if (sampled->isBornMarked || (vm.isMinorGC && sampled->object->isOld))
+		{
+			if (!vm.isMinorGC) sampled->isBornMarked = false;
+			profiler->objects[kept++] = *sampled;
+			continue;
+		}
+
+		if (isWhite(sampled->object)) profiler->sites[sampled->site].died++;
+		else profiler->sites[sampled->site].survived++;
+	}
+
+	profiler->objectCount = kept;
+}
+
+
+/*		report		*/
+
+static int compareSamples(const void* a, const void* b)
+{
+	long difference = (*(AllocationSite**)b)->samples - (*(AllocationSite**)a)->samples;
+	return difference > 0 ? 1 : difference < 0 ? -1 : 0;
+}
+
+static const char* kindName(int kind)
+{
+	return kind == SAMPLE_ARRAY ? "array" : objTypeName((ObjType)kind);
+}
+
+void printProfile(Profiler* profiler, FILE* file)
+{
+	fprintf(file, "== allocation profile, a sample about every %zu bytes ==\n", profiler->interval);
+	if (profiler->samples == 0)
+	{
+		fprintf(file, "no samples\n");
+		return;
+	}
+
+	AllocationSite** sorted = (AllocationSite**)malloc(sizeof(AllocationSite*) * profiler->siteCount);
+	if (sorted == NULL) return;
+
+	int count = 0;
+	for (int i = 0; i < profiler->siteCapacity; i++)
+	{
+		if (profiler->sites[i].samples != 0) sorted[count++] = &profiler->sites[i];
+	}
+	qsort(sorted, count, sizeof(AllocationSite*), compareSamples);
+
+	// every sample stands for about interval bytes allocated
+	fprintf(file, "%12s %6s %8s %9s  %-24s %s\n", "~bytes", "share", "samples", "survived", "kinds", "site");
+	for (int i = 0; i < count && i < 20; i++)
+	{
+		AllocationSite* site = sorted[i];
+
+		// the two most sampled kinds
+		int first = -1;
+		int second = -1;
+		for (int kind = 0; kind < SAMPLE_KINDS; kind++)
+		{
+			if (site->kinds[kind] == 0) continue;
+			if (first == -1 || site->kinds[kind] > site->kinds[first])
+			{
+				second = first;
+				first = kind;
+			}
+			else if (second == -1 || site->kinds[kind] > site->kinds[second])
+			{
+				second = kind;
+			}
+		}
+
+		char kinds[64];
+		if (second == -1) snprintf(kinds, sizeof(kinds), "%s", kindName(first));
+		else snprintf(kinds, sizeof(kinds), "%s %ld%%, %s", kindName(first), site->kinds[first] * 100 / site->samples, kindName(second));
+
+		char survived[16];
+		long followed = site->survived + site->died;
+		if (followed == 0) snprintf(survived, sizeof(survived), "-");
+		else snprintf(survived, sizeof(survived), "%.1f%%", 100.0 * site->survived / followed);
+
+		fprintf(file, "%12.0f %5.1f%% %8ld %9s  %-24s %s:%d\n",
+			(double)site->samples * profiler->interval, 100.0 * site->samples / profiler->samples,
+			site->samples, survived, kinds, site->name, site->line);
+	}
+
+	if (count > 20) fprintf(file, "... %d more sites\n", count - 20);
+	fprintf(file, "survived: sampled objects still reachable at their first collection, arrays are not followed\n");
+	free(sorted);
+}
@@ -0,0 +1,74 @@
+// sampling allocation profiler, off unless cfei --alloc-profile or startProfiler turns it on
+// about once every interval bytes, an allocation is charged to the function and line the program is running
+// -> sampled objects are followed to their first collection, a site whose objects survive it makes long lived data,
+//	one whose objects die makes the garbage that keeps the collector busy
+// -> the profiler's own tables are malloc'd and not counted in vm.bytesAllocated, like the gray stack
+
+#ifndef profiler_h
+#define profiler_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+// kinds of sampled allocations, an object type or an array from reallocate
+#define SAMPLE_ARRAY OBJ_TYPE_COUNT
+#define SAMPLE_KINDS (OBJ_TYPE_COUNT + 1)
+
+#define SITE_NAME_MAX 48
+
+typedef struct
+{
+	char name[SITE_NAME_MAX];		// the function, "script" for the top level and "compiler" while compiling
+	uint32_t nameHash;
+	int line;
+	long samples;
+	size_t bytes;					// sizes of the sampled allocations
+	long kinds[SAMPLE_KINDS];
+	long survived;					// sampled objects still reachable at their first collection
+	long died;						// sampled objects freed by their first collection
+} AllocationSite;
+
+typedef struct
+{
+	Obj* object;
+	int site;
+	bool isBornMarked;				// allocated during incremental marking, it survives that cycle whatever happens
+} SampledObject;
+
+typedef struct
+{
+	size_t interval;				// mean bytes between two samples, 0 when the profiler is off
+	long countdown;					// bytes left until the next sample
+	uint32_t random;				// the distance between samples varies, so allocation patterns cannot line up with it
+	long samples;
+
+	int siteCount;
+	int siteCapacity;
+	AllocationSite* sites;			// open addressing on the name hash and line
+
+	int objectCount;
+	int objectCapacity;
+	SampledObject* objects;			// sampled objects that have not met a collection yet
+} Profiler;
+
+void initProfiler(Profiler* profiler);
+void freeProfiler(Profiler* profiler);
+void startProfiler(Profiler* profiler, size_t interval);
+
+// called for every allocation, the test is all it costs while the profiler is off
+// kind is the object type, or SAMPLE_ARRAY with a NULL object for arrays
+#define PROFILE_ALLOCATION(object, kind, size)	\
+	do {	\
+		if (vm.profiler.interval != 0 && (vm.profiler.countdown -= (long)(size)) <= 0) sampleAllocation(object, kind, size);	\
+	} while (false)
+
+void sampleAllocation(Obj* object, int kind, size_t size);
+
+// after the marking of every collection, before the sweep, while unreached objects can still be told apart
+void profileSurvivors();
+
+void printProfile(Profiler* profiler, FILE* file);
+
+#endif
@@ -229,6 +229,7 @@ static TokenType identifierType()
 			switch (scanner.start[1])
 			{
 			case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
+			case 'n': return checkKeyword(2, 0, "", TOKEN_IN);
 			case 's': return checkKeyword(2, 0, "", TOKEN_EQUAL_EQUAL);
 			}
 		}
@@ -356,7 +357,7 @@ Token scanToken()
 	case ';': return makeToken(TOKEN_SEMICOLON);
 	case ':': return makeToken(TOKEN_COLON);
 	case ',': return makeToken(TOKEN_COMMA);
-	case '.': return makeToken(TOKEN_DOT);
+	case '.': return makeToken(match('.') ? TOKEN_DOT_DOT : TOKEN_DOT);		// .. for ranges
 	case '-': return makeToken(TOKEN_MINUS);
 	case '+': return makeToken(TOKEN_PLUS);
 	case '*': return makeToken(TOKEN_STAR);
@@ -6,7 +6,7 @@ typedef enum
 	// single character
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,		// ( )
 	TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,		// { }
-	TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+	TOKEN_COMMA, TOKEN_DOT, TOKEN_DOT_DOT, TOKEN_MINUS, TOKEN_PLUS,
 	TOKEN_SEMICOLON, TOKEN_COLON, TOKEN_SLASH, TOKEN_STAR,
 	TOKEN_MODULO,
 
@@ -25,7 +25,7 @@ typedef enum
 	TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH,
 	TOKEN_DEFAULT, TOKEN_CASE, TOKEN_THIS, TOKEN_TRUE, 
 	TOKEN_VAR, TOKEN_WHILE, TOKEN_BREAK, TOKEN_CONTINUE,
-	TOKEN_THEN,
+	TOKEN_THEN, TOKEN_IN,
 
 	// do while, repeat until
 	TOKEN_DO, TOKEN_REPEAT, TOKEN_UNTIL,
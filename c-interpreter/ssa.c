@@ -0,0 +1,932 @@
+#include <string.h>
+
+#include "ssa.h"
+#include "memory.h"
+
+static int addValue(SsaFunction* ssa, SsaValueKind kind, int block, int instruction)
+{
+	if (ssa->valueCount == ssa->valueCapacity)
+	{
+		int oldCapacity = ssa->valueCapacity;
+		ssa->valueCapacity = GROW_CAPACITY(oldCapacity);
+		ssa->values = ARENA_GROW_ARRAY(ssa->arena, SsaValue, ssa->values, oldCapacity, ssa->valueCapacity);
+	}
+
+	SsaValue* value = &ssa->values[ssa->valueCount];
+	value->kind = kind;
+	value->block = block;
+	value->instruction = instruction;
+	value->slot = -1;
+	value->source = -1;
+	value->type = SSA_TYPE_ANY;
+	value->isLive = false;
+	return ssa->valueCount++;
+}
+
+static int addCopy(SsaFunction* ssa, int source, int block, int instruction)
+{
+	int copy = addValue(ssa, VALUE_COPY, block, instruction);
+	ssa->values[copy].source = source;
+	ssa->values[copy].type = 0;
+	return copy;
+}
+
+static void addInput(SsaFunction* ssa, SsaInstruction* instruction, int value)
+{
+	if (ssa->inputCount == ssa->inputCapacity)
+	{
+		int oldCapacity = ssa->inputCapacity;
+		ssa->inputCapacity = GROW_CAPACITY(oldCapacity);
+		ssa->inputs = ARENA_GROW_ARRAY(ssa->arena, int, ssa->inputs, oldCapacity, ssa->inputCapacity);
+	}
+
+	ssa->inputs[ssa->inputCount++] = value;
+	instruction->inputCount++;
+}
+
+static int addBlock(SsaFunction* ssa)
+{
+	if (ssa->blockCount == ssa->blockCapacity)
+	{
+		int oldCapacity = ssa->blockCapacity;
+		ssa->blockCapacity = GROW_CAPACITY(oldCapacity);
+		ssa->blocks = ARENA_GROW_ARRAY(ssa->arena, SsaBlock, ssa->blocks, oldCapacity, ssa->blockCapacity);
+	}
+
+	SsaBlock* block = &ssa->blocks[ssa->blockCount];
+	block->instructions = NULL;
+	block->count = 0;
+	block->capacity = 0;
+	block->depth = 0;
+	block->entry = NULL;
+	block->exit = NULL;
+	block->exitDepth = 0;
+	block->target = -1;
+	block->next = -1;
+	block->preds = NULL;
+	block->predCount = 0;
+	block->order = -1;
+	block->idom = -1;
+	block->preheader = -1;
+	block->isPreheader = false;
+	return ssa->blockCount++;
+}
+
+static int addInstruction(SsaFunction* ssa)
+{
+	if (ssa->instructionCount == ssa->instructionCapacity)
+	{
+		int oldCapacity = ssa->instructionCapacity;
+		ssa->instructionCapacity = GROW_CAPACITY(oldCapacity);
+		ssa->instructions = ARENA_GROW_ARRAY(ssa->arena, SsaInstruction, ssa->instructions, oldCapacity, ssa->instructionCapacity);
+	}
+
+	SsaInstruction* instruction = &ssa->instructions[ssa->instructionCount];
+	instruction->op = OP_POP;
+	instruction->operand = 0;
+	instruction->offset = -1;
+	instruction->length = 1;
+	instruction->line = 0;
+	instruction->block = -1;
+	instruction->value = -1;
+	instruction->inputs = 0;
+	instruction->inputCount = 0;
+	instruction->start = -1;
+	instruction->temp = -1;
+	instruction->isTemp = false;
+	instruction->isRemoved = false;
+	return ssa->instructionCount++;
+}
+
+void appendToBlock(SsaFunction* ssa, int block, int instruction)
+{
+	SsaBlock* to = &ssa->blocks[block];
+	if (to->count == to->capacity)
+	{
+		int oldCapacity = to->capacity;
+		to->capacity = GROW_CAPACITY(oldCapacity);
+		to->instructions = ARENA_GROW_ARRAY(ssa->arena, int, to->instructions, oldCapacity, to->capacity);
+	}
+
+	to->instructions[to->count++] = instruction;
+	ssa->instructions[instruction].block = block;
+}
+
+int addSsaInstruction(SsaFunction* ssa, uint8_t op, uint8_t operand, int line)
+{
+	int index = addInstruction(ssa);
+	SsaInstruction* instruction = &ssa->instructions[index];
+	instruction->op = op;
+	instruction->operand = operand;
+	instruction->length = op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_CONSTANT ? 2 : 1;
+	instruction->line = line;
+	return index;
+}
+
+int addSsaTemp(SsaFunction* ssa)
+{
+	if (ssa->maxDepth + ssa->tempCount + 1 > UINT8_COUNT) return -1;
+	return ssa->tempCount++;
+}
+
+int resolveValue(SsaFunction* ssa, int value)
+{
+	while (ssa->values[value].kind == VALUE_COPY) value = ssa->values[value].source;
+	return value;
+}
+
+int phiOperand(SsaFunction* ssa, int phi, int pred)
+{
+	SsaValue* value = &ssa->values[phi];
+	SsaBlock* block = &ssa->blocks[value->block];
+	return ssa->blocks[block->preds[pred]].exit[value->slot];
+}
+
+bool dominates(SsaFunction* ssa, int a, int b)
+{
+	while (b != -1)
+	{
+		if (b == a) return true;
+		b = ssa->blocks[b].idom;
+	}
+	return false;
+}
+
+// instructions and their jump targets, false for bytecode the analysis cannot follow
+static bool decode(SsaFunction* ssa, int** targetsOut)
+{
+	Chunk* chunk = ssa->chunk;
+	int* indexOf = ARENA_ALLOCATE(ssa->arena, int, chunk->count);
+
+	for (int offset = 0; offset < chunk->count; )
+	{
+		uint8_t op = chunk->code[offset];
+		int length = instructionLength(chunk, offset);
+
+		// captured locals live in upvalues while the closure is open, loads and stores to their slots are not the whole story
+		if (op == OP_CLOSE_UPVALUE)
+		{
+			ARENA_FREE_ARRAY(ssa->arena, int, indexOf, chunk->count);
+			return false;
+		}
+		if (op == OP_CLOSURE)
+		{
+			for (int i = offset + 2; i < offset + length; i += 2)
+			{
+				if (chunk->code[i])
+				{
+					ARENA_FREE_ARRAY(ssa->arena, int, indexOf, chunk->count);
+					return false;
+				}
+			}
+		}
+
+		int index = addInstruction(ssa);
+		SsaInstruction* instruction = &ssa->instructions[index];
+		instruction->op = op;
+		instruction->operand = length > 1 ? chunk->code[offset + 1] : 0;
+		instruction->offset = offset;
+		instruction->length = length;
+		instruction->line = chunk->lines[offset];
+		indexOf[offset] = index;
+		offset += length;
+	}
+
+	int* targets = ARENA_ALLOCATE(ssa->arena, int, ssa->instructionCount);
+	for (int i = 0; i < ssa->instructionCount; i++)
+	{
+		SsaInstruction* instruction = &ssa->instructions[i];
+		targets[i] = -1;
+		if (!isJump(instruction->op)) continue;
+
+		targets[i] = indexOf[jumpTarget(chunk, instruction->offset)];
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, indexOf, chunk->count);
+	*targetsOut = targets;
+	return true;
+}
+
+// blocks start at the first instruction, at jump targets and after jumps and returns
+// -> block 0 is an empty entry block in front of them all, temporaries are set to null there
+static bool splitBlocks(SsaFunction* ssa, int* targets)
+{
+	int count = ssa->instructionCount;
+	bool* isLeader = ARENA_ALLOCATE(ssa->arena, bool, count + 1);
+	memset(isLeader, 0, count + 1);
+
+	isLeader[0] = true;
+	for (int i = 0; i < count; i++)
+	{
+		if (targets[i] != -1) isLeader[targets[i]] = true;
+		if (targets[i] != -1 || ssa->instructions[i].op == OP_RETURN) isLeader[i + 1] = true;
+	}
+
+	addBlock(ssa);
+	ssa->blocks[0].next = 1;
+
+	int* blockOf = ARENA_ALLOCATE(ssa->arena, int, count);
+	for (int i = 0; i < count; i++)
+	{
+		if (isLeader[i]) addBlock(ssa);
+		blockOf[i] = ssa->blockCount - 1;
+		appendToBlock(ssa, ssa->blockCount - 1, i);
+	}
+
+	bool isValid = true;
+	for (int b = 1; b < ssa->blockCount; b++)
+	{
+		SsaBlock* block = &ssa->blocks[b];
+		int last = block->instructions[block->count - 1];
+		uint8_t op = ssa->instructions[last].op;
+
+		if (targets[last] != -1) block->target = blockOf[targets[last]];
+		if (fallsThrough(op))
+		{
+			// endCompiler ends every chunk with a return, running off the end would be a bug
+			if (b + 1 == ssa->blockCount) isValid = false;
+			block->next = b + 1;
+		}
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, blockOf, count);
+	ARENA_FREE_ARRAY(ssa->arena, bool, isLeader, count + 1);
+	return isValid;
+}
+
+// reverse postorder of the blocks reachable from the entry, the others keep order -1
+static void orderBlocks(SsaFunction* ssa)
+{
+	int count = ssa->blockCount;
+	int* stack = ARENA_ALLOCATE(ssa->arena, int, count);
+	int* edge = ARENA_ALLOCATE(ssa->arena, int, count);		// successors of each stacked block already visited
+	bool* isVisited = ARENA_ALLOCATE(ssa->arena, bool, count);
+	int* postorder = ARENA_ALLOCATE(ssa->arena, int, count);
+	memset(isVisited, 0, count);
+
+	int reachable = 0;
+	int top = 0;
+	stack[top] = 0;
+	edge[top++] = 0;
+	isVisited[0] = true;
+
+	while (top > 0)
+	{
+		SsaBlock* block = &ssa->blocks[stack[top - 1]];
+		int successor = -1;
+		while (successor == -1 && edge[top - 1] < 2)
+		{
+			int candidate = edge[top - 1]++ == 0 ? block->target : block->next;
+			if (candidate != -1 && !isVisited[candidate]) successor = candidate;
+		}
+
+		if (successor == -1)
+		{
+			postorder[reachable++] = stack[--top];
+			continue;
+		}
+
+		isVisited[successor] = true;
+		stack[top] = successor;
+		edge[top++] = 0;
+	}
+
+	ssa->rpo = ARENA_ALLOCATE(ssa->arena, int, reachable);
+	ssa->rpoCount = reachable;
+	for (int i = 0; i < reachable; i++)
+	{
+		ssa->rpo[i] = postorder[reachable - 1 - i];
+		ssa->blocks[ssa->rpo[i]].order = i;
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, postorder, count);
+	ARENA_FREE_ARRAY(ssa->arena, bool, isVisited, count);
+	ARENA_FREE_ARRAY(ssa->arena, int, edge, count);
+	ARENA_FREE_ARRAY(ssa->arena, int, stack, count);
+}
+
+static void addPred(SsaFunction* ssa, int block, int pred)
+{
+	SsaBlock* to = &ssa->blocks[block];
+	to->preds = ARENA_GROW_ARRAY(ssa->arena, int, to->preds, to->predCount, to->predCount + 1);
+	to->preds[to->predCount++] = pred;
+}
+
+static int intersect(SsaFunction* ssa, int a, int b)
+{
+	while (a != b)
+	{
+		while (ssa->blocks[a].order > ssa->blocks[b].order) a = ssa->blocks[a].idom;
+		while (ssa->blocks[b].order > ssa->blocks[a].order) b = ssa->blocks[b].idom;
+	}
+	return a;
+}
+
+// Cooper, Harvey and Kennedy's iteration over the reverse postorder, a handful of rounds for structured code
+static void findDominators(SsaFunction* ssa)
+{
+	for (int i = 0; i < ssa->rpoCount; i++)
+	{
+		int b = ssa->rpo[i];
+		SsaBlock* block = &ssa->blocks[b];
+		if (block->target != -1) addPred(ssa, block->target, b);
+		if (block->next != -1 && block->next != block->target) addPred(ssa, block->next, b);
+	}
+
+	ssa->blocks[0].idom = 0;
+	bool isChanged = true;
+	while (isChanged)
+	{
+		isChanged = false;
+		for (int i = 1; i < ssa->rpoCount; i++)
+		{
+			SsaBlock* block = &ssa->blocks[ssa->rpo[i]];
+			int idom = -1;
+			for (int p = 0; p < block->predCount; p++)
+			{
+				int pred = block->preds[p];
+				if (ssa->blocks[pred].idom == -1) continue;		// not reached yet on this round
+				idom = idom == -1 ? pred : intersect(ssa, pred, idom);
+			}
+
+			if (idom != block->idom)
+			{
+				block->idom = idom;
+				isChanged = true;
+			}
+		}
+	}
+	ssa->blocks[0].idom = -1;
+}
+
+// runs one instruction over the abstract stack, false on code that reads below the bottom or past its slots
+static bool simulate(SsaFunction* ssa, int b, int position, int* stack, int* starts, int* depth)
+{
+	int index = ssa->blocks[b].instructions[position];
+	SsaInstruction* instruction = &ssa->instructions[index];
+	Chunk* chunk = ssa->chunk;
+	int top = *depth;
+
+	instruction->inputs = ssa->inputCount;
+	instruction->inputCount = 0;
+
+	int reads = 0;		// values at the top the instruction reads
+	int pops = 0;
+	bool pushes = false;
+
+	switch (instruction->op)
+	{
+	case OP_CONSTANT:
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+	{
+		if (top == UINT8_COUNT) return false;
+		int value = addValue(ssa, VALUE_CONSTANT, b, index);
+		if (instruction->op == OP_CONSTANT)
+		{
+			Value constant = chunk->constants.values[instruction->operand];
+			if (IS_NUMBER(constant)) ssa->values[value].type = SSA_TYPE_NUMBER;
+			else if (IS_STRING(constant)) ssa->values[value].type = SSA_TYPE_STRING;
+		}
+		else ssa->values[value].type = instruction->op == OP_NULL ? SSA_TYPE_OTHER : SSA_TYPE_BOOL;
+
+		instruction->value = value;
+		instruction->start = position;
+		stack[top] = value;
+		starts[top] = position;
+		*depth = top + 1;
+		return true;
+	}
+
+	case OP_GET_LOCAL:
+	{
+		if (instruction->operand >= top || top == UINT8_COUNT) return false;
+		addInput(ssa, instruction, stack[instruction->operand]);
+		instruction->value = addCopy(ssa, stack[instruction->operand], b, index);
+		instruction->start = position;
+		stack[top] = instruction->value;
+		starts[top] = position;
+		*depth = top + 1;
+		return true;
+	}
+
+	case OP_SET_LOCAL:
+	{
+		if (instruction->operand >= top) return false;
+		addInput(ssa, instruction, stack[top - 1]);
+		instruction->value = addCopy(ssa, stack[top - 1], b, index);
+		stack[instruction->operand] = instruction->value;
+		starts[instruction->operand] = -1;
+		return true;
+	}
+
+	// the range bounds are numbers once the loop is entered, the instruction errors otherwise
+	case OP_FOR_RANGE_INIT:
+	{
+		int slot = instruction->operand;
+		if (slot + 1 >= top) return false;
+		for (int i = slot; i <= slot + 1; i++)
+		{
+			addInput(ssa, instruction, stack[i]);
+			stack[i] = addCopy(ssa, stack[i], b, index);
+			ssa->values[stack[i]].type = SSA_TYPE_NUMBER;
+			starts[i] = -1;
+		}
+		return true;
+	}
+
+	case OP_FOR_RANGE:
+	{
+		int slot = instruction->operand;
+		if (slot + 1 >= top) return false;
+		addInput(ssa, instruction, stack[slot]);
+		addInput(ssa, instruction, stack[slot + 1]);
+		instruction->value = addValue(ssa, VALUE_OP, b, index);
+		ssa->values[instruction->value].type = SSA_TYPE_NUMBER;
+		stack[slot] = instruction->value;
+		starts[slot] = -1;
+		return true;
+	}
+
+	// the sequence, the index into it and the element
+	case OP_FOR_ITER:
+	{
+		int slot = instruction->operand;
+		if (slot + 2 >= top) return false;
+		for (int i = slot; i <= slot + 2; i++) addInput(ssa, instruction, stack[i]);
+
+		stack[slot + 1] = addValue(ssa, VALUE_OP, b, index);
+		ssa->values[stack[slot + 1]].type = SSA_TYPE_NUMBER;
+		stack[slot + 2] = addValue(ssa, VALUE_OP, b, index);
+		starts[slot + 1] = -1;
+		starts[slot + 2] = -1;
+		return true;
+	}
+
+	case OP_POP: pops = 1; break;
+
+	case OP_PRINT:
+	case OP_DEFINE_GLOBAL:
+	case OP_METHOD:
+	case OP_LOOP_IF_FALSE:
+	case OP_LOOP_IF_TRUE:
+	case OP_RETURN:
+		reads = 1;
+		pops = 1;
+		break;
+
+	case OP_INHERIT: reads = 2; pops = 1; break;
+
+	case OP_SET_GLOBAL:
+	case OP_SET_UPVALUE:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_TRUE:
+		reads = 1;
+		break;
+
+	case OP_NEGATE:
+	case OP_NOT:
+	case OP_GET_PROPERTY:
+		reads = 1;
+		pops = 1;
+		pushes = true;
+		break;
+
+	case OP_ADD:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MODULO:
+	case OP_EQUAL:
+	case OP_GREATER:
+	case OP_LESS:
+	case OP_SET_PROPERTY:
+	case OP_GET_SUPER:
+		reads = 2;
+		pops = 2;
+		pushes = true;
+		break;
+
+	// keeps the switch value for the next case
+	case OP_SWITCH_EQUAL:
+		reads = 2;
+		pops = 1;
+		pushes = true;
+		break;
+
+	case OP_CALL:
+		reads = pops = instruction->operand + 1;
+		pushes = true;
+		break;
+
+	case OP_INVOKE:
+		reads = pops = chunk->code[instruction->offset + 2] + 1;
+		pushes = true;
+		break;
+
+	case OP_SUPER_INVOKE:
+		reads = pops = chunk->code[instruction->offset + 2] + 2;
+		pushes = true;
+		break;
+
+	// the callee or receiver and the arguments stay for the inlined body or the call
+	case OP_CHECK_FUNCTION:
+	case OP_CHECK_METHOD:
+		reads = chunk->code[instruction->offset + 2] + 1;
+		break;
+
+	case OP_GET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_CLOSURE:
+	case OP_CLASS:
+		pushes = true;
+		break;
+
+	case OP_JUMP:
+	case OP_LOOP:
+		break;
+
+	default:
+		return false;		// OP_CLOSE_UPVALUE was turned away by decode
+	}
+
+	if (reads > top || pops > top) return false;
+	for (int i = top - reads; i < top; i++) addInput(ssa, instruction, stack[i]);
+
+	// a value computed by one run of instructions in this block, from the first push of its operands on
+	int start = position;
+	if (pops > 0) start = reads == pops ? starts[top - pops] : -1;
+
+	top -= pops;
+	if (pushes)
+	{
+		if (top == UINT8_COUNT) return false;
+		instruction->value = addValue(ssa, VALUE_OP, b, index);
+		instruction->start = start;
+		stack[top] = instruction->value;
+		starts[top] = start;
+		top++;
+	}
+
+	*depth = top;
+	return true;
+}
+
+// the stack is run through every block in reverse postorder, so one predecessor at least has been seen before
+static bool buildValues(SsaFunction* ssa)
+{
+	int stack[UINT8_COUNT];
+	int starts[UINT8_COUNT];
+
+	for (int i = 0; i < ssa->rpoCount; i++)
+	{
+		int b = ssa->rpo[i];
+		SsaBlock* block = &ssa->blocks[b];
+
+		int depth = ssa->function->arity + 1;
+		if (b != 0)
+		{
+			int seen = -1;
+			for (int p = 0; p < block->predCount && seen == -1; p++)
+			{
+				if (ssa->blocks[block->preds[p]].order < i) seen = block->preds[p];
+			}
+			if (seen == -1) return false;
+			depth = ssa->blocks[seen].exitDepth;
+		}
+
+		block->depth = depth;
+		block->entry = ARENA_ALLOCATE(ssa->arena, int, depth);
+		for (int slot = 0; slot < depth; slot++)
+		{
+			if (b == 0) block->entry[slot] = addValue(ssa, VALUE_ENTRY, b, -1);
+			else if (block->predCount == 1) block->entry[slot] = ssa->blocks[block->preds[0]].exit[slot];
+			else
+			{
+				block->entry[slot] = addValue(ssa, VALUE_PHI, b, -1);
+				ssa->values[block->entry[slot]].slot = slot;
+			}
+			stack[slot] = block->entry[slot];
+			starts[slot] = -1;
+		}
+
+		for (int position = 0; position < block->count; position++)
+		{
+			if (!simulate(ssa, b, position, stack, starts, &depth)) return false;
+			if (depth > ssa->maxDepth) ssa->maxDepth = depth;
+		}
+
+		block = &ssa->blocks[b];
+		block->exitDepth = depth;
+		block->exit = ARENA_ALLOCATE(ssa->arena, int, depth);
+		memcpy(block->exit, stack, sizeof(int) * depth);
+		if (block->depth > ssa->maxDepth) ssa->maxDepth = block->depth;
+	}
+
+	// a loop back edge or a later jump may arrive with another depth, the compiler never emits one
+	for (int i = 1; i < ssa->rpoCount; i++)
+	{
+		SsaBlock* block = &ssa->blocks[ssa->rpo[i]];
+		for (int p = 0; p < block->predCount; p++)
+		{
+			if (ssa->blocks[block->preds[p]].exitDepth != block->depth) return false;
+		}
+	}
+	return true;
+}
+
+// a phi whose operands are all itself or one other value is a copy of that value
+static void removeTrivialPhis(SsaFunction* ssa)
+{
+	bool isChanged = true;
+	while (isChanged)
+	{
+		isChanged = false;
+		for (int v = 0; v < ssa->valueCount; v++)
+		{
+			SsaValue* phi = &ssa->values[v];
+			if (phi->kind != VALUE_PHI) continue;
+
+			int same = -1;
+			bool isTrivial = true;
+			SsaBlock* block = &ssa->blocks[phi->block];
+			for (int p = 0; p < block->predCount && isTrivial; p++)
+			{
+				int operand = resolveValue(ssa, phiOperand(ssa, v, p));
+				if (operand == v || operand == same) continue;
+				if (same == -1) same = operand;
+				else isTrivial = false;
+			}
+
+			if (!isTrivial || same == -1) continue;
+			phi->kind = VALUE_COPY;
+			phi->source = same;
+			phi->type = 0;
+			isChanged = true;
+		}
+	}
+}
+
+bool buildSsa(SsaFunction* ssa, ObjFunction* function, Arena* arena)
+{
+	ssa->function = function;
+	ssa->chunk = &function->chunk;
+	ssa->arena = arena;
+	ssa->instructions = NULL;
+	ssa->instructionCount = 0;
+	ssa->instructionCapacity = 0;
+	ssa->values = NULL;
+	ssa->valueCount = 0;
+	ssa->valueCapacity = 0;
+	ssa->inputs = NULL;
+	ssa->inputCount = 0;
+	ssa->inputCapacity = 0;
+	ssa->blocks = NULL;
+	ssa->blockCount = 0;
+	ssa->blockCapacity = 0;
+	ssa->rpo = NULL;
+	ssa->rpoCount = 0;
+	ssa->maxDepth = function->arity + 1;
+	ssa->tempCount = 0;
+
+	int* targets = NULL;
+	if (!decode(ssa, &targets)) return false;
+
+	bool isBuilt = splitBlocks(ssa, targets);
+	ARENA_FREE_ARRAY(arena, int, targets, ssa->instructionCount);
+	if (!isBuilt) return false;
+
+	orderBlocks(ssa);
+	findDominators(ssa);
+	if (!buildValues(ssa)) return false;
+
+	removeTrivialPhis(ssa);
+	return true;
+}
+
+void freeSsa(SsaFunction* ssa)
+{
+	for (int b = 0; b < ssa->blockCount; b++)
+	{
+		SsaBlock* block = &ssa->blocks[b];
+		ARENA_FREE_ARRAY(ssa->arena, int, block->instructions, block->capacity);
+		ARENA_FREE_ARRAY(ssa->arena, int, block->entry, block->depth);
+		ARENA_FREE_ARRAY(ssa->arena, int, block->exit, block->exitDepth);
+		ARENA_FREE_ARRAY(ssa->arena, int, block->preds, block->predCount);
+	}
+
+	ARENA_FREE_ARRAY(ssa->arena, int, ssa->rpo, ssa->rpoCount);
+	ARENA_FREE_ARRAY(ssa->arena, SsaBlock, ssa->blocks, ssa->blockCapacity);
+	ARENA_FREE_ARRAY(ssa->arena, int, ssa->inputs, ssa->inputCapacity);
+	ARENA_FREE_ARRAY(ssa->arena, SsaValue, ssa->values, ssa->valueCapacity);
+	ARENA_FREE_ARRAY(ssa->arena, SsaInstruction, ssa->instructions, ssa->instructionCapacity);
+}
+
+// the preheader takes the edges into the loop from outside, values that differ between them meet in its own phis
+int addPreheader(SsaFunction* ssa, int header)
+{
+	if (ssa->blocks[header].preheader != -1) return ssa->blocks[header].preheader;
+
+	SsaBlock* block = &ssa->blocks[header];
+	int outsideCount = 0;
+	for (int p = 0; p < block->predCount; p++)
+	{
+		int pred = block->preds[p];
+		if (!dominates(ssa, header, pred)) outsideCount++;
+		else if (ssa->blocks[pred].next == header) return -1;		// the loop falls into its header, there is no room in front of it
+	}
+	if (outsideCount == 0) return -1;
+
+	int preheader = addBlock(ssa);
+	block = &ssa->blocks[header];
+	SsaBlock* before = &ssa->blocks[preheader];
+
+	before->preds = ARENA_ALLOCATE(ssa->arena, int, outsideCount);
+	int* inside = ARENA_ALLOCATE(ssa->arena, int, block->predCount - outsideCount + 1);
+	int insideCount = 0;
+	for (int p = 0; p < block->predCount; p++)
+	{
+		int pred = block->preds[p];
+		if (dominates(ssa, header, pred)) inside[insideCount++] = pred;
+		else before->preds[before->predCount++] = pred;
+	}
+
+	before->depth = block->depth;
+	before->exitDepth = block->depth;
+	before->entry = ARENA_ALLOCATE(ssa->arena, int, block->depth);
+	before->exit = ARENA_ALLOCATE(ssa->arena, int, block->depth);
+	for (int slot = 0; slot < block->depth; slot++)
+	{
+		int first = ssa->blocks[before->preds[0]].exit[slot];
+		int value = first;
+		bool isSame = true;
+		for (int p = 1; p < before->predCount; p++)
+		{
+			int other = ssa->blocks[before->preds[p]].exit[slot];
+			if (other == first) continue;
+			if (value == first)
+			{
+				value = addValue(ssa, VALUE_PHI, preheader, -1);
+				ssa->values[value].slot = slot;
+			}
+			if (resolveValue(ssa, other) != resolveValue(ssa, first)) isSame = false;
+		}
+
+		// copies of one value stored in different places, as removeTrivialPhis leaves them
+		if (value != first && isSame)
+		{
+			ssa->values[value].kind = VALUE_COPY;
+			ssa->values[value].source = resolveValue(ssa, first);
+		}
+		before->entry[slot] = value;
+		before->exit[slot] = value;
+	}
+
+	for (int p = 0; p < before->predCount; p++)
+	{
+		SsaBlock* pred = &ssa->blocks[before->preds[p]];
+		if (pred->next == header) pred->next = preheader;
+		if (pred->target == header) pred->target = preheader;
+	}
+
+	// the header's phis now take their outside operand from the preheader
+	inside[insideCount++] = preheader;
+	ARENA_FREE_ARRAY(ssa->arena, int, block->preds, block->predCount);
+	block->preds = inside;
+	block->predCount = insideCount;
+
+	before->next = header;
+	before->order = block->order;
+	before->idom = before->predCount == 1 ? before->preds[0] : block->idom;
+	before->isPreheader = true;
+	block->idom = preheader;
+	block->preheader = preheader;
+	return preheader;
+}
+
+static int firstTempSlot(SsaFunction* ssa)
+{
+	return ssa->function->arity + 1;
+}
+
+// slots of the compiled code above the arguments move up past the temporaries
+static uint8_t emittedSlot(SsaFunction* ssa, SsaInstruction* instruction)
+{
+	if (instruction->isTemp) return (uint8_t)(firstTempSlot(ssa) + instruction->operand);
+	if (instruction->operand < firstTempSlot(ssa)) return instruction->operand;
+	return (uint8_t)(instruction->operand + ssa->tempCount);
+}
+
+static bool isKept(SsaFunction* ssa, int b, int index)
+{
+	SsaInstruction* instruction = &ssa->instructions[index];
+	return instruction->block == b && !instruction->isRemoved;
+}
+
+static int emittedLength(SsaInstruction* instruction)
+{
+	return instruction->length + (instruction->temp != -1 ? 2 : 0);
+}
+
+bool emitSsa(SsaFunction* ssa)
+{
+	Arena* arena = ssa->arena;
+	int* layout = ARENA_ALLOCATE(arena, int, ssa->blockCount);
+	int* blockStart = ARENA_ALLOCATE(arena, int, ssa->blockCount);
+	int layoutCount = 0;
+
+	// the compiled order, with each preheader right in front of its loop
+	for (int b = 0; b < ssa->blockCount; b++)
+	{
+		SsaBlock* block = &ssa->blocks[b];
+		if (block->order == -1 || block->isPreheader) continue;
+		if (block->preheader != -1) layout[layoutCount++] = block->preheader;
+		layout[layoutCount++] = b;
+	}
+
+	int size = 0;
+	bool isValid = true;
+	for (int i = 0; i < layoutCount; i++)
+	{
+		int b = layout[i];
+		SsaBlock* block = &ssa->blocks[b];
+		blockStart[b] = size;
+		if (b == 0) size += ssa->tempCount;
+
+		for (int j = 0; j < block->count; j++)
+		{
+			if (isKept(ssa, b, block->instructions[j])) size += emittedLength(&ssa->instructions[block->instructions[j]]);
+		}
+
+		// falling through needs the next block right after, the layout keeps the compiled order so it always is
+		if (block->next != -1 && (i + 1 == layoutCount || layout[i + 1] != block->next)) isValid = false;
+	}
+
+	uint8_t* code = ARENA_ALLOCATE(arena, uint8_t, size);
+	int* lines = ARENA_ALLOCATE(arena, int, size);
+	int offset = 0;
+
+	for (int i = 0; i < layoutCount && isValid; i++)
+	{
+		int b = layout[i];
+		SsaBlock* block = &ssa->blocks[b];
+
+		// temporaries start out null so the slots above them keep their places
+		for (int t = 0; b == 0 && t < ssa->tempCount; t++)
+		{
+			code[offset] = OP_NULL;
+			lines[offset++] = ssa->instructions[0].line;
+		}
+
+		for (int j = 0; j < block->count; j++)
+		{
+			int index = block->instructions[j];
+			if (!isKept(ssa, b, index)) continue;
+
+			SsaInstruction* instruction = &ssa->instructions[index];
+			int end = offset + instruction->length;
+			for (int k = offset; k < offset + emittedLength(instruction); k++) lines[k] = instruction->line;
+
+			code[offset] = instruction->op;
+			if (instruction->length > 1) code[offset + 1] = hasSlotOperand(instruction->op) ? emittedSlot(ssa, instruction) : instruction->operand;
+			for (int k = 2; k < instruction->length; k++) code[offset + k] = ssa->chunk->code[instruction->offset + k];
+
+			if (isJump(instruction->op))
+			{
+				int to = blockStart[block->target];
+				if (instruction->op == OP_JUMP || instruction->op == OP_LOOP) code[offset] = to >= end ? OP_JUMP : OP_LOOP;
+
+				int distance = isBackward(code[offset]) ? end - to : to - end;
+				if (distance < 0 || distance > UINT16_MAX)
+				{
+					isValid = false;
+					break;
+				}
+				code[end - 2] = (distance >> 8) & 0xff;
+				code[end - 1] = distance & 0xff;
+			}
+
+			offset = end;
+			if (instruction->temp != -1)
+			{
+				code[offset++] = OP_SET_LOCAL;
+				code[offset++] = (uint8_t)(firstTempSlot(ssa) + instruction->temp);
+			}
+		}
+	}
+
+	// written to the chunk only once every jump fits
+	if (isValid)
+	{
+		Chunk* chunk = ssa->chunk;
+		chunk->count = 0;
+		for (int i = 0; i < size; i++) writeChunk(chunk, code[i], lines[i]);
+	}
+
+	ARENA_FREE_ARRAY(arena, int, lines, size);
+	ARENA_FREE_ARRAY(arena, uint8_t, code, size);
+	ARENA_FREE_ARRAY(arena, int, blockStart, ssa->blockCount);
+	ARENA_FREE_ARRAY(arena, int, layout, ssa->blockCount);
+	return isValid;
+}
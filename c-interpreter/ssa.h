@@ -0,0 +1,131 @@
+// the intermediate representation of the optimizer, a function's bytecode lifted into a control flow graph in SSA form
+// -> the compiler has no tree to work from, so the graph is built from the finished chunk: the instructions are split
+//	into basic blocks at jumps and jump targets, and the operand stack is run abstractly through every block
+// -> locals live on the stack like temporaries, so every stack slot is a variable; each push, store and phi makes a new
+//	value, and a block entered from several blocks gets a phi for every slot, the phis that merge one value are removed
+// -> instructions keep their bytecode form, passes rewrite them in place, remove them, or move them into the
+//	preheaders of loops, and emitSsa writes the graph back over the chunk
+// -> a function is left as compiled when its bytecode is out of reach of the analysis: locals captured by closures,
+//	blocks entered at different stack depths, or too many slots once temporaries are added
+
+#ifndef ssa_h
+#define ssa_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+#include "arena.h"
+
+// the types a value can have at run time
+#define SSA_TYPE_NUMBER 0x1
+#define SSA_TYPE_STRING 0x2
+#define SSA_TYPE_BOOL 0x4
+#define SSA_TYPE_OTHER 0x8			// null and every object but strings
+#define SSA_TYPE_ANY 0xf
+
+typedef enum
+{
+	VALUE_ENTRY,		// in a slot when the function starts, the callee or receiver and the arguments
+	VALUE_CONSTANT,		// loaded by OP_CONSTANT, OP_NULL, OP_TRUE or OP_FALSE
+	VALUE_OP,			// result of an instruction, opaque unless the instruction is pure
+	VALUE_PHI,			// a slot at the entry of a block with several predecessors
+	VALUE_COPY,			// same value as source, from OP_GET_LOCAL, OP_SET_LOCAL or a removed phi
+} SsaValueKind;
+
+typedef struct
+{
+	SsaValueKind kind;
+	int block;				// block the value is defined in
+	int instruction;		// instruction defining it, -1 for entry values and phis
+	int slot;				// phis, the stack slot they merge, kept when they turn out to be copies
+	int source;				// copies, the value copied
+	uint8_t type;			// SSA_TYPE_ bits, copies have none until the optimizer infers them unless their instruction checks the type
+	bool isLive;			// read by something that is kept, see markLiveValues
+} SsaValue;
+
+typedef struct
+{
+	uint8_t op;
+	uint8_t operand;		// first operand byte: slot, constant index or argument count, a temporary for synthetic loads and stores
+	int offset;				// in the chunk as compiled, for the other operand bytes, -1 for synthetic instructions
+	int length;
+	int line;
+
+	int block;				// block it is emitted in, changed when it is hoisted
+	int value;				// value pushed, or stored by OP_SET_LOCAL, -1 if none
+	int inputs;				// first of its input values in SsaFunction.inputs
+	int inputCount;			// values popped or read, slot reads of OP_GET_LOCAL and the loop instructions included
+	int start;				// index in the block of the first instruction computing the value pushed, -1 if it began in another block
+
+	int temp;				// temporary the value is also stored in, -1 for none
+	bool isTemp;			// the operand is a temporary, not a slot of the compiled code
+	bool isRemoved;
+} SsaInstruction;
+
+typedef struct
+{
+	int* instructions;		// in emitted order, entries whose instruction moved to another block are skipped
+	int count;
+	int capacity;
+
+	int depth;				// stack slots in use on entry
+	int* entry;				// value in every slot on entry
+	int* exit;				// value in every slot when the block is left, the phi operands of its successors
+	int exitDepth;
+
+	int target;				// block a jump at its end goes to, -1 if it ends without one
+	int next;				// block it falls through to, -1 if it cannot
+	int* preds;
+	int predCount;
+
+	int order;				// reverse postorder position
+	int idom;				// immediate dominator, -1 for the entry block
+	int preheader;			// block inserted before this loop header, -1 for none
+	bool isPreheader;
+} SsaBlock;
+
+typedef struct
+{
+	ObjFunction* function;
+	Chunk* chunk;
+	Arena* arena;
+
+	SsaInstruction* instructions;
+	int instructionCount;
+	int instructionCapacity;
+
+	SsaValue* values;
+	int valueCount;
+	int valueCapacity;
+
+	int* inputs;
+	int inputCount;
+	int inputCapacity;
+
+	SsaBlock* blocks;		// entry block first, the others in the order of the compiled code
+	int blockCount;
+	int blockCapacity;
+
+	int* rpo;				// reachable blocks in reverse postorder, preheaders are not in it
+	int rpoCount;
+	int maxDepth;			// most stack slots the compiled code uses at once
+	int tempCount;			// slots added for values kept across instructions, right after the arguments
+} SsaFunction;
+
+// builds the graph, false if the function is left as compiled
+bool buildSsa(SsaFunction* ssa, ObjFunction* function, Arena* arena);
+void freeSsa(SsaFunction* ssa);
+
+int resolveValue(SsaFunction* ssa, int value);		// follows copies to the value they carry
+int phiOperand(SsaFunction* ssa, int phi, int pred);		// value a phi takes from the pred-th predecessor of its block
+bool dominates(SsaFunction* ssa, int a, int b);
+
+int addSsaInstruction(SsaFunction* ssa, uint8_t op, uint8_t operand, int line);		// synthetic, placed by the caller
+int addSsaTemp(SsaFunction* ssa);					// a new temporary slot, -1 if the frame has no room left
+void appendToBlock(SsaFunction* ssa, int block, int instruction);
+int addPreheader(SsaFunction* ssa, int header);		// -1 if the header cannot get one
+
+// writes the graph back over the chunk, false when it does not fit in the instruction formats
+bool emitSsa(SsaFunction* ssa);
+
+#endif
@@ -17,8 +17,9 @@ void writeValueArray(ValueArray* array, Value value)
 	if (array->capacity < array->count + 1)
 	{
 		int oldCapacity = array->capacity;
-		array->capacity = GROW_CAPACITY(oldCapacity);
-		array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+		int capacity = GROW_CAPACITY(oldCapacity);
+		array->values = GROW_ARRAY(Value, array->values, oldCapacity, capacity);		// capacity after, growing may fail
+		array->capacity = capacity;
 	}
 
 	array->values[array->count] = value;
@@ -57,7 +58,10 @@ bool valuesEqual(Value a, Value b)
 	case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
 	case VAL_NULL: return true;				// true for all nulls
-	case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);		// already interned, occupies the same address
+	case VAL_OBJ:
+		// interned strings occupy the same address, string views have to be compared by contents
+		if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+		return AS_OBJ(a) == AS_OBJ(b);
 	default:
 		return false;		// unreachable
 	}
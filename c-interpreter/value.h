@@ -85,6 +85,13 @@ typedef struct
 
 bool valuesEqual(Value a, Value b);			// comparison function used in the VM
 
+// comparison for OP_NOT, also used by natives taking flags
+static inline bool isFalsey(Value value)
+{
+	// return true if value is the null type or if it is a false bool type
+	return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
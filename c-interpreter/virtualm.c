@@ -1,22 +1,22 @@
 #include <stdarg.h>	// for variadic functions, va_list
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
 
 #include "common.h"
 #include "object.h"
 #include "memory.h"
 #include "compiler.h"
 #include "debug.h"
+#include "heapsnap.h"
+#include "native.h"
 #include "virtualm.h"
 
 // initialize virtual machine here
 VM vm;
 
-static Value clockNative(int argCount, Value* args)
-{
-	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);		// returns elapsed time since program was running
-}
+// error raised from inside a native function, picked up by callValue after the native returns
+static bool hasNativeError = false;
+static char nativeErrorMessage[256];
 
 // forward declartion of run
 static InterpretResult run();
@@ -71,20 +71,23 @@ static void runtimeError(const char* format, ...)
 	resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function)
+Value nativeError(const char* format, ...)
 {
-	push(OBJ_VAL(copyString(name, (int)strlen(name))));			// strlen to get char* length
-	push(OBJ_VAL(newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-	pop();
-	pop();
+	va_list args;
+	va_start(args, format);
+	vsnprintf(nativeErrorMessage, sizeof(nativeErrorMessage), format, args);
+	va_end(args);
+
+	hasNativeError = true;
+	return NULL_VAL;
 }
 
 
 void initVM()
 {
 	resetStack();			// initialiing the Value stack, also initializing the callframe count
-	vm.objects = NULL;
+	initHeap(&vm.heap);
+	initHeap(&vm.buffers);
 	initTable(&vm.globals);
 	initTable(&vm.strings);
 
@@ -95,22 +98,63 @@ void initVM()
 
 	// self adjusting heap to control frequency of GC
 	vm.bytesAllocated = 0;
-	vm.nextGC = 1024 * 1024;
+	vm.memoryError = NULL;
+
+	// generational garbage collection
+	vm.generational = true;
+	vm.youngCapacity = 0;
+	vm.youngCount = 0;
+	vm.youngObjects = NULL;
+	vm.youngBytes = 0;
+	vm.isMinorGC = false;
+	vm.isSweeping = false;
+	vm.sweepCursor = NULL;
+	vm.sweepBefore = 0;
+	vm.rememberedCapacity = 0;
+	vm.rememberedCount = 0;
+	vm.remembered = NULL;
+	vm.rememberedOverflow = false;
+	vm.weakCapacity = 0;
+	vm.weakCount = 0;
+	vm.weakObjects = NULL;
+
+	// incremental marking
+	vm.incremental = true;
+	vm.isMarking = false;
+	vm.sliceBytes = 0;
+	vm.markSliceWork = 1000;
+	vm.markSliceTime = 0.0005;		// half a millisecond
+	vm.maxPause = 0;
+	initGCStats(&vm.gcStats);
+	initProfiler(&vm.profiler);
+
+	// parallel marking
+	vm.lastMarkTime = 0;
+
+	// compaction
+	vm.compactThreshold = 0.5;
+	vm.compactPending = false;
+
+	// heap sizes, marking threads and compaction, an embedding program may change them after initVM
+	GCConfig config;
+	defaultGCConfig(&config);
+	configureGC(&config);
 
 
 	// init initalizer string
 	vm.initString = NULL;
 	vm.initString = copyString("init", 4);
 
-	defineNative("clock", clockNative);
+	defineNatives();		// from native.c
 }
 
 void freeVM()
 {
 	vm.initString = NULL;
-	freeObjects();		// free all objects, from vm.objects
 	freeTable(&vm.globals);
 	freeTable(&vm.strings);
+	freeObjects();		// free all objects, from vm.heap, and the buffers heap with them
+	freeProfiler(&vm.profiler);
 }
 
 /* stack operations */
@@ -165,6 +209,29 @@ static bool call(ObjClosure* closure, int argCount)
 	return true;
 }
 
+void defaultGCConfig(GCConfig* config)
+{
+	config->heapGrowFactor = 2;
+	config->initialHeap = 1024 * 1024;
+	config->minHeap = 0;
+	config->maxHeap = 0;
+	config->threads = 1;
+	config->compacting = false;
+}
+
+void configureGC(const GCConfig* config)
+{
+	vm.heapGrowFactor = config->heapGrowFactor < 1 ? 1 : config->heapGrowFactor;		// below 1 every allocation would collect
+	vm.minHeap = config->minHeap;
+	vm.maxHeap = config->maxHeap;
+	vm.gcThreads = config->threads < 1 ? 1 : config->threads > GC_MAX_THREADS ? GC_MAX_THREADS : config->threads;
+	vm.compacting = config->compacting;
+
+	vm.nextGC = config->initialHeap < vm.minHeap ? vm.minHeap : config->initialHeap;
+	if (vm.maxHeap != 0 && vm.nextGC > vm.maxHeap) vm.nextGC = vm.maxHeap;
+}
+
+
 static bool callValue(Value callee, int argCount)
 {
 	if (IS_OBJ(callee))
@@ -205,6 +272,14 @@ static bool callValue(Value callee, int argCount)
 		{
 			NativeFn native = AS_NATIVE(callee);
 			Value result = native(argCount, vm.stackTop - argCount);
+
+			if (hasNativeError)
+			{
+				hasNativeError = false;
+				runtimeError("%s", nativeErrorMessage);
+				return false;
+			}
+
 			vm.stackTop -= argCount + 1;				// remove call and arguments from the stack
 			push(result);
 			return true;
@@ -334,6 +409,7 @@ static void closeUpvalues(Value* last)			// takes pointer to stack slot
 		ObjUpvalue* upvalue = vm.openUpvalues;	// pointer to list of openupvalues
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		WRITE_BARRIER(upvalue, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
@@ -344,20 +420,13 @@ static void defineMethod(ObjString* name)
 	Value method = peek(0);				// method/closure is at the top of the stack
 	ObjClass* kelas = AS_CLASS(peek(1));	// class is at the 2nd top
 	tableSet(&kelas->methods, name, method);	// add to hashtable
+	WRITE_BARRIER(kelas, OBJ_VAL(name));
+	WRITE_BARRIER(kelas, method);
 	pop();				// pop the method
 }
 
 
 
-// comparison for OP_NOT
-static bool isFalsey(Value value)
-{
-	// return true if value is the null type or if it is a false bool type
-	bool test = IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
-
-	return test;
-}
-
 // string concatenation
 static void concatenate()
 {
@@ -385,10 +454,42 @@ static void concatenate()
 
 
 /* starting point of the compiler */
+// an allocation failed and jumped back to interpret, the collector has already freed every unreachable object
+// the script is stopped like on any other runtime error, what it left on the stack is dropped
+static InterpretResult outOfMemoryError(int reason)
+{
+	vm.memoryError = NULL;
+	abortCompile();			// the compiler may have been running, its unfinished functions become garbage
+
+	if (vm.frameCount == 0)			// while compiling, no frame to report a line for
+	{
+		fprintf(stderr, "Out of memory.\n");
+		resetStack();
+	}
+	else if (reason == OUT_OF_MEMORY_LIMIT)
+	{
+		runtimeError("Out of memory, the heap is limited to %zu bytes.", vm.maxHeap);
+	}
+	else
+	{
+		runtimeError("Out of memory.");
+	}
+	return INTERPRET_RUNTIME_ERROR;
+}
+
 InterpretResult interpret(const char* source)
 {
+	jmp_buf memoryError;
+	int reason = setjmp(memoryError);
+	if (reason != 0) return outOfMemoryError(reason);
+	vm.memoryError = &memoryError;
+
 	ObjFunction* function = compile(source);
-	if (function == NULL) return INTERPRET_COMPILE_ERROR;		// NULL gets passed from compiler
+	if (function == NULL)		// NULL gets passed from compiler
+	{
+		vm.memoryError = NULL;
+		return INTERPRET_COMPILE_ERROR;
+	}
 
 	push(OBJ_VAL(function));
 	ObjClosure* closure = newClosure(function);
@@ -396,8 +497,9 @@ InterpretResult interpret(const char* source)
 	push(OBJ_VAL(closure));
 	callValue(OBJ_VAL(closure), 0);			// 0 params for main()
 
-
-	return run();
+	InterpretResult result = run();
+	vm.memoryError = NULL;
+	return result;
 }
 
 
@@ -418,6 +520,14 @@ READ STRING:
 	return as object string, read directly from the vm(oip)
 */
 
+// objects may only move where the interpreter holds no object pointer in a C local: at backward jumps and returns
+// heap snapshots asked for by the user signal are taken there too, the stack holds every live value
+#define SAFE_POINT() \
+	do {	\
+		if (vm.compactPending) compactHeap();	\
+		if (heapSnapshotRequested) takeRequestedSnapshot();	\
+	} while (false)
+
 #define READ_BYTE() (*frame->ip++)		
 #define READ_CONSTANT()		\
 	(frame->closure->function->chunk.constants.values[READ_BYTE()])	
@@ -622,7 +732,9 @@ READ STRING:
 			case OP_SET_UPVALUE:
 			{
 				uint8_t slot = READ_BYTE();		// read index
-				*frame->closure->upvalues[slot]->location = peek(0);		// set to the topmost stack
+				ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+				*upvalue->location = peek(0);		// set to the topmost stack
+				WRITE_BARRIER(upvalue, peek(0));		// only matters once the upvalue is closed
 				break;
 			}
 			
@@ -663,7 +775,10 @@ READ STRING:
 
 				// not top most, as the top most is reserved for the new value to be set
 				ObjInstance* instance = AS_INSTANCE(peek(1));		
-				tableSet(&instance->fields, READ_STRING(), peek(0));		//peek(0) is the new value
+				ObjString* name = READ_STRING();
+				tableSet(&instance->fields, name, peek(0));		//peek(0) is the new value
+				WRITE_BARRIER(instance, OBJ_VAL(name));
+				WRITE_BARRIER(instance, peek(0));
 
 				Value value = pop();		// pop the already set value
 				pop();		// pop the property instance itself
@@ -696,10 +811,18 @@ READ STRING:
 				break;
 			}
 
+			case OP_JUMP_IF_TRUE:
+			{
+				uint16_t offset = READ_SHORT();
+				if (!isFalsey(peek(0))) frame->ip += offset;
+				break;
+			}
+
 			case OP_LOOP:
 			{
 				uint16_t offset = READ_SHORT();
 				frame->ip -= offset;		// jumps back
+				SAFE_POINT();
 				break;
 			}
 
@@ -710,6 +833,7 @@ READ STRING:
 				// if false loop back
 				if (isFalsey(peek(0))) frame->ip -= offset;
 				pop();			// pop the true/false
+				SAFE_POINT();
 				break;
 			}
 
@@ -720,6 +844,79 @@ READ STRING:
 				// if not false loop back
 				if (!isFalsey(peek(0))) frame->ip -= offset;
 				pop();			// pop the true/false
+				SAFE_POINT();
+				break;
+			}
+
+			// for in loops; slot is the first loop local, the counter or the sequence
+			case OP_FOR_RANGE_INIT:
+			{
+				uint8_t slot = READ_BYTE();
+				uint16_t offset = READ_SHORT();
+				Value* counter = &frame->slots[slot];		// end of the range is right above the counter
+
+				if (!IS_NUMBER(counter[0]) || !IS_NUMBER(counter[1]))
+				{
+					runtimeError("Range bounds must be numbers.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				if (!(AS_NUMBER(counter[0]) < AS_NUMBER(counter[1]))) frame->ip += offset;		// empty range
+				break;
+			}
+
+			case OP_FOR_RANGE:
+			{
+				uint8_t slot = READ_BYTE();
+				uint16_t offset = READ_SHORT();
+				Value* counter = &frame->slots[slot];
+
+				if (!IS_NUMBER(counter[0]))		// the body may have assigned to the loop variable
+				{
+					runtimeError("Loop variable must be a number.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				double next = AS_NUMBER(counter[0]) + 1;
+				counter[0] = NUMBER_VAL(next);
+				if (next < AS_NUMBER(counter[1])) frame->ip -= offset;		// loop back to the body
+				SAFE_POINT();
+				break;
+			}
+
+			case OP_FOR_ITER:
+			{
+				uint8_t slot = READ_BYTE();
+				uint16_t offset = READ_SHORT();
+				Value* locals = &frame->slots[slot];		// sequence, index, loop variable
+				Value sequence = locals[0];
+				size_t index = (size_t)AS_NUMBER(locals[1]);
+
+				if (IS_STRING(sequence))
+				{
+					ObjString* string = AS_STRING(sequence);
+					if (index < (size_t)string->length)
+					{
+						locals[2] = OBJ_VAL(copyString(string->chars + index, 1));
+					}
+					else frame->ip += offset;
+				}
+				else if (IS_BYTES(sequence))
+				{
+					ObjBytes* bytes = AS_BYTES(sequence);
+					if (index < bytes->length)
+					{
+						locals[2] = NUMBER_VAL(bytes->data[index]);
+					}
+					else frame->ip += offset;
+				}
+				else
+				{
+					runtimeError("Only strings and byte buffers can be iterated.");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				locals[1] = NUMBER_VAL((double)(index + 1));
 				break;
 			}
 
@@ -758,6 +955,9 @@ READ STRING:
 					{
 						closure->upvalues[i] = frame->closure->upvalues[index];				// get from current upvalue
 					}
+
+					// capturing allocates, the closure may have been promoted already
+					WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
 				}
 
 				break;
@@ -796,6 +996,8 @@ READ STRING:
 
 				ObjClass* child = AS_CLASS(peek(0));		// child class at the top of the stack
 				tableAddAll(&AS_CLASS(parent)->methods, &child->methods);	// add all methods from parent to child table
+				if (child->obj.isOld) rememberObject((Obj*)child);		// write barrier for every copied method
+				WRITE_BARRIER(child, parent);		// while marking, the parent's table holds the same methods
 				pop();				// pop the child class
 				break;
 			}
@@ -824,6 +1026,31 @@ READ STRING:
 				break;
 			}
 
+			// an inlined call runs in this frame when the callee is the function it was inlined from, the call is
+			// left behind the body for every other callee
+			case OP_CHECK_FUNCTION:
+			{
+				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+				Value callee = peek(READ_BYTE());
+				uint16_t offset = READ_SHORT();
+				if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function != function) frame->ip += offset;
+				break;
+			}
+
+			// the same lookup invoke() makes, a field of the name comes before the method
+			case OP_CHECK_METHOD:
+			{
+				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+				Value receiver = peek(READ_BYTE());
+				uint16_t offset = READ_SHORT();
+
+				Value method;
+				bool isExpected = IS_INSTANCE(receiver) && !tableGet(&AS_INSTANCE(receiver)->fields, function->name, &method) &&
+					tableGet(&AS_INSTANCE(receiver)->kelas->methods, function->name, &method) && AS_CLOSURE(method)->function == function;
+				if (!isExpected) frame->ip += offset;
+				break;
+			}
+
 			case OP_RETURN:				
 			{
 				Value result = pop();	// if function returns a value, value will beon top of the stack
@@ -833,7 +1060,7 @@ READ STRING:
 				vm.frameCount--;
 				if (vm.frameCount == 0)		// return from 'main()'/script function
 				{
-					pop();						// pop main script function from the stack
+					vm.stackTop = frame->slots;		// the script function, and the temporaries of -O that sit above it
 					return INTERPRET_OK;
 				}
 
@@ -843,12 +1070,14 @@ READ STRING:
 				push(result);		// push the return value
 
 				frame = &vm.frames[vm.frameCount - 1];		// update run function's current frame
+				SAFE_POINT();
 				break;
 			}
 		}
 	}
 
 
+#undef SAFE_POINT
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
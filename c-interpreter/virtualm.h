@@ -5,15 +5,23 @@
 #ifndef virtualm_h
 #define virtualm_h
 
+#include <setjmp.h>
+
 #include "object.h"
 #include "chunk.h"
+#include "gcstats.h"
 #include "hasht.h"
+#include "heap.h"
+#include "profiler.h"
 #include "value.h"
 
 // max frames is fixed
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)		
 
+// most threads used to mark the heap
+#define GC_MAX_THREADS 64
+
 
 // the call stack
 // keep track where on the stack a function's local begin, where the caller should resume, etc.
@@ -42,8 +50,50 @@ typedef struct
 
 	ObjUpvalue* openUpvalues;		// track all upvalues; points to the first node of the linked list
 
-	Obj* objects;		// pointer to the header of the Obj itself/node, start of the list
-						// nicely used in GARBAGE COLLECTION, where objects are nicely erased in the middle
+	Heap heap;			// every object lives in the size class pages of the heap
+	Heap buffers;		// arrays owned by objects, up to MAX_CELL_SIZE bytes, larger ones come from realloc
+
+	// generational garbage collection, objects allocated since the last collection are young
+	bool generational;			// minor collections over young objects only
+	int youngCapacity;			// objects allocated since the last collection, the rest of the heap is old
+	int youngCount;
+	Obj** youngObjects;
+	size_t youngBytes;			// bytes allocated since the last collection, triggers minor collections
+	bool isMinorGC;				// a minor collection is running, old objects count as marked
+
+	// lazy sweeping, pages of the last collection that were not swept yet
+	bool isSweeping;			// collections wait until the sweep is done
+	Page** sweepCursor;			// link to the next page to sweep, pages still to be swept keep their marks
+	size_t sweepBefore;			// bytes allocated when the sweep started
+
+	// old objects that had a young object written into them by the write barrier
+	int rememberedCapacity;
+	int rememberedCount;
+	Obj** remembered;
+	bool rememberedOverflow;	// the list could not grow, the next collection has to be a full one
+
+	// weak references and weak maps, cleared by every collection, see memory.c
+	int weakCapacity;
+	int weakCount;
+	Obj** weakObjects;
+
+	// incremental marking, a full collection marks the heap in slices between allocations
+	bool incremental;			// full collections are incremental instead of stopping the program until they finish
+	bool isMarking;				// an incremental cycle is running, new objects are allocated marked
+	size_t sliceBytes;			// bytes allocated since the last marking slice
+	int markSliceWork;			// most gray objects blackened in one slice
+	double markSliceTime;		// most seconds spent in one slice, 0 for no time limit
+	double maxPause;			// longest time in seconds the program was stopped by the collector
+	GCStats gcStats;			// collections, pauses, freed bytes and live objects, see gcstats.h
+	Profiler profiler;			// sampling allocation profiler, see profiler.h
+
+	int gcThreads;				// threads marking the heap during the stop-the-world part of a collection
+
+	// compaction, objects of sparse pages are moved together and the emptied pages given back
+	bool compacting;			// compaction is allowed
+	double compactThreshold;	// share of the page memory a compaction must give back before one is run
+	bool compactPending;		// the next safe point of the interpreter compacts the heap
+	double lastMarkTime;		// seconds spent marking in the last full collection
 
 	// stack to store gray marked Objects for garbage collection
 	int grayCapacity;		
@@ -53,8 +103,30 @@ typedef struct
 	// self-adjusting-g-heap, to control frequency of GC, bytesAllocated is the running total
 	size_t bytesAllocated;		// size_t is a 32 bit(integer/4bytes), represents size of an object in bytes
 	size_t nextGC;				// threhsold that triggers the GC
+	double heapGrowFactor;		// nextGC is the heap left by a full collection times this
+	size_t minHeap;				// nextGC never drops below it
+	size_t maxHeap;				// most bytes the program may allocate, 0 for no limit
+
+	jmp_buf* memoryError;		// where interpret resumes when an allocation fails, NULL outside of it
 } VM;
 
+// garbage collector settings, for programs that embed the vm
+// fill them in with defaultGCConfig, change what is needed and apply them with configureGC after initVM
+typedef struct
+{
+	double heapGrowFactor;		// a full collection starts once the heap has grown this many times since the last one
+	size_t initialHeap;			// bytes allocated before the first full collection
+	size_t minHeap;				// full collections never start below this many bytes
+	size_t maxHeap;				// most bytes the program may allocate, 0 for no limit
+	int threads;				// threads marking the heap, at most GC_MAX_THREADS
+	bool compacting;			// objects may be moved to give sparse pages back
+} GCConfig;
+
+// an allocation over maxHeap, or one the system cannot satisfy even after a full collection, stops the script
+// with a runtime error, interpret returns INTERPRET_RUNTIME_ERROR and the vm can run the next script
+#define OUT_OF_MEMORY_LIMIT 1
+#define OUT_OF_MEMORY_SYSTEM 2
+
 // rseult that responds from the running VM
 typedef enum
 {
@@ -67,6 +139,9 @@ typedef enum
 void initVM();
 void freeVM();
 
+void defaultGCConfig(GCConfig* config);
+void configureGC(const GCConfig* config);
+
 // interpret/run chunks and return enum
 // changed from interpreting chunks to interpreting strings
 InterpretResult interpret(const char* source);
@@ -77,4 +152,7 @@ extern VM vm;		// use extern, declare as global variable
 void push(Value value);
 Value pop();
 
+// for native functions; reports a runtime error once the native returns, the returned value is discarded
+Value nativeError(const char* format, ...);
+
 #endif
\ No newline at end of file
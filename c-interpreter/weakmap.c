@@ -0,0 +1,120 @@
+#include <stdint.h>
+
+#include "memory.h"
+#include "weakmap.h"
+
+// like the hash tables, tombstones count towards the load
+#define WEAK_MAP_MAX_LOAD 0.75
+
+// addresses are aligned, the low bits carry nothing, multiplying mixes the rest into the high bits
+static uint32_t hashObject(Obj* object)
+{
+	uint64_t address = (uint64_t)(uintptr_t)object;
+	return (uint32_t)((address * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+static WeakEntry* findWeakEntry(WeakEntry* entries, int capacity, Obj* key)
+{
+	uint32_t index = hashObject(key) & (capacity - 1);		// capacities are powers of two
+	WeakEntry* tombstone = NULL;
+
+	for (;;)
+	{
+		WeakEntry* entry = &entries[index];
+		if (entry->key == NULL)
+		{
+			if (IS_NULL(entry->value)) return tombstone != NULL ? tombstone : entry;
+			if (tombstone == NULL) tombstone = entry;
+		}
+		else if (entry->key == key)
+		{
+			return entry;
+		}
+
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+// moves the entries into a new array, dropping the tombstones, and places them by their current addresses
+static void adjustCapacity(ObjWeakMap* map, int capacity)
+{
+	WeakEntry* entries = ALLOCATE(WeakEntry, capacity);
+	for (int i = 0; i < capacity; i++)
+	{
+		entries[i].key = NULL;
+		entries[i].value = NULL_VAL;
+	}
+
+	// the allocation may have run a collection that dropped entries, the old array is read afterwards
+	map->count = 0;
+	for (int i = 0; i < map->capacity; i++)
+	{
+		WeakEntry* entry = &map->entries[i];
+		if (entry->key == NULL) continue;
+
+		WeakEntry* destination = findWeakEntry(entries, capacity, entry->key);
+		*destination = *entry;
+		map->count++;
+	}
+
+	FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+	map->entries = entries;
+	map->capacity = capacity;
+	map->tombstones = 0;
+	map->isStale = false;
+}
+
+static void rehashIfStale(ObjWeakMap* map)
+{
+	if (map->isStale) adjustCapacity(map, map->capacity);
+}
+
+bool weakMapGet(ObjWeakMap* map, Obj* key, Value* value)
+{
+	if (map->count == 0) return false;
+	rehashIfStale(map);
+
+	WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+	if (entry->key == NULL) return false;
+
+	*value = entry->value;
+	return true;
+}
+
+void weakMapSet(ObjWeakMap* map, Obj* key, Value value)
+{
+	if (map->count + map->tombstones + 1 > map->capacity * WEAK_MAP_MAX_LOAD)
+	{
+		adjustCapacity(map, GROW_CAPACITY(map->capacity));
+	}
+	else
+	{
+		rehashIfStale(map);
+	}
+
+	// neither the key nor the value go through the write barrier, traceWeak looks at every entry of a live map
+	WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+	if (entry->key == NULL)
+	{
+		map->count++;
+		if (!IS_NULL(entry->value)) map->tombstones--;		// a tombstone is reused
+	}
+
+	entry->key = key;
+	entry->value = value;
+}
+
+bool weakMapDelete(ObjWeakMap* map, Obj* key)
+{
+	if (map->count == 0) return false;
+	rehashIfStale(map);
+
+	WeakEntry* entry = findWeakEntry(map->entries, map->capacity, key);
+	if (entry->key == NULL) return false;
+
+	entry->key = NULL;
+	entry->value = BOOL_VAL(true);
+	map->count--;
+	map->tombstones++;
+	return true;
+}
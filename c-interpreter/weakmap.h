@@ -0,0 +1,18 @@
+// weak keyed maps, open addressing tables keyed by object identity
+// -> the collector drops entries whose key died, like tableRemoveWhite does for the interned strings, and marks
+//	a value only once its key is reached (ephemerons), see traceWeak in memory.c
+// -> keys are hashed by address, compaction moves them and leaves the map stale until the next lookup rehashes it
+
+#ifndef weakmap_h
+#define weakmap_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// maps, keys and values must be reachable(e.g. on the stack) as growing the table can trigger the garbage collector
+bool weakMapGet(ObjWeakMap* map, Obj* key, Value* value);
+void weakMapSet(ObjWeakMap* map, Obj* key, Value value);
+bool weakMapDelete(ObjWeakMap* map, Obj* key);
+
+#endif